@@ -21,15 +21,21 @@
 #include <v8-platform.h>
 #include <v8.h>
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <future>
+#include <list>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+typedef struct flex_tokenizer flex_tokenizer;
+
 namespace openrasp_v8 {
 
 constexpr int max_buffer_size = 4 * 1024 * 1024;
@@ -76,7 +82,7 @@ class Platform : public v8::Platform {
   // v8::platform::DefaultPlatform implementation.
   bool PumpMessageLoop(v8::Isolate* isolate,
                        v8::platform::MessageLoopBehavior behavior = v8::platform::MessageLoopBehavior::kDoNotWait);
-  // void RunIdleTasks(v8::Isolate* isolate, double idle_time_in_seconds);
+  void RunIdleTasks(v8::Isolate* isolate, double idle_time_in_seconds);
 
   // v8::Platform implementation.
   int NumberOfWorkerThreads() override;
@@ -85,8 +91,8 @@ class Platform : public v8::Platform {
   void CallDelayedOnWorkerThread(std::unique_ptr<v8::Task> task, double delay_in_seconds) override;
   void CallOnForegroundThread(v8::Isolate* isolate, v8::Task* task) override;
   void CallDelayedOnForegroundThread(v8::Isolate* isolate, v8::Task* task, double delay_in_seconds) override;
-  // void CallIdleOnForegroundThread(v8::Isolate* isolate, v8::IdleTask* task) override;
-  // bool IdleTasksEnabled(v8::Isolate* isolate) override;
+  void CallIdleOnForegroundThread(v8::Isolate* isolate, v8::IdleTask* task) override;
+  bool IdleTasksEnabled(v8::Isolate* isolate) override;
   double MonotonicallyIncreasingTime() override;
   double CurrentClockTimeMillis() override;
   v8::TracingController* GetTracingController() override;
@@ -117,6 +123,144 @@ class PluginFile {
   std::string source;
 };
 
+// 生成快照前用来预热检测函数的一次检测调用，params是json
+class WarmupCall {
+ public:
+  WarmupCall(const std::string& type, const std::string& params) : type(type), params(params){};
+  std::string type;
+  std::string params;
+};
+
+// 检测点名称到id的映射，进程内所有isolate共用同一套id，id只增不减
+// 只在isolate初始化或宿主启动时访问，检测时使用id，不必再查找名称
+class CheckPointRegistry {
+ public:
+  static int Register(const std::string& name);
+  static int Lookup(const std::string& name);
+  static int Size();
+  static std::string GetName(int id);
+
+ private:
+  static std::mutex mtx;
+  static std::unordered_map<std::string, int> ids;
+  static std::vector<std::string> names;
+};
+
+// 检测的结果分类，用于Metrics计数
+enum MetricsOutcome {
+  kMetricsIgnore = 0,
+  kMetricsLog,
+  kMetricsBlock,
+  kMetricsOther,      // 其他action或者返回了promise
+  kMetricsException,  // 插件抛出异常
+  kMetricsTimeout,    // 看门狗超时中断
+  kMetricsTerminated,  // 其他原因被中断，通常是内存超限
+  kMetricsSkipped,     // 连续超时被暂停调用，不计入calls和耗时
+  kMetricsOutcomeSize
+};
+
+// 进程内所有isolate共用的检测统计，按检测点和插件分别记录调用次数、结果分类和耗时分布
+// 每个线程固定写入一个分片，计数都是relaxed原子操作，热路径上没有锁，读取时合并所有分片
+// 耗时直方图按2的幂分段，每段再线性分为8份，单位微秒，分位数的相对误差不超过12.5%
+class Metrics {
+ public:
+  static constexpr int max_check_points = 128;
+  static constexpr int max_plugins = 64;  // 插件id从1开始，0表示整个检测点
+  static constexpr int histogram_size = 232;
+  struct Entry {
+    std::string check_point;
+    std::string plugin;  // 为空时是整个检测点的统计
+    uint64_t calls;
+    uint64_t outcomes[kMetricsOutcomeSize];
+    uint64_t p50;  // 微秒
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+    uint64_t total_time;  // 累计耗时，微秒
+    uint64_t cpu_time;    // 开启profiling期间累计的线程CPU时间，微秒
+  };
+  static int RegisterPlugin(const std::string& name);
+  static std::string GetPluginName(int id);
+  static void Record(int check_point,
+                     int plugin,
+                     int64_t nanoseconds,
+                     MetricsOutcome outcome,
+                     int64_t cpu_nanoseconds = 0);
+  static void RecordOom();
+  static uint64_t GetOomCount();
+  static std::vector<Entry> Collect();
+  // {"oom":0,"entries":[{"check_point":"...","plugin":"...","calls":0,"ignore":0,...,"p50":0,...}]}
+  static std::string ToJson();
+  // 按CPU时间（未开启profiling时按累计耗时）从高到低返回前n个插件在各检测点的统计
+  static std::vector<Entry> TopPlugins(size_t n);
+  static std::string TopPluginsJson(size_t n);
+  // profiling需要额外读取线程CPU时间，默认关闭
+  static void SetProfiling(bool enable);
+  static bool IsProfiling();
+  static int64_t ThreadCpuTime();  // 纳秒
+  static void Reset();
+  static int HistogramIndex(uint64_t microseconds);
+  static uint64_t HistogramValue(int index);  // 下标对应区间的上界
+};
+
+// 按输入缓存flex_tokenize的结果，同一条sql语句反复出现时不必重新扫描
+// 每个isolate一份，按最近最少使用淘汰，占用的字节数不超过budget
+class TokenCache {
+ public:
+  static uint64_t Key(const char* input, size_t length, int type);
+  const std::vector<uint32_t>* Get(uint64_t key, const char* input, size_t length, int type);
+  void Put(uint64_t key, const char* input, size_t length, int type, const uint32_t* offsets, size_t count);
+  void Trim(size_t budget);  // 淘汰最久未使用的结果，直到占用不超过budget
+  void Clear() { Trim(0); }
+  size_t GetSize() const { return size; }
+  size_t GetCount() const { return entries.size(); }
+
+  static size_t budget;  // 每个isolate的缓存上限，为0时不缓存
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+
+ private:
+  struct Entry {
+    uint64_t key;
+    int type;
+    std::string input;
+    std::vector<uint32_t> offsets;
+    size_t Size() const { return sizeof(Entry) + input.size() + offsets.size() * sizeof(uint32_t); }
+  };
+  std::list<Entry> entries;  // 最近使用的在前
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+  size_t size = 0;
+};
+
+// 插件通过RASP.register注册的检测函数，Isolate::Initialize和ExecScript后从RASP.checkPoints中取出
+// v8::Persistent不能放进vector，所以这里使用可移动的v8::Global
+class CheckProcess {
+ public:
+  static int max_timeouts;  // 连续超时达到该次数后暂停调用，不大于0时不暂停，默认为0
+  static int cooldown_ms;   // 暂停调用的时长
+  int plugin_id = 0;                     // Metrics中的插件id
+  int timeouts = 0;                      // 连续超时的次数，正常返回后清零
+  int64_t skip_until = 0;                // 在此之前跳过该检测函数，Watchdog::Now()的时间
+  v8::Global<v8::Function> func;         // 检测函数
+  v8::Global<v8::Object> receiver;       // 调用检测函数时的this，与RASP.check保持一致
+  v8::Global<v8::Object> plugin;         // 插件对象
+  v8::Global<v8::Function> make_result;  // 插件的make_result方法
+};
+
+// RASP.request在请求线程完成后通知检测线程，检测等待promise时阻塞在这里而不是轮询
+// 请求线程可能在isolate销毁后才完成，所以由shared_ptr持有
+class RequestSignal {
+ public:
+  void Notify();
+  // 有未消费的通知时返回true，超过timeout纳秒仍没有通知时返回false
+  bool WaitFor(int64_t timeout);
+
+ private:
+  std::mutex mtx;
+  std::condition_variable cv;
+  size_t count = 0;
+};
+
 // v8::Isolate只能通过v8::Isolate::New工厂函数创建，所以下面v8::Isolate的子类openrasp::Isolate不能增加对象
 // 只能通过v8::Isolate::SetData方法向其对象绑定数据
 // IsolateData是需要绑定到Isolate的数据的集合
@@ -130,20 +274,60 @@ class IsolateData {
   v8::Persistent<v8::Function> console_log;    // 缓存方法，调用时不必到js中获取
   v8::Persistent<v8::Object> request_context;  // 在一个请求生命周期内缓存的插件context对象
   v8::Persistent<v8::ObjectTemplate> request_context_templ;  // 插件context对象的构造模版
+  v8::Persistent<v8::ObjectTemplate> flat_params_templ;      // 扁平params对象的构造模版
   v8::HeapStatistics hs;                                     // 保存v8堆栈采样信息的对象
   std::unordered_set<std::string> check_points;              // 所有检测点名称
-  bool is_timeout = false;                                   // 超时标志
+  std::unordered_map<std::string, int> check_point_ids;      // 检测点名称到CheckPointRegistry中id的映射
+  std::vector<std::vector<CheckProcess>> check_tables;       // 以检测点id为下标的检测函数表
+  double check_points_generation = -1;                       // 展开检测函数表时的RASP.checkPointsGeneration
+  v8::Persistent<v8::String> key_action;                     // 缓存"action"
+  v8::Persistent<v8::String> str_ignore;                     // 缓存"ignore"
+  v8::Persistent<v8::String> str_log;                        // 缓存"log"
+  v8::Persistent<v8::String> str_block;                      // 缓存"block"
+  std::atomic<bool> is_timeout{false};                       // 超时标志
+  std::atomic<int64_t> deadline{0};                          // 当前检测的截止时间，由Watchdog监视
   bool is_oom = false;                                       // 内存满标志
+  bool is_warmup = false;                                    // 生成快照前的预热中，网络请求直接失败
+  size_t oom_threshold = 20 * 1024 * 1024;                   // 堆使用超过后终止执行，取自MemoryProfile
+  int64_t gc_start = 0;                                      // 当前GC开始的时间
+  uint64_t gc_count = 0;                                     // GC次数
+  uint64_t gc_time = 0;                                      // GC累计停顿时间，纳秒
+  uint64_t max_gc_pause = 0;                                 // 单次GC最长停顿时间，纳秒
+  uint64_t idle_gc_count = 0;                                // 在IdleNotification中完成的GC次数
   uint64_t timestamp = 0;                                    // 创建时间
+  const char* flat_params = nullptr;                         // 当前检测的扁平params数据，由宿主持有
+  size_t flat_params_size = 0;                               // 扁平params数据长度
+  uint32_t flat_params_id = 0;                               // 每次释放扁平params后递增，使之前创建的对象失效
+  std::shared_ptr<flex_tokenizer> tokenizer;                 // flex_tokenize复用的tokenizer，首次使用时创建
+  TokenCache token_cache;                                    // flex_tokenize的结果缓存
+  std::unordered_map<uint64_t, v8::Global<v8::Promise::Resolver>> pending_requests;  // 未完成的RASP.request
+  std::shared_ptr<RequestSignal> request_signal = std::make_shared<RequestSignal>();  // RASP.request完成的通知
   void* custom_data = nullptr;                               // php或java环境中额外非公共的数据
 };
 
 // v8::StartupData是一个构造好的js运行环境的快照
+// 快照文件头，载入时先比较头部，不兼容的快照直接拒绝，不必等到v8::Isolate::New时崩溃
+// 整数均为本机字节序，头部之后是v8的快照数据
+struct SnapshotHeader {
+  char magic[8];                      // "ORV8SNAP"
+  uint32_t format_version;            // 文件格式版本，字节序不同时也不相等
+  uint32_t header_size;               // sizeof(SnapshotHeader)
+  uint64_t v8_version_hash;           // v8::V8::GetVersion()
+  uint64_t flags_hash;                // Initialize设置的v8 flags
+  uint64_t external_references_hash;  // native方法表
+  uint64_t plugin_digest;             // 生成快照时的内置js、v8 flags、配置、插件和版本号
+  uint64_t data_size;                 // 快照数据长度
+  uint32_t checksum;                  // 快照数据的crc32
+  uint32_t reserved;
+};
+
 // Snapshot增加了数据保存和载入方法
 class Snapshot : public v8::StartupData {
  public:
   uint64_t timestamp = 0;
+  uint64_t plugin_digest = 0;
   static intptr_t* external_references;
+  static uint64_t flags_hash;
   Snapshot() = delete;
   Snapshot(const char* data, size_t raw_size, uint64_t timestamp);
   Snapshot(const std::string& path, uint64_t timestamp);
@@ -156,6 +340,54 @@ class Snapshot : public v8::StartupData {
   bool Save(const std::string& path) const;  // check errno when return value is false
   bool IsOk() const { return data && raw_size; };
   bool IsExpired(uint64_t timestamp) const { return timestamp > this->timestamp; };
+  void FillHeader(SnapshotHeader& header) const;
+  static bool IsCompatible(const SnapshotHeader& header);
+  static uint64_t Hash(const char* data, size_t size, uint64_t seed = 14695981039346656037ULL);
+  static uint32_t Crc32(const char* data, size_t size);
+  // 按plugin_digest缓存生成的快照，内容相同时不再执行插件，directory为空时不使用文件缓存
+  static void ConfigCache(const std::string& directory, bool in_memory);
+  // corpus不为空时，生成快照前先执行这些检测调用，并保留编译后的代码，新isolate的首次检测不必再编译，快照会更大
+  // 预热中RASP.request直接reject，RASP.request_async被忽略；检测函数修改的插件状态会随快照进入所有isolate
+  static void ConfigWarmup(const std::vector<WarmupCall>& corpus);
+
+ private:
+  bool Load(const std::string& path, uint64_t digest = 0);
+  bool LoadFromCache();
+  void SaveToCache() const;
+  void* mapping = nullptr;  // 从文件载入时映射的地址，data指向头部之后
+  size_t mapping_size = 0;
+};
+
+// 检测结果的二进制编码，宿主读取结果时不必再经过JSON序列化和解析
+// 每条结果依次为（整数均为本机字节序）：
+//   uint8  action      ResultAction
+//   uint8  flags       ResultFlag
+//   uint16 保留
+//   int32  confidence
+//   uint32 name长度，name（utf8）
+//   uint32 message长度，message（utf8）
+//   uint32 json长度，整个结果对象的json    仅当flags含kResultHasJson
+enum ResultAction : uint8_t { kResultLog = 0, kResultBlock = 1, kResultIgnore = 2, kResultException = 3, kResultOther = 255 };
+enum ResultFlag : uint8_t { kResultHasJson = 1 };
+
+// 扁平params的编码，宿主不必把params序列化成json，插件访问到某个属性时才从原始数据中解码
+// 每个key/value依次为（整数均为本机字节序）：
+//   uint32 key长度，key（utf8）
+//   uint8  value类型   FlatParamType
+//   uint32 value长度，value（utf8）
+enum FlatParamType : uint8_t { kFlatString = 0, kFlatJson = 1 };
+
+// isolate的内存配置，按部署场景在Initialize之前选择
+// 默认与之前的行为相同：每次GC都压缩整个堆，关闭新生代，最省内存但GC停顿更长
+// 关闭stress_compaction后新生代恢复工作，短命对象由scavenge回收，吞吐更高，占用更多内存
+struct MemoryProfile {
+  size_t max_old_space_mb = 0;   // 老生代上限，0使用v8默认值
+  size_t max_semi_space_kb = 0;  // 新生代semi space上限，0使用v8默认值
+  size_t oom_threshold_mb = 20;  // 堆使用超过后终止isolate
+  bool stress_compaction = true;
+  std::string Flags() const;
+  static MemoryProfile Compact();
+  static MemoryProfile Throughput();
 };
 
 // v8::Isolate是一个独立的js运行环境，使用时必须绑定到线程
@@ -163,6 +395,16 @@ class Snapshot : public v8::StartupData {
 class Isolate : public v8::Isolate {
  public:
   static Isolate* New(Snapshot* snapshot_blob, uint64_t timestamp);
+  // 检测函数连续超时max_timeouts次后暂停调用cooldown_ms，max_timeouts不大于0时不暂停，默认不暂停
+  static void ConfigPluginBudget(int max_timeouts, int cooldown_ms);
+  // 必须在Initialize之前调用，之后的调用被忽略并返回false，GC相关的v8 flags是进程全局的
+  static bool ConfigMemoryProfile(const MemoryProfile& profile);
+  static const MemoryProfile& GetMemoryProfile();
+  // 按MemoryProfile和环境变量OPENRASP_V8_OPTIONS设置v8 flags，由Initialize调用，只生效一次
+  static void ApplyFlags();
+  // 请求之间的空闲时间，budget_ms不大于0时不执行
+  static void ConfigIdleBudget(int budget_ms);
+  static int GetIdleBudget();
   Isolate() = delete;
   ~Isolate() = delete;
   void Initialize();
@@ -181,14 +423,39 @@ class Isolate : public v8::Isolate {
                                   v8::Local<v8::Object> request_params,
                                   v8::Local<v8::Object> request_context,
                                   int timeout = 100);
+  // check_point是CheckPointRegistry中的id，直接按检测函数表调用，不经过js中的RASP.check
+  v8::MaybeLocal<v8::Array> Check(v8::Local<v8::Context> context,
+                                  int check_point,
+                                  v8::Local<v8::Object> request_params,
+                                  v8::Local<v8::Object> request_context,
+                                  int timeout = 100);
+  // 由扁平params数据创建params对象，data在ReleaseFlatParams之前必须保持有效
+  v8::MaybeLocal<v8::Object> NewFlatParams(v8::Local<v8::Context> context, const char* data, size_t size);
+  // 检测结束后调用，之后再访问未解码的属性得到undefined
+  void ReleaseFlatParams();
+  // 把Check的结果编码到buffer，返回编码后的总长度，大于capacity时buffer中的内容无效
+  size_t WriteResults(v8::Local<v8::Context> context, v8::Local<v8::Array> results, char* buffer, size_t capacity);
   v8::MaybeLocal<v8::Value> ExecScript(const std::string& source, const std::string& filename, int line_offset = 0);
   v8::MaybeLocal<v8::Value> ExecScript(v8::Local<v8::String> source,
                                        v8::Local<v8::String> filename,
                                        v8::Local<v8::Integer> line_offset);
   v8::MaybeLocal<v8::Value> Log(v8::Local<v8::Value> value);
+  // 请求结束后调用，在budget_ms内执行v8的空闲任务和增量GC，把GC停顿移出检测过程
+  // 堆使用超过oom_threshold的3/4时先通知内存压力，开始增量标记
+  // 返回true表示v8已经没有可做的GC工作
+  bool IdleNotification(int budget_ms);
+  bool IdleNotification() { return IdleNotification(idle_budget_ms); }
+
+ private:
+  void BuildCheckTables(v8::Local<v8::Context> context);
+
+  static MemoryProfile memory_profile;
+  static std::atomic<bool> flags_applied;
+  static int idle_budget_ms;
 };
 
 // 中断超时的js执行，任务在v8::Platform的后台线程池中执行
+// Isolate::Check已改用Watchdog，保留给需要单独控制超时的调用方
 class TimeoutTask : public v8::Task {
  public:
   TimeoutTask(Isolate* isolate, std::future<void> fut, int milliseconds = 100);
@@ -200,18 +467,78 @@ class TimeoutTask : public v8::Task {
   std::chrono::time_point<std::chrono::high_resolution_clock> time_point;
 };
 
+// 检测超时看门狗，所有isolate共用一个后台线程
+// 检测开始和结束时只是存取isolate上的原子截止时间，只有真正超时时看门狗线程才会调用TerminateExecution
+class Watchdog {
+ public:
+  static Watchdog& GetInstance();
+  static int64_t Now();
+  void Start();
+  void Stop();
+  void Register(Isolate* isolate);
+  void Unregister(Isolate* isolate);
+  void Arm(IsolateData* data, int milliseconds);
+  void ArmAt(IsolateData* data, int64_t deadline);  // deadline是Now()的绝对时间
+  void Disarm(IsolateData* data);
+
+ private:
+  Watchdog() = default;
+  void Run();
+  void Scan(int64_t now);
+
+  static constexpr int64_t firing = -1;                   // 看门狗正在中断该isolate
+  static constexpr int64_t resolution = 5 * 1000 * 1000;  // 扫描间隔，纳秒
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::vector<Isolate*> isolates;
+  std::thread thread;
+  bool running = false;
+};
+
+// RASP.request和request_async共用的curl连接池的统计
+struct HTTPClientStats {
+  uint64_t requests;            // 发出的请求数
+  uint64_t handles;             // 创建的curl handle数
+  uint64_t new_connections;     // 新建连接的请求数
+  uint64_t reused_connections;  // 复用已有连接的请求数
+  uint64_t waits;               // 因同一host并发数达到上限而等待的次数
+  uint64_t rejects;             // 等待超时放弃的请求数
+  size_t active;                // 正在进行的请求数
+  size_t idle;                  // 空闲的curl handle数
+};
+
+// request_async合并队列的统计
+struct RequestBatchStats {
+  uint64_t queued;   // 进入合并队列的请求数
+  uint64_t batches;  // 合并后发出的请求数
+  uint64_t dropped;  // 队列已满被丢弃的请求数
+  size_t pending;    // 等待合并的请求数
+};
+
 // 为异步request请求提供线程池和队列
 class ThreadPool;
+struct ThreadPoolStats;
 class HTTPRequest;
+class HTTPResponse;
 class AsyncRequest {
  public:
   AsyncRequest(std::shared_ptr<ThreadPool> pool);
   bool Submit(std::shared_ptr<HTTPRequest> request);
+  // 在线程池中完成请求后调用callback，队列已满时返回false
+  bool Submit(std::shared_ptr<HTTPRequest> request, std::function<void(HTTPResponse&)> callback);
   size_t GetQueueSize();
+  HTTPClientStats GetClientStats();
+  RequestBatchStats GetBatchStats();
+  ThreadPoolStats GetPoolStats();
 
   static void ConfigInstance(size_t pool_size, size_t queue_cap);
+  // max_idle为保留的空闲curl handle数，max_per_host为同一host同时进行的请求数上限
+  static void ConfigClient(size_t max_idle, size_t max_per_host);
+  // 配置了batch的请求最多等待window_ms毫秒，等待中的数据超过max_bytes时立即发出
+  static void ConfigBatch(size_t window_ms, size_t max_bytes);
   static AsyncRequest& GetInstance();
-  static void Terminate();
+  // drain_ms大于0时先等待队列中的请求完成，最多等待drain_ms毫秒
+  static void Terminate(size_t drain_ms = 0);
 
  private:
   std::shared_ptr<ThreadPool> pool;
@@ -221,13 +548,7 @@ class AsyncRequest {
 
 // v8整体（不是isolate）初始化过程
 inline bool Initialize(size_t pool_size, Logger logger, size_t request_pool_size = 1, size_t request_queue_cap = 100) {
-  // 这两个flag关闭新生代，只使用老生代，更省内存
-  std::string flags = "--stress-compaction --stress-compaction-random ";
-  const char* env = std::getenv("OPENRASP_V8_OPTIONS");
-  if (env) {
-    flags += env;
-  }
-  v8::V8::SetFlagsFromString(flags.data(), flags.size());
+  Isolate::ApplyFlags();
   Platform::logger = logger;
   v8::V8::InitializePlatform(Platform::New(pool_size));
   // v8::V8::SetDcheckErrorHandler([](const char* file, int line, const char* message) {
@@ -246,7 +567,7 @@ inline bool Initialize(size_t pool_size, Logger logger, size_t request_pool_size
 }
 
 inline bool Dispose() {
-  AsyncRequest::GetInstance().Terminate();
+  AsyncRequest::Terminate(1000);
   bool rst = v8::V8::Dispose();
   v8::V8::ShutdownPlatform();
   return rst;
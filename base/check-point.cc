@@ -0,0 +1,50 @@
+/*
+ * Copyright 2017-2019 Baidu Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bundle.h"
+
+namespace openrasp_v8 {
+
+std::mutex CheckPointRegistry::mtx;
+std::unordered_map<std::string, int> CheckPointRegistry::ids;
+std::vector<std::string> CheckPointRegistry::names;
+
+int CheckPointRegistry::Register(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto rst = ids.emplace(name, ids.size());
+  if (rst.second) {
+    names.push_back(name);
+  }
+  return rst.first->second;
+}
+
+int CheckPointRegistry::Lookup(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = ids.find(name);
+  return it == ids.end() ? -1 : it->second;
+}
+
+int CheckPointRegistry::Size() {
+  std::lock_guard<std::mutex> lock(mtx);
+  return ids.size();
+}
+
+std::string CheckPointRegistry::GetName(int id) {
+  std::lock_guard<std::mutex> lock(mtx);
+  return id >= 0 && id < names.size() ? names[id] : std::string();
+}
+
+}  // namespace openrasp_v8
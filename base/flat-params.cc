@@ -0,0 +1,115 @@
+/*
+ * Copyright 2017-2019 Baidu Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include <limits>
+#include "bundle.h"
+
+namespace openrasp_v8 {
+
+// 属性首次被访问时才解码，data是value在扁平数据中的偏移，创建时已校验过边界
+static void flat_param_getter(v8::Local<v8::Name> name, const v8::PropertyCallbackInfo<v8::Value>& info) {
+  auto isolate = reinterpret_cast<Isolate*>(info.GetIsolate());
+  auto data = isolate->GetData();
+  auto id = info.Holder()->GetInternalField(0).As<v8::Integer>()->Value();
+  // 检测已经结束，宿主的数据可能已经释放
+  if (UNLIKELY(id != data->flat_params_id || !data->flat_params)) {
+    return;
+  }
+  const char* ptr = data->flat_params + info.Data().As<v8::Integer>()->Value();
+  uint8_t type = ptr[0];
+  uint32_t length;
+  memcpy(&length, ptr + 1, sizeof(length));
+  v8::Local<v8::String> str;
+  if (!v8::String::NewFromUtf8(isolate, ptr + 5, v8::NewStringType::kNormal, length).ToLocal(&str)) {
+    return;
+  }
+  if (type == kFlatJson) {
+    v8::Local<v8::Value> value;
+    if (v8::JSON::Parse(isolate->GetCurrentContext(), str).ToLocal(&value)) {
+      info.GetReturnValue().Set(value);
+    }
+    return;
+  }
+  info.GetReturnValue().Set(str);
+}
+
+v8::MaybeLocal<v8::Object> Isolate::NewFlatParams(v8::Local<v8::Context> context, const char* data, size_t size) {
+  auto isolate = this;
+  v8::EscapableHandleScope handle_scope(isolate);
+  auto isolate_data = isolate->GetData();
+  if (UNLIKELY((!data && size) || size > std::numeric_limits<uint32_t>::max())) {
+    return {};
+  }
+  if (isolate_data->flat_params_templ.IsEmpty()) {
+    auto templ = v8::ObjectTemplate::New(isolate);
+    templ->SetInternalFieldCount(1);
+    isolate_data->flat_params_templ.Reset(isolate, templ);
+  }
+  v8::Local<v8::Object> params;
+  if (!isolate_data->flat_params_templ.Get(isolate)->NewInstance(context).ToLocal(&params)) {
+    return {};
+  }
+  // 之前创建的对象不能再访问新的数据
+  uint32_t id = ++isolate_data->flat_params_id;
+  params->SetInternalField(0, v8::Integer::NewFromUnsigned(isolate, id));
+
+  size_t offset = 0;
+  while (offset < size) {
+    uint32_t key_length, value_length;
+    if (size - offset < sizeof(key_length)) {
+      return {};
+    }
+    memcpy(&key_length, data + offset, sizeof(key_length));
+    offset += sizeof(key_length);
+    if (size - offset < key_length) {
+      return {};
+    }
+    const char* key = data + offset;
+    offset += key_length;
+    size_t value_offset = offset;
+    if (size - offset < 1 + sizeof(value_length)) {
+      return {};
+    }
+    uint8_t type = data[offset];
+    memcpy(&value_length, data + offset + 1, sizeof(value_length));
+    offset += 1 + sizeof(value_length);
+    if (size - offset < value_length || value_length > max_buffer_size || type > kFlatJson) {
+      return {};
+    }
+    offset += value_length;
+    v8::Local<v8::String> name;
+    if (!v8::String::NewFromUtf8(isolate, key, v8::NewStringType::kInternalized, key_length).ToLocal(&name) ||
+        params
+            ->SetLazyDataProperty(context, name, flat_param_getter,
+                                  v8::Integer::NewFromUnsigned(isolate, value_offset))
+            .IsNothing()) {
+      return {};
+    }
+  }
+  isolate_data->flat_params = data;
+  isolate_data->flat_params_size = size;
+  return handle_scope.Escape(params);
+}
+
+void Isolate::ReleaseFlatParams() {
+  auto data = GetData();
+  data->flat_params = nullptr;
+  data->flat_params_size = 0;
+  data->flat_params_id++;
+}
+
+}  // namespace openrasp_v8
@@ -721,6 +721,7 @@ static yyconst flex_int16_t yy_chk[805] =
 #define YY_RESTORE_YY_MORE_OFFSET
 #line 1 "flexLexer/lex.l"
 #line 2 "flexLexer/lex.l"
+#include "flex.h"
 
 typedef enum flex_mode
 {
@@ -736,24 +737,38 @@ typedef enum flex_mode
 typedef struct mode_info {
     flex_mode mode_type;
     flex_uint32_t parentheses_count;//未匹配的括号数量
-    mode_info * next;//下一个mode_info节点
 } mode_info;
 
+#define INLINE_MODE_DEPTH 64
+
 typedef struct token_info {
-    const char * mode; //存储使用的tokenize规则，为sql或bash
+    flex_tokenizer_type type; //存储使用的tokenize规则，为sql或bash
     flex_uint32_t * result; //存储token起止下标在输入字符串上的位置，格式为[token1_start_pos,token1_stop_pos, token2_start_pos,token2_stop_pos ...]
     flex_uint32_t result_len; //当前result已申请的内存大小
     const char * input; //当前输入字符串
     flex_uint32_t crt_input_pos; //当前输入字符串已分析的长度
     flex_uint32_t crt_input_unicode_pos; //当前输入字符串已分析的unicode字符数
     flex_uint32_t crt_result_pos; //当前result数组长度
-    mode_info * mode_info_ptr;//记录flex_mode当前状态信息的堆栈
+    flex_uint32_t is_ascii; //输入全部是ascii时，utf8下标就是unicode下标，不必转换
+    mode_info * mode_info_ptr;//当前flex_mode状态信息，指向modes的栈顶
+    mode_info * modes;//记录flex_mode状态信息的堆栈，通常指向inline_modes，嵌套过深时才申请内存
+    flex_uint32_t mode_depth;//modes中的元素数量
+    flex_uint32_t mode_cap;//modes可容纳的元素数量
+    mode_info inline_modes[INLINE_MODE_DEPTH];
 } token_info;
 
 
 #line 40 "flexLexer/lex.l"
 #include <stdlib.h>
-#include "flex.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline int ctz32(int mask) { unsigned long index; _BitScanForward(&index, mask); return (int)index; }
+#else
+static inline int ctz32(int mask) { return __builtin_ctz(mask); }
+#endif
+#endif
 
 #ifdef _WIN32
 #define YY_NO_UNISTD_H
@@ -820,59 +835,54 @@ static inline int isatty(int desc) { return 0; }
     }
 
 static flex_uint32_t init_mode(token_info * yyext, flex_mode mode_type){
-    mode_info* init_mode_info_ptr = (mode_info*)malloc(sizeof(mode_info));
-    if(init_mode_info_ptr == NULL){
-        return -1;
-    }
-    init_mode_info_ptr->mode_type = mode_type;
-    init_mode_info_ptr->parentheses_count = 0;
-    init_mode_info_ptr->next = NULL;
-    yyext->mode_info_ptr = init_mode_info_ptr;
+    yyext->modes[0].mode_type = mode_type;
+    yyext->modes[0].parentheses_count = 0;
+    yyext->mode_depth = 1;
+    yyext->mode_info_ptr = yyext->modes;
     return 0;
 }
 
 static void free_mode(token_info * yyext){
-    mode_info* next_ptr = yyext->mode_info_ptr;
-    mode_info* crt_ptr;
-    while(next_ptr != NULL){
-        crt_ptr = next_ptr;
-        next_ptr = next_ptr->next;
-        free(crt_ptr);
-    }
+    yyext->mode_depth = 0;
+    yyext->mode_info_ptr = NULL;
     return;
 }
 
 static flex_uint32_t bash_push_mode(token_info * yyext, flex_mode next_mode){
-    mode_info * new_mode = (mode_info*)malloc(sizeof(mode_info));
-    if(new_mode == NULL){
-        return -1;
+    if(yyext->mode_depth >= yyext->mode_cap){
+        mode_info * new_modes = (mode_info*)malloc(sizeof(mode_info) * yyext->mode_cap * 2);
+        if(new_modes == NULL){
+            return -1;
+        }
+        memcpy(new_modes, yyext->modes, sizeof(mode_info) * yyext->mode_depth);
+        if(yyext->modes != yyext->inline_modes){
+            free(yyext->modes);
+        }
+        yyext->modes = new_modes;
+        yyext->mode_cap *= 2;
     }
+    mode_info * new_mode = yyext->modes + yyext->mode_depth++;
     new_mode->mode_type = next_mode;
     new_mode->parentheses_count = 0;
-    new_mode->next = yyext->mode_info_ptr;
     yyext->mode_info_ptr = new_mode;
     return 0;
 }
 
+// 栈底的mode不会被弹出，is_tick时一直弹出到bashTick
 static flex_mode bash_pop_mode(token_info * yyext, flex_uint32_t is_tick){
-    mode_info * next_mode_ptr = yyext->mode_info_ptr->next;
     if(is_tick){
-        while(next_mode_ptr != NULL && 
-              yyext->mode_info_ptr->mode_type != flex_mode_bashTick
+        while(yyext->mode_depth > 1 &&
+              yyext->modes[yyext->mode_depth - 1].mode_type != flex_mode_bashTick
         ){
-            next_mode_ptr = next_mode_ptr->next;
-            bash_pop_mode(yyext, 0);
+            yyext->mode_depth--;
         }
     }
-    
-    if(next_mode_ptr == NULL){
-        return (yyext->mode_info_ptr->mode_type);
-    }
-    else{
-        free(yyext->mode_info_ptr);
-        yyext->mode_info_ptr = next_mode_ptr;
-        return next_mode_ptr->mode_type;
+
+    if(yyext->mode_depth > 1){
+        yyext->mode_depth--;
     }
+    yyext->mode_info_ptr = yyext->modes + yyext->mode_depth - 1;
+    return yyext->mode_info_ptr->mode_type;
 }
 
 static flex_uint32_t check_mem(token_info * yyext, flex_uint32_t new_str_len){
@@ -899,11 +909,45 @@ static flex_uint32_t check_mem(token_info * yyext, flex_uint32_t new_str_len){
     }
 }
 
+// 返回开头连续ascii字符的长度
+static flex_uint32_t ascii_prefix(const char * str, flex_uint32_t str_len){
+    flex_uint32_t pos = 0;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    while (pos + 16 <= str_len) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(str + pos)));
+        if (mask != 0) {
+            return pos + ctz32(mask);
+        }
+        pos += 16;
+    }
+#else
+    while (pos + 8 <= str_len) {
+        uint64_t word;
+        memcpy(&word, str + pos, sizeof(word));
+        if (word & 0x8080808080808080ULL) {
+            break;
+        }
+        pos += 8;
+    }
+#endif
+    while (pos < str_len && (unsigned char)str[pos] < 0x80) {
+        pos++;
+    }
+    return pos;
+}
+
 static flex_uint32_t utf8len(const char * str, flex_uint32_t str_len){
     flex_uint32_t pos = 0;
     flex_uint32_t length = 0;
 
     while (pos < str_len) {
+        // ascii字符的utf8和utf16长度都是1，成段跳过
+        flex_uint32_t ascii_len = ascii_prefix(str + pos, str_len - pos);
+        pos += ascii_len;
+        length += ascii_len;
+        if (pos >= str_len) {
+            break;
+        }
         if (0xfc == (0xfe & *(str + pos))) {
             // 6-byte utf8 code point (began with 0b1111110x)
             pos += 6;
@@ -936,7 +980,11 @@ static flex_uint32_t utf8len(const char * str, flex_uint32_t str_len){
 }
 
 static void change_pos(token_info * yyext, flex_uint32_t length){
-    yyext->crt_input_unicode_pos += utf8len(yyext->input + yyext->crt_input_pos, length);
+    if (yyext->is_ascii) {
+        yyext->crt_input_unicode_pos += length;
+    } else {
+        yyext->crt_input_unicode_pos += utf8len(yyext->input + yyext->crt_input_pos, length);
+    }
     yyext->crt_input_pos += length;
 }
 
@@ -1188,10 +1236,10 @@ YY_DECL
 
 #line 321 "flexLexer/lex.l"
 
-    if(strcmp(yyextra->mode, "sql") == 0){
+    if(yyextra->type == flex_tokenizer_sql){
         INIT_MODE(sql)
     }
-    else if(strcmp(yyextra->mode, "bash") == 0){
+    else if(yyextra->type == flex_tokenizer_bash){
         INIT_MODE(bash)
     }
     else{
@@ -2689,48 +2737,164 @@ void yyfree (void * ptr , yyscan_t yyscanner)
 #line 425 "flexLexer/lex.l"
 
 
-flex_token_result flex_lexing(const char *input, flex_uint32_t len, const char *tokenizer_type){
-    flex_uint32_t * init_token_result = (flex_uint32_t *)malloc(sizeof(flex_uint32_t) * INIT_RESULT_LEN);
-    if(init_token_result == NULL){
-        flex_token_result res = {NULL, 0};
+#define INIT_INPUT_LEN 64 * 1024
+
+struct flex_tokenizer {
+    yyscan_t scanner;
+    YY_BUFFER_STATE buffer; //指向input的buffer，每次调用时重置，不再重新申请
+    char * input; //末尾留出两个YY_END_OF_BUFFER_CHAR，flex直接在其中扫描，不再拷贝
+    flex_uint32_t input_len; //input可容纳的输入长度
+    token_info ti;
+};
+
+flex_tokenizer * flex_tokenizer_new(){
+    flex_tokenizer * tokenizer = (flex_tokenizer *)calloc(1, sizeof(flex_tokenizer));
+    return tokenizer;
+}
+
+void flex_tokenizer_free(flex_tokenizer * tokenizer){
+    if(tokenizer == NULL){
+        return;
+    }
+    if(tokenizer->scanner != NULL){
+        yylex_destroy(tokenizer->scanner);
+    }
+    if(tokenizer->ti.modes != tokenizer->ti.inline_modes){
+        free(tokenizer->ti.modes);
+    }
+    free(tokenizer->input);
+    free(tokenizer->ti.result);
+    free(tokenizer);
+}
+
+char * flex_tokenizer_input(flex_tokenizer * tokenizer, flex_uint32_t len){
+    if(len > UINT32_MAX - 2){
+        return NULL;
+    }
+    // 处理过很长的输入后，遇到短输入时归还多余的内存
+    if(tokenizer->input == NULL || len > tokenizer->input_len ||
+       (tokenizer->input_len > INIT_INPUT_LEN && len <= INIT_INPUT_LEN)){
+        flex_uint32_t new_input_len = len > INIT_INPUT_LEN ? len : INIT_INPUT_LEN;
+        char * new_input = (char *)realloc(tokenizer->input, new_input_len + 2);
+        if(new_input == NULL){
+            return NULL;
+        }
+        tokenizer->input = new_input;
+        tokenizer->input_len = new_input_len;
+    }
+    return tokenizer->input;
+}
+
+// 与yy_scan_buffer相同，但复用同一个buffer对象
+static void reset_buffer(flex_tokenizer * tokenizer, flex_uint32_t len){
+    yyscan_t yyscanner = tokenizer->scanner;
+    struct yyguts_t * yyg = (struct yyguts_t*)yyscanner;
+    YY_BUFFER_STATE b = tokenizer->buffer;
+    if(b == NULL){
+        b = (YY_BUFFER_STATE) yyalloc(sizeof( struct yy_buffer_state ) ,yyscanner );
+        if ( ! b )
+            YY_FATAL_ERROR( "out of dynamic memory in reset_buffer()" );
+        tokenizer->buffer = b;
+    }
+    tokenizer->input[len] = YY_END_OF_BUFFER_CHAR;
+    tokenizer->input[len + 1] = YY_END_OF_BUFFER_CHAR;
+    b->yy_buf_size = len;
+    b->yy_buf_pos = b->yy_ch_buf = tokenizer->input;
+    b->yy_is_our_buffer = 0;
+    b->yy_input_file = 0;
+    b->yy_n_chars = b->yy_buf_size;
+    b->yy_is_interactive = 0;
+    b->yy_at_bol = 1;
+    b->yy_fill_buffer = 0;
+    b->yy_buffer_status = YY_BUFFER_NEW;
+    if(YY_CURRENT_BUFFER == b){
+        yy_load_buffer_state(yyscanner);
+        yyg->yy_did_buffer_switch_on_eof = 1;
+    }
+    else{
+        yy_switch_to_buffer(b ,yyscanner );
+    }
+}
+
+flex_token_result flex_tokenizer_lexing(flex_tokenizer * tokenizer, flex_uint32_t len, flex_tokenizer_type type, int is_ascii){
+    flex_token_result res = {NULL, 0};
+    token_info * ti = &tokenizer->ti;
+    if(tokenizer->input == NULL || len > tokenizer->input_len){
+        return res;
+    }
+    if(ti->result == NULL || ti->result_len > INIT_RESULT_LEN * 8){
+        free(ti->result);
+        ti->result = (flex_uint32_t *)malloc(sizeof(flex_uint32_t) * INIT_RESULT_LEN);
+        ti->result_len = ti->result == NULL ? 0 : INIT_RESULT_LEN;
+        if(ti->result == NULL){
+            return res;
+        }
+    }
+    ti->type = type;
+    ti->input = tokenizer->input;
+    ti->crt_input_pos = 0;
+    ti->crt_input_unicode_pos = 0;
+    ti->crt_result_pos = 0;
+    ti->is_ascii = is_ascii || ascii_prefix(tokenizer->input, len) == len;
+    if(ti->modes == NULL){
+        ti->modes = ti->inline_modes;
+        ti->mode_cap = INLINE_MODE_DEPTH;
+    }
+    ti->mode_depth = 0;
+    ti->mode_info_ptr = NULL;
+    if(tokenizer->scanner == NULL && yylex_init_extra(ti, &tokenizer->scanner) != 0){
+        tokenizer->scanner = NULL;
         return res;
     }
     flex_uint32_t res_state;
-    yyscan_t scanner;
-    token_info ti = {
-        tokenizer_type,
-        init_token_result,
-        INIT_RESULT_LEN,
-        input,
-        0,
-        0,
-        0,
-        NULL
-    };
-    if(yylex_init_extra(&ti,&scanner) != 0){
+#ifndef DISABLE_EXCEPTION
+    try{
+#endif
+        reset_buffer(tokenizer, len);
+        res_state = yylex(tokenizer->scanner);
+#ifndef DISABLE_EXCEPTION
+    }
+    catch(const char* msg){
         res_state = 1;
     }
+#endif
+    if(res_state != 0){
+        // 出错时扫描器停在任意位置，丢弃它，下次重新创建
+        yylex_destroy(tokenizer->scanner);
+        tokenizer->scanner = NULL;
+        tokenizer->buffer = NULL;
+        return res;
+    }
+    res.result = ti->result;
+    res.result_len = ti->crt_result_pos;
+    return res;
+}
+
+flex_token_result flex_lexing(const char *input, flex_uint32_t len, const char *tokenizer_type){
+    flex_token_result res = {NULL, 0};
+    flex_tokenizer_type type;
+    if(strcmp(tokenizer_type, "sql") == 0){
+        type = flex_tokenizer_sql;
+    }
+    else if(strcmp(tokenizer_type, "bash") == 0){
+        type = flex_tokenizer_bash;
+    }
     else{
-    #ifndef DISABLE_EXCEPTION
-        try{
-    #endif
-
-            YY_BUFFER_STATE buffer = yy_scan_bytes(input,len,scanner);
-            res_state = yylex(scanner);
-            
-    #ifndef DISABLE_EXCEPTION
-        }
-        catch(const char* msg){
-            res_state = 1;
-        }
-    #endif
-        yylex_destroy(scanner);
+        return res;
     }
-    if(res_state != 0){
-        free(ti.result);
-        flex_token_result res = {NULL, 0};
+    flex_tokenizer * tokenizer = flex_tokenizer_new();
+    if(tokenizer == NULL){
         return res;
     }
-    flex_token_result res = {ti.result, ti.crt_result_pos};
+    char * buffer = flex_tokenizer_input(tokenizer, len);
+    if(buffer != NULL){
+        memcpy(buffer, input, len);
+        res = flex_tokenizer_lexing(tokenizer, len, type, 0);
+        // 结果交给调用方释放
+        if(res.result != NULL){
+            tokenizer->ti.result = NULL;
+        }
+    }
+    flex_tokenizer_free(tokenizer);
     return res;
 }
@@ -1,9 +1,24 @@
+#pragma once
 #include <inttypes.h>
 typedef struct flex_token_result {
     uint32_t * result;
     uint32_t result_len;
 } flex_token_result;
 
+typedef enum flex_tokenizer_type {
+    flex_tokenizer_sql,
+    flex_tokenizer_bash
+} flex_tokenizer_type;
+
 flex_token_result flex_lexing(const char *input, uint32_t len, const char *tokenizer_type);
 
+// 保留扫描器状态、输入和结果缓冲区，多次调用之间不再重新申请，同一时间只能在一个线程中使用
+typedef struct flex_tokenizer flex_tokenizer;
+flex_tokenizer * flex_tokenizer_new();
+void flex_tokenizer_free(flex_tokenizer * tokenizer);
+// 返回可容纳len字节的输入缓冲区，写入输入后调用flex_tokenizer_lexing，失败返回NULL
+char * flex_tokenizer_input(flex_tokenizer * tokenizer, uint32_t len);
+// 结果属于tokenizer，下次调用前有效，is_ascii非0表示调用方已知输入全部是ascii，为0时自行检测
+flex_token_result flex_tokenizer_lexing(flex_tokenizer * tokenizer, uint32_t len, flex_tokenizer_type type, int is_ascii);
+
 #define YY_FATAL_ERROR(msg) throw msg
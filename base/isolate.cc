@@ -14,10 +14,96 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <cstdlib>
 #include "bundle.h"
 
 namespace openrasp_v8 {
 
+// 默认不暂停，否则构造几次超时的输入就能让检测函数失效一段时间
+int CheckProcess::max_timeouts = 0;
+int CheckProcess::cooldown_ms = 10 * 1000;
+
+void Isolate::ConfigPluginBudget(int max_timeouts, int cooldown_ms) {
+  CheckProcess::max_timeouts = max_timeouts;
+  CheckProcess::cooldown_ms = cooldown_ms;
+}
+
+void RequestSignal::Notify() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    count++;
+  }
+  cv.notify_one();
+}
+
+bool RequestSignal::WaitFor(int64_t timeout) {
+  std::unique_lock<std::mutex> lock(mtx);
+  if (!cv.wait_for(lock, std::chrono::nanoseconds(timeout), [this] { return count > 0; })) {
+    return false;
+  }
+  count--;
+  return true;
+}
+
+MemoryProfile Isolate::memory_profile;
+std::atomic<bool> Isolate::flags_applied{false};
+int Isolate::idle_budget_ms = 1;
+
+// 这两个flag关闭新生代，只使用老生代，更省内存
+std::string MemoryProfile::Flags() const {
+  return stress_compaction ? "--stress-compaction --stress-compaction-random "
+                           : "--no-stress-compaction --no-stress-compaction-random ";
+}
+
+MemoryProfile MemoryProfile::Compact() {
+  return MemoryProfile();
+}
+
+MemoryProfile MemoryProfile::Throughput() {
+  MemoryProfile profile;
+  profile.max_old_space_mb = 64;
+  profile.max_semi_space_kb = 1024;
+  profile.oom_threshold_mb = 48;
+  profile.stress_compaction = false;
+  return profile;
+}
+
+// v8 flags在V8::Initialize之后不能再修改，isolate也会读取memory_profile，所以Initialize之后的配置被忽略
+bool Isolate::ConfigMemoryProfile(const MemoryProfile& profile) {
+  if (flags_applied) {
+    return false;
+  }
+  memory_profile = profile;
+  return true;
+}
+
+const MemoryProfile& Isolate::GetMemoryProfile() {
+  return memory_profile;
+}
+
+// flags参与快照的兼容性校验，只在V8::Initialize之前执行一次
+void Isolate::ApplyFlags() {
+  if (flags_applied.exchange(true)) {
+    return;
+  }
+  std::string flags = memory_profile.Flags();
+  const char* env = std::getenv("OPENRASP_V8_OPTIONS");
+  if (env) {
+    flags += env;
+  }
+  v8::V8::SetFlagsFromString(flags.data(), flags.size());
+  Snapshot::flags_hash = Snapshot::Hash(flags.data(), flags.size());
+}
+
+void Isolate::ConfigIdleBudget(int budget_ms) {
+  idle_budget_ms = budget_ms;
+}
+
+int Isolate::GetIdleBudget() {
+  return idle_budget_ms;
+}
+
 // 创建isolate对象
 Isolate* Isolate::New(Snapshot* snapshot_blob, uint64_t timestamp) {
   static v8::ArrayBuffer::Allocator* array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
@@ -25,12 +111,15 @@ Isolate* Isolate::New(Snapshot* snapshot_blob, uint64_t timestamp) {
   data->create_params.array_buffer_allocator = array_buffer_allocator;
   data->create_params.snapshot_blob = snapshot_blob;
   data->create_params.external_references = snapshot_blob->external_references;  // native方法的指针
-  // 设置新生代，老生代大小，目前已经不需要了
-  // data->create_params.constraints.set_max_young_generation_size_in_bytes(1);
-  // data->create_params.constraints.set_max_old_generation_size_in_bytes(20 * 1024 * 1024);
-  // data->create_params.constraints.set_initial_old_generation_size_in_bytes(1024 * 1024 / 2);
-  // data->create_params.constraints.set_max_semi_space_size_in_kb(1024);
-  // data->create_params.constraints.set_max_old_space_size(20);
+  // 设置新生代，老生代大小，stress_compaction开启时新生代不起作用
+  auto& profile = memory_profile;
+  if (profile.max_old_space_mb) {
+    data->create_params.constraints.set_max_old_space_size(profile.max_old_space_mb);
+  }
+  if (profile.max_semi_space_kb) {
+    data->create_params.constraints.set_max_semi_space_size_in_kb(profile.max_semi_space_kb);
+  }
+  data->oom_threshold = profile.oom_threshold_mb * 1024 * 1024;
 
   Isolate* isolate = reinterpret_cast<Isolate*>(v8::Isolate::New(data->create_params));
   if (!isolate) {
@@ -46,14 +135,35 @@ Isolate* Isolate::New(Snapshot* snapshot_blob, uint64_t timestamp) {
     Platform::logger(msg);
     printf("%s", msg.c_str());
   });
-  // 每次GC后对isolate的堆采样，超出20M终止执行
+  isolate->AddGCPrologueCallback(
+      [](v8::Isolate* isolate, v8::GCType type, v8::GCCallbackFlags flags, void* d) {
+        reinterpret_cast<IsolateData*>(d)->gc_start = Watchdog::Now();
+      },
+      data);
+  // 每次GC后对isolate的堆采样，超出oom_threshold终止执行
+  // token缓存不在v8堆中，但与堆合计不超过oom_threshold，堆增长时先淘汰缓存
   isolate->AddGCEpilogueCallback(
       [](v8::Isolate* isolate, v8::GCType type, v8::GCCallbackFlags flags, void* d) {
         auto data = reinterpret_cast<IsolateData*>(d);
+        if (data->gc_start) {
+          uint64_t pause = Watchdog::Now() - data->gc_start;
+          data->gc_count++;
+          data->gc_time += pause;
+          data->max_gc_pause = std::max(data->max_gc_pause, pause);
+          data->gc_start = 0;
+        }
         isolate->GetHeapStatistics(&data->hs);
-        if (data->hs.used_heap_size() > 20 * 1024 * 1024) {
+        size_t used = data->hs.used_heap_size();
+        size_t threshold = data->oom_threshold;
+        if (used + data->token_cache.GetSize() > threshold) {
+          data->token_cache.Trim(used < threshold ? threshold - used : 0);
+        }
+        if (used > threshold) {
           Platform::logger("Javascript plugin execution out of memory\n");
           isolate->TerminateExecution();
+          if (!data->is_oom) {
+            Metrics::RecordOom();
+          }
           data->is_oom = true;
         }
       },
@@ -64,12 +174,16 @@ Isolate* Isolate::New(Snapshot* snapshot_blob, uint64_t timestamp) {
         Platform::logger("Near v8 isolate heap limit\n");
         auto isolate = reinterpret_cast<Isolate*>(data);
         isolate->TerminateExecution();
+        if (!isolate->GetData()->is_oom) {
+          Metrics::RecordOom();
+        }
         isolate->GetData()->is_oom = true;
         return current_heap_limit * 2;
       },
       isolate);
   isolate->SetData(data);
   data->timestamp = timestamp;
+  Watchdog::GetInstance().Register(isolate);
 
   return isolate;
 }
@@ -90,20 +204,91 @@ void Isolate::Initialize() {
                          ->Get(context, NewV8Key(this, "log"))
                          .ToLocalChecked()
                          .As<v8::Function>();
-  auto check_points = RASP->Get(context, NewV8Key(this, "checkPoints"))
-                          .ToLocalChecked()
-                          .As<v8::Object>()
-                          ->GetOwnPropertyNames(context)
-                          .ToLocalChecked();
-  for (uint32_t i = 0; i < check_points->Length(); i++) {
-    auto key = check_points->Get(context, i).ToLocalChecked();
-    v8::String::Utf8Value val(this, key);
-    data->check_points.emplace(*val, val.length());
-  }
+  data->key_action.Reset(this, NewV8Key(this, "action"));
+  data->str_ignore.Reset(this, NewV8Key(this, "ignore"));
+  data->str_log.Reset(this, NewV8Key(this, "log"));
+  data->str_block.Reset(this, NewV8Key(this, "block"));
   data->context.Reset(this, context);
   data->RASP.Reset(this, RASP);
   data->check.Reset(this, check);
   data->console_log.Reset(this, console_log);
+  BuildCheckTables(context);
+}
+
+// 把RASP.checkPoints[name]展开成以id为下标的检测函数表
+// Initialize之后执行的脚本可能注册新的检测函数，ExecScript后RASP.checkPointsGeneration变化时重新展开
+// 已有检测函数的超时计数和暂停状态按函数保留，重新展开不会解除暂停
+void Isolate::BuildCheckTables(v8::Local<v8::Context> context) {
+  v8::HandleScope handle_scope(this);
+  auto data = GetData();
+  auto RASP = data->RASP.Get(this);
+  std::vector<std::vector<CheckProcess>> old_tables;
+  old_tables.swap(data->check_tables);
+  data->check_points.clear();
+  data->check_point_ids.clear();
+  v8::Local<v8::Value> generation;
+  data->check_points_generation =
+      RASP->Get(context, NewV8Key(this, "checkPointsGeneration")).ToLocal(&generation) && generation->IsNumber()
+          ? generation.As<v8::Number>()->Value()
+          : -1;
+  // ExecScript执行的脚本可以改写RASP.checkPoints，类型不对的项直接跳过
+  v8::Local<v8::Value> value;
+  v8::Local<v8::Array> check_points;
+  if (!RASP->Get(context, NewV8Key(this, "checkPoints")).ToLocal(&value) || !value->IsObject()) {
+    return;
+  }
+  auto check_points_obj = value.As<v8::Object>();
+  if (!check_points_obj->GetOwnPropertyNames(context).ToLocal(&check_points)) {
+    return;
+  }
+  auto key_func = NewV8Key(this, "func");
+  auto key_plugin = NewV8Key(this, "plugin");
+  auto key_make_result = NewV8Key(this, "make_result");
+  auto key_name = NewV8Key(this, "name");
+  for (uint32_t i = 0; i < check_points->Length(); i++) {
+    v8::Local<v8::Value> key, processes;
+    if (!check_points->Get(context, i).ToLocal(&key) || !check_points_obj->Get(context, key).ToLocal(&processes) ||
+        !processes->IsArray()) {
+      continue;
+    }
+    v8::String::Utf8Value val(this, key);
+    std::string name(*val, val.length());
+    data->check_points.emplace(name);
+    int id = CheckPointRegistry::Register(name);
+    data->check_point_ids.emplace(name, id);
+    if (data->check_tables.size() <= id) {
+      data->check_tables.resize(id + 1);
+    }
+    auto& table = data->check_tables[id];
+    auto array = processes.As<v8::Array>();
+    for (uint32_t j = 0; j < array->Length(); j++) {
+      v8::Local<v8::Value> process, func, plugin, make_result, plugin_name;
+      if (!array->Get(context, j).ToLocal(&process) || !process->IsObject() ||
+          !process.As<v8::Object>()->Get(context, key_func).ToLocal(&func) || !func->IsFunction() ||
+          !process.As<v8::Object>()->Get(context, key_plugin).ToLocal(&plugin) || !plugin->IsObject() ||
+          !plugin.As<v8::Object>()->Get(context, key_make_result).ToLocal(&make_result) ||
+          !make_result->IsFunction() || !plugin.As<v8::Object>()->Get(context, key_name).ToLocal(&plugin_name)) {
+        continue;
+      }
+      table.emplace_back();
+      auto& entry = table.back();
+      entry.func.Reset(this, func.As<v8::Function>());
+      entry.receiver.Reset(this, process.As<v8::Object>());
+      entry.plugin.Reset(this, plugin.As<v8::Object>());
+      entry.make_result.Reset(this, make_result.As<v8::Function>());
+      v8::String::Utf8Value utf8_name(this, plugin_name);
+      entry.plugin_id = Metrics::RegisterPlugin(std::string(*utf8_name, utf8_name.length()));
+      if (id < old_tables.size()) {
+        for (auto& old_entry : old_tables[id]) {
+          if (old_entry.func == func) {
+            entry.timeouts = old_entry.timeouts;
+            entry.skip_until = old_entry.skip_until;
+            break;
+          }
+        }
+      }
+    }
+  }
 }
 
 IsolateData* Isolate::GetData() {
@@ -115,6 +300,7 @@ void Isolate::SetData(IsolateData* data) {
 }
 
 void Isolate::Dispose() {
+  Watchdog::GetInstance().Unregister(this);
   delete GetData();
   v8::Isolate::Dispose();
 }
@@ -128,33 +314,216 @@ bool Isolate::IsExpired(uint64_t timestamp) {
 }
 
 // 执行检测
+// 检测点在Initialize时已经展开成检测函数表，这里转换为id后按表调用
 v8::MaybeLocal<v8::Array> Isolate::Check(v8::Local<v8::Context> context,
                                          v8::Local<v8::String> request_type,
                                          v8::Local<v8::Object> request_params,
                                          v8::Local<v8::Object> request_context,
                                          int timeout) {
+  auto data = GetData();
+  v8::String::Utf8Value type(this, request_type);
+  auto it = data->check_point_ids.find(std::string(*type, type.length()));
+  if (it == data->check_point_ids.end()) {
+    return {};
+  }
+  return Check(context, it->second, request_params, request_context, timeout);
+}
+
+namespace {
+// 依次记录每个插件和整个检测点的耗时，开启profiling时同时记录当前线程的CPU时间
+class CheckTimer {
+ public:
+  explicit CheckTimer(int check_point) : check_point(check_point), profiling(Metrics::IsProfiling()) {
+    start = last = Watchdog::Now();
+    cpu_start = cpu_last = profiling ? Metrics::ThreadCpuTime() : 0;
+  }
+  void Lap(int plugin, MetricsOutcome outcome) {
+    int64_t now = Watchdog::Now();
+    int64_t cpu = profiling ? Metrics::ThreadCpuTime() : 0;
+    Metrics::Record(check_point, plugin, now - last, outcome, cpu - cpu_last);
+    last = now;
+    cpu_last = cpu;
+  }
+  void Finish(MetricsOutcome outcome) {
+    int64_t cpu = profiling ? Metrics::ThreadCpuTime() : 0;
+    Metrics::Record(check_point, 0, Watchdog::Now() - start, outcome, cpu - cpu_start);
+  }
+
+ private:
+  int check_point;
+  bool profiling;
+  int64_t start;
+  int64_t last;
+  int64_t cpu_start;
+  int64_t cpu_last;
+};
+
+bool HasPendingPromise(v8::Local<v8::Context> context, v8::Local<v8::Array> arr, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    v8::Local<v8::Value> item;
+    if (arr->Get(context, i).ToLocal(&item) && item->IsPromise() &&
+        item.As<v8::Promise>()->State() == v8::Promise::PromiseState::kPending) {
+      return true;
+    }
+  }
+  return false;
+}
+}  // namespace
+
+// 与rasp.js中RASP.check的逻辑相同，但省去了检测点的字典查找，并且结果为ignore时不再调用make_result
+// 每个插件和整个检测点的耗时与结果都计入Metrics，检测点的结果取所有插件中最严重的action
+v8::MaybeLocal<v8::Array> Isolate::Check(v8::Local<v8::Context> context,
+                                         int check_point,
+                                         v8::Local<v8::Object> request_params,
+                                         v8::Local<v8::Object> request_context,
+                                         int timeout) {
   auto isolate = this;
   v8::EscapableHandleScope handle_scope(isolate);
   auto data = isolate->GetData();
+  if (UNLIKELY(check_point < 0 || check_point >= data->check_tables.size())) {
+    return {};
+  }
+  auto& table = data->check_tables[check_point];
+  if (table.empty()) {
+    return {};
+  }
   v8::TryCatch try_catch(isolate);
-  auto check = data->check.Get(isolate);
-  v8::Local<v8::Value> argv[]{request_type, request_params, request_context};
-
-  // 提交后台超时任务
-  std::promise<void> pro;
-  Platform::Get()->CallOnWorkerThread(std::unique_ptr<v8::Task>(new TimeoutTask(isolate, pro.get_future(), timeout)));
-  auto maybe_rst = check->Call(context, check, 3, argv);
-  pro.set_value();
+  auto key_action = data->key_action.Get(isolate);
+  auto str_ignore = data->str_ignore.Get(isolate);
+  auto str_log = data->str_log.Get(isolate);
+  auto str_block = data->str_block.Get(isolate);
+  v8::Local<v8::Value> argv[]{request_params, request_context};
+  auto arr = v8::Array::New(isolate);
+  uint32_t length = 0;
+  bool is_ok = true;
+  bool has_timeout = false;
+  bool has_promise = false;
+  MetricsOutcome total_outcome = kMetricsIgnore;
+  CheckTimer timer(check_point);
+
+  // 执行一个检测函数，返回结果分类，需要make_result的结果写入rst
+  auto run = [&](CheckProcess& process, v8::Local<v8::Value>& rst) -> MetricsOutcome {
+    auto func = process.func.Get(isolate);
+    if (!func->Call(context, process.receiver.Get(isolate), 2, argv).ToLocal(&rst)) {
+      return kMetricsException;
+    }
+    // 绝大多数检测函数返回undefined或者ignore，直接跳过
+    if (rst->IsUndefined()) {
+      return kMetricsIgnore;
+    }
+    MetricsOutcome outcome = kMetricsOther;
+    if (rst->IsObject() && !rst->IsPromise()) {
+      v8::Local<v8::Value> action;
+      if (!rst.As<v8::Object>()->Get(context, key_action).ToLocal(&action)) {
+        return kMetricsException;
+      }
+      if (action->StrictEquals(str_ignore)) {
+        rst.Clear();
+        return kMetricsIgnore;
+      }
+      if (action->StrictEquals(str_block)) {
+        outcome = kMetricsBlock;
+      } else if (action->StrictEquals(str_log)) {
+        outcome = kMetricsLog;
+      }
+    }
+    auto make_result = process.make_result.Get(isolate);
+    if (!make_result->Call(context, process.plugin.Get(isolate), 1, &rst).ToLocal(&rst)) {
+      return kMetricsException;
+    }
+    return outcome;
+  };
+
+  // 每个检测函数分到剩余时间的平均值作为截止时间，先结束的检测函数把剩余时间留给后面的
+  // 超时只中断当前检测函数，已完成的结果照常返回，连续超时的检测函数暂停调用一段时间
+  auto& watchdog = Watchdog::GetInstance();
+  int64_t deadline = Watchdog::Now() + static_cast<int64_t>(timeout) * 1000 * 1000;
+  size_t remaining = table.size();
+  for (auto& process : table) {
+    int64_t now = Watchdog::Now();
+    int64_t slice = (deadline - now) / static_cast<int64_t>(remaining--);
+    if (UNLIKELY(process.skip_until > now || slice <= 0)) {
+      timer.Lap(process.plugin_id, kMetricsSkipped);
+      has_timeout = has_timeout || slice <= 0;
+      continue;
+    }
+    v8::Local<v8::Value> rst;
+    watchdog.ArmAt(data, now + slice);
+    MetricsOutcome outcome = run(process, rst);
+    watchdog.Disarm(data);
+    if (UNLIKELY(data->is_timeout)) {
+      data->is_timeout = false;
+      isolate->CancelTerminateExecution();
+      // 执行刚好结束时看门狗才发出中断，结果有效
+      if (outcome == kMetricsException) {
+        outcome = kMetricsTimeout;
+      }
+    }
+    if (UNLIKELY(outcome == kMetricsTimeout)) {
+      timer.Lap(process.plugin_id, outcome);
+      try_catch.Reset();
+      has_timeout = true;
+      Platform::logger("Javascript plugin execution timeout\n");
+      process.timeouts++;
+      if (CheckProcess::max_timeouts > 0 && process.timeouts >= CheckProcess::max_timeouts) {
+        process.timeouts = 0;
+        process.skip_until = Watchdog::Now() + static_cast<int64_t>(CheckProcess::cooldown_ms) * 1000 * 1000;
+        Platform::logger("Javascript plugin " + Metrics::GetPluginName(process.plugin_id) +
+                         " timed out repeatedly, skipped for " + std::to_string(CheckProcess::cooldown_ms) + "ms\n");
+      }
+      continue;
+    }
+    if (UNLIKELY(outcome == kMetricsException)) {
+      outcome = try_catch.HasTerminated() ? kMetricsTerminated : kMetricsException;
+      timer.Lap(process.plugin_id, outcome);
+      total_outcome = outcome;
+      is_ok = false;
+      break;
+    }
+    timer.Lap(process.plugin_id, outcome);
+    process.timeouts = 0;
+    if (!rst.IsEmpty() && !rst->IsUndefined() && outcome != kMetricsIgnore) {
+      has_promise = has_promise || rst->IsPromise();
+      arr->Set(context, length++, rst).IsJust();
+    }
+    // block最严重，其次log，其他action最轻
+    if (outcome == kMetricsBlock || (outcome == kMetricsLog && total_outcome != kMetricsBlock) ||
+        (outcome == kMetricsOther && total_outcome == kMetricsIgnore)) {
+      total_outcome = outcome;
+    }
+  }
+  // 有检测函数超时，检测点的结果记为timeout，但其他检测函数的结果仍然返回
+  if (has_timeout && is_ok) {
+    total_outcome = kMetricsTimeout;
+  }
+  timer.Finish(total_outcome);
   // 必须pump剩余任务
   while (Platform::Get()->PumpMessageLoop(isolate)) {
     continue;
   }
-
-  if (UNLIKELY(maybe_rst.IsEmpty())) {
-    if (data->is_timeout) {
-      data->is_timeout = false;
-      Platform::logger("Javascript plugin execution timeout\n");
+  // RASP.request的promise在请求线程完成后才settle，截止时间之前阻塞等待请求完成的通知，之后仍未settle的视为没有结果
+  // 插件的then回调在pump时执行，同样受剩余时间的限制
+  if (UNLIKELY(has_promise && is_ok)) {
+    while (HasPendingPromise(context, arr, length)) {
+      int64_t now = Watchdog::Now();
+      if (now >= deadline || !data->request_signal->WaitFor(deadline - now)) {
+        break;
+      }
+      watchdog.ArmAt(data, deadline);
+      while (Platform::Get()->PumpMessageLoop(isolate)) {
+        continue;
+      }
+      watchdog.Disarm(data);
+      if (UNLIKELY(data->is_timeout)) {
+        data->is_timeout = false;
+        isolate->CancelTerminateExecution();
+        Platform::logger("Javascript plugin execution timeout\n");
+        break;
+      }
     }
+  }
+
+  if (UNLIKELY(!is_ok)) {
     if (try_catch.HasTerminated()) {
       isolate->CancelTerminateExecution();
     } else {
@@ -162,23 +531,22 @@ v8::MaybeLocal<v8::Array> Isolate::Check(v8::Local<v8::Context> context,
     }
     return {};
   }
-  auto rst = maybe_rst.ToLocalChecked();
-  if (UNLIKELY(!rst->IsArray())) {
-    return {};
-  }
-  auto arr = rst.As<v8::Array>();
   // all results are ignore, fast track
-  if (LIKELY(arr->Length() == 0)) {
+  if (LIKELY(length == 0)) {
     return handle_scope.Escape(arr);
   }
   // any result is promise or any result.action is not equal to ignore
   // we do not care abort the performace here
   v8::Local<v8::Array> ret_arr = v8::Array::New(isolate);
   int idx = 0;
-  for (int i = 0; i < arr->Length(); i++) {
+  for (int i = 0; i < length; i++) {
     v8::Local<v8::Value> item;
     if (arr->Get(context, i).ToLocal(&item)) {
       if (item->IsPromise()) {
+        // pending的promise调用Result()会触发v8的fatal error
+        if (item.As<v8::Promise>()->State() == v8::Promise::PromiseState::kPending) {
+          continue;
+        }
         item = item.As<v8::Promise>()->Result();
         if (item->IsUndefined()) {
           continue;
@@ -225,6 +593,17 @@ v8::MaybeLocal<v8::Value> Isolate::ExecScript(v8::Local<v8::String> source,
   while (Platform::Get()->PumpMessageLoop(isolate)) {
     continue;
   }
+  // 快照创建时RASP还未缓存，不需要展开，没有注册新的检测函数时也不需要
+  auto data = isolate->GetData();
+  if (!data->RASP.IsEmpty()) {
+    v8::Local<v8::Value> generation;
+    if (!data->RASP.Get(isolate)
+             ->Get(context, NewV8Key(isolate, "checkPointsGeneration"))
+             .ToLocal(&generation) ||
+        !generation->IsNumber() || generation.As<v8::Number>()->Value() != data->check_points_generation) {
+      BuildCheckTables(context);
+    }
+  }
   return handle_scope.EscapeMaybe(rst);
 }
 
@@ -237,4 +616,37 @@ v8::MaybeLocal<v8::Value> Isolate::Log(v8::Local<v8::Value> value) {
   return handle_scope.EscapeMaybe(rst);
 }
 
-}  // namespace openrasp_v8
\ No newline at end of file
+bool Isolate::IdleNotification(int budget_ms) {
+  if (budget_ms <= 0) {
+    return true;
+  }
+  auto platform = Platform::Get();
+  auto data = GetData();
+  uint64_t gc_count = data->gc_count;
+  double deadline = platform->MonotonicallyIncreasingTime() + budget_ms / 1000.0;
+  GetHeapStatistics(&data->hs);
+  bool pressure = data->hs.used_heap_size() > data->oom_threshold / 4 * 3;
+  if (pressure) {
+    MemoryPressureNotification(v8::MemoryPressureLevel::kModerate);
+  }
+  // 增量标记完成后由前台任务收尾，所以每轮先pump前台任务，再执行空闲任务和增量GC
+  bool done = false;
+  for (double now = platform->MonotonicallyIncreasingTime(); !done && now < deadline;
+       now = platform->MonotonicallyIncreasingTime()) {
+    while (platform->PumpMessageLoop(this)) {
+      continue;
+    }
+    platform->RunIdleTasks(this, deadline - now);
+    if (platform->MonotonicallyIncreasingTime() >= deadline) {
+      break;
+    }
+    done = IdleNotificationDeadline(deadline);
+  }
+  if (pressure) {
+    MemoryPressureNotification(v8::MemoryPressureLevel::kNone);
+  }
+  data->idle_gc_count += data->gc_count - gc_count;
+  return done;
+}
+
+}  // namespace openrasp_v8
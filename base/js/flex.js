@@ -2,16 +2,51 @@
  * @file flex.js
  * 包装native的flex_tokenize方法
  */
-'use strict';
+(function () {
+  'use strict';
 
-global.tokenize = function (query, type) {
-  const result = []
-  const arr = flex_tokenize(query, type) || []
-  for (let i = 0; i < arr.length; i += 2) {
-    const start = arr[i]
-    const stop = arr[i + 1]
-    const text = query.substring(start, stop)
-    result.push({ start, stop, text })
+  // 直接访问native返回的偏移，不为每个token创建对象，text只在访问时截取
+  class TokenView {
+    constructor(query, offsets) {
+      this.query = query
+      this.offsets = offsets
+      this.length = offsets.length >> 1
+    }
+
+    start(i) {
+      return this.offsets[i * 2]
+    }
+
+    stop(i) {
+      return this.offsets[i * 2 + 1]
+    }
+
+    text(i) {
+      return this.query.substring(this.offsets[i * 2], this.offsets[i * 2 + 1])
+    }
+
+    token(i) {
+      const start = this.offsets[i * 2]
+      const stop = this.offsets[i * 2 + 1]
+      return { start, stop, text: this.query.substring(start, stop) }
+    }
+  }
+
+  global.tokenize_view = function (query, type) {
+    return new TokenView(query, flex_tokenize(query, type) || new Uint32Array(0))
+  }
+
+  global.tokenize = function (query, type) {
+    const offsets = flex_tokenize(query, type) || new Uint32Array(0)
+    const result = new Array(offsets.length >> 1)
+    // token是普通对象，text是自有的可枚举属性，插件可以遍历、展开和改写
+    for (let i = 0; i < result.length; i++) {
+      const start = offsets[i * 2]
+      const stop = offsets[i * 2 + 1]
+      result[i] = { start, stop, text: query.substring(start, stop) }
+    }
+    // 供RASP.token_range直接在偏移上二分查找
+    Object.defineProperty(result, 'offsets', { value: offsets })
+    return result
   }
-  return result
-}
\ No newline at end of file
+})();
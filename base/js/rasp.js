@@ -35,6 +35,79 @@ global.RASP = class {
         return tokenize(query, 'bash')
     }
 
+    // 只读取需要的token，不创建token对象
+    static sql_tokenize_view(query) {
+        return tokenize_view(query, 'sql')
+    }
+
+    static cmd_tokenize_view(query) {
+        return tokenize_view(query, 'bash')
+    }
+
+    // 返回str1和str2所有不同的最长公共子串
+    static lcs_search(str1, str2) {
+        return lcs_search(String(str1), String(str2))
+    }
+
+    // 返回用户输入[index, index + length)覆盖的第一个和最后一个token的下标，找不到时为-1和token数量
+    // tokens可以是sql_tokenize、sql_tokenize_view等的结果，也可以是flex_tokenize返回的偏移
+    static token_range(tokens, index, length) {
+        if (tokens instanceof Uint32Array) {
+            return token_range(tokens, index, length)
+        }
+        if (tokens && tokens.offsets instanceof Uint32Array) {
+            return token_range(tokens.offsets, index, length)
+        }
+        const search = (from, found) => {
+            let lo = from, hi = tokens.length
+            while (lo < hi) {
+                const mid = (lo + hi) >> 1
+                if (found(tokens[mid].stop)) {
+                    hi = mid
+                } else {
+                    lo = mid + 1
+                }
+            }
+            return lo
+        }
+        const start = search(0, stop => stop > index)
+        if (start == tokens.length) {
+            return [-1, tokens.length]
+        }
+        return [start, search(start, stop => stop >= index + length)]
+    }
+
+    // 返回target中出现的所有请求参数，每项为{key, value, offset}，按在target中的结束位置排序
+    // 请求参数在每个请求中只编译一次，缓存在context上，之后每次匹配只需扫描一遍target
+    static match_userinput(context, target) {
+        let matcher = userinputMatchers.get(context)
+        if (!matcher) {
+            const keys = [], values = []
+            const parameter = context && context.parameter
+            if (parameter && typeof parameter === 'object') {
+                for (const key of Object.keys(parameter)) {
+                    const value = parameter[key]
+                    for (const item of (value && typeof value === 'object') ? Object.values(value) : [value]) {
+                        if (typeof item === 'string' && item.length > 0) {
+                            keys.push(key)
+                            values.push(item)
+                        }
+                    }
+                }
+            }
+            matcher = { keys, values, automaton: ac_compile(values) }
+            if (context && typeof context === 'object') {
+                userinputMatchers.set(context, matcher)
+            }
+        }
+        const hits = ac_match(matcher.automaton, String(target)) || []
+        const result = []
+        for (let i = 0; i < hits.length; i += 2) {
+            result.push({ key: matcher.keys[hits[i]], value: matcher.values[hits[i]], offset: hits[i + 1] })
+        }
+        return result
+    }
+
     static request(config) {
         return request(config)
     }
@@ -68,6 +141,7 @@ global.RASP = class {
             func: checkProcess,
             plugin: this
         });
+        RASP.checkPointsGeneration++;
     }
 
     // 加上插件名称前缀
@@ -107,4 +181,6 @@ global.RASP = class {
     }
 };
 RASP.plugins = {};
-RASP.checkPoints = {};
\ No newline at end of file
+RASP.checkPoints = {};
+RASP.checkPointsGeneration = 0;
+const userinputMatchers = new WeakMap();
\ No newline at end of file
@@ -0,0 +1,383 @@
+/*
+ * Copyright 2017-2019 Baidu Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "bundle.h"
+
+namespace openrasp_v8 {
+
+constexpr int Metrics::max_check_points;
+constexpr int Metrics::max_plugins;
+constexpr int Metrics::histogram_size;
+
+namespace {
+constexpr int shard_count = 8;
+
+struct Cell {
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> outcomes[kMetricsOutcomeSize]{};
+  std::atomic<uint64_t> max{0};
+  std::atomic<uint64_t> total_time{0};  // 纳秒
+  std::atomic<uint64_t> cpu_time{0};    // 纳秒
+  std::atomic<uint64_t> histogram[Metrics::histogram_size]{};
+};
+
+struct Row {
+  std::atomic<Cell*> cells[Metrics::max_plugins + 1]{};
+};
+
+// 行和单元格首次写入时才分配，CAS失败的一方释放自己分配的对象，之后不再释放
+struct Shard {
+  std::atomic<Row*> rows[Metrics::max_check_points]{};
+  Cell* GetCell(int check_point, int plugin) {
+    auto row = rows[check_point].load(std::memory_order_acquire);
+    if (UNLIKELY(!row)) {
+      auto fresh = new Row();
+      if (rows[check_point].compare_exchange_strong(row, fresh, std::memory_order_acq_rel)) {
+        row = fresh;
+      } else {
+        delete fresh;
+      }
+    }
+    auto cell = row->cells[plugin].load(std::memory_order_acquire);
+    if (UNLIKELY(!cell)) {
+      auto fresh = new Cell();
+      if (row->cells[plugin].compare_exchange_strong(cell, fresh, std::memory_order_acq_rel)) {
+        cell = fresh;
+      } else {
+        delete fresh;
+      }
+    }
+    return cell;
+  }
+  Cell* FindCell(int check_point, int plugin) {
+    auto row = rows[check_point].load(std::memory_order_acquire);
+    return row ? row->cells[plugin].load(std::memory_order_acquire) : nullptr;
+  }
+};
+
+Shard shards[shard_count];
+std::atomic<uint64_t> oom_count{0};
+std::atomic<bool> profiling{false};
+std::atomic<int> next_shard{0};
+
+std::mutex plugin_mtx;
+std::unordered_map<std::string, int> plugin_ids;
+std::vector<std::string> plugin_names{""};
+
+// 线程首次记录时按轮转分配分片，之后固定不变
+Shard& GetShard() {
+  thread_local int index = next_shard.fetch_add(1, std::memory_order_relaxed) % shard_count;
+  return shards[index];
+}
+
+void Add(std::atomic<uint64_t>& counter, uint64_t value = 1) {
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+void RecordCell(Cell* cell, uint64_t nanoseconds, uint64_t cpu_nanoseconds, MetricsOutcome outcome) {
+  if (outcome == kMetricsSkipped) {
+    Add(cell->outcomes[outcome]);
+    return;
+  }
+  uint64_t microseconds = nanoseconds / 1000;
+  int index = Metrics::HistogramIndex(microseconds);
+  Add(cell->calls);
+  Add(cell->outcomes[outcome]);
+  Add(cell->total_time, nanoseconds);
+  if (cpu_nanoseconds) {
+    Add(cell->cpu_time, cpu_nanoseconds);
+  }
+  Add(cell->histogram[index]);
+  uint64_t max = cell->max.load(std::memory_order_relaxed);
+  while (microseconds > max &&
+         !cell->max.compare_exchange_weak(max, microseconds, std::memory_order_relaxed)) {
+  }
+}
+
+uint64_t Percentile(const uint64_t* histogram, uint64_t total, double ratio) {
+  uint64_t rank = static_cast<uint64_t>(total * ratio);
+  if (rank >= total) {
+    rank = total - 1;
+  }
+  uint64_t count = 0;
+  for (int i = 0; i < Metrics::histogram_size; i++) {
+    count += histogram[i];
+    if (count > rank) {
+      return Metrics::HistogramValue(i);
+    }
+  }
+  return Metrics::HistogramValue(Metrics::histogram_size - 1);
+}
+
+void AppendJsonString(std::string& out, const std::string& str) {
+  out += '"';
+  for (unsigned char c : str) {
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      default:
+        if (c < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          out += buf;
+        } else {
+          out += c;
+        }
+    }
+  }
+  out += '"';
+}
+
+const char* outcome_names[kMetricsOutcomeSize]{"ignore",  "log",        "block",      "other",
+                                               "exception", "timeout", "terminated", "skipped"};
+}  // namespace
+
+// 插件名相同的插件共用一个id，超出max_plugins的插件只计入检测点的统计
+int Metrics::RegisterPlugin(const std::string& name) {
+  std::lock_guard<std::mutex> lock(plugin_mtx);
+  auto rst = plugin_ids.emplace(name, plugin_names.size());
+  if (rst.second) {
+    plugin_names.push_back(name);
+  }
+  return rst.first->second;
+}
+
+std::string Metrics::GetPluginName(int id) {
+  std::lock_guard<std::mutex> lock(plugin_mtx);
+  return id > 0 && id < plugin_names.size() ? plugin_names[id] : std::string();
+}
+
+// 小于8的值单独一格，之后每个2的幂区间分8格
+int Metrics::HistogramIndex(uint64_t microseconds) {
+  if (microseconds < 8) {
+    return microseconds;
+  }
+#if defined(__GNUC__) || defined(__clang__)
+  int k = 63 - __builtin_clzll(microseconds);
+#else
+  int k = 3;
+  while (microseconds >> (k + 1)) {
+    k++;
+  }
+#endif
+  int index = (k - 2) * 8 + ((microseconds >> (k - 3)) & 7);
+  return std::min(index, histogram_size - 1);
+}
+
+uint64_t Metrics::HistogramValue(int index) {
+  if (index < 8) {
+    return index;
+  }
+  int k = index / 8 + 2;
+  uint64_t lower = static_cast<uint64_t>(8 + index % 8) << (k - 3);
+  return lower + (1ull << (k - 3)) - 1;
+}
+
+void Metrics::Record(int check_point,
+                     int plugin,
+                     int64_t nanoseconds,
+                     MetricsOutcome outcome,
+                     int64_t cpu_nanoseconds) {
+  if (UNLIKELY(check_point < 0 || check_point >= max_check_points || plugin < 0 || plugin > max_plugins ||
+               outcome < 0 || outcome >= kMetricsOutcomeSize)) {
+    return;
+  }
+  RecordCell(GetShard().GetCell(check_point, plugin), nanoseconds > 0 ? nanoseconds : 0,
+             cpu_nanoseconds > 0 ? cpu_nanoseconds : 0, outcome);
+}
+
+void Metrics::RecordOom() {
+  Add(oom_count);
+}
+
+uint64_t Metrics::GetOomCount() {
+  return oom_count.load(std::memory_order_relaxed);
+}
+
+// 读取时各分片可能还在写入，结果不是严格的快照，但每个计数都是单调的
+std::vector<Metrics::Entry> Metrics::Collect() {
+  std::vector<Entry> entries;
+  int check_points = std::min(CheckPointRegistry::Size(), max_check_points);
+  uint64_t histogram[histogram_size];
+  for (int cp = 0; cp < check_points; cp++) {
+    for (int plugin = 0; plugin <= max_plugins; plugin++) {
+      Entry entry{};
+      std::fill(histogram, histogram + histogram_size, 0);
+      bool found = false;
+      for (auto& shard : shards) {
+        auto cell = shard.FindCell(cp, plugin);
+        if (!cell) {
+          continue;
+        }
+        found = true;
+        entry.calls += cell->calls.load(std::memory_order_relaxed);
+        for (int i = 0; i < kMetricsOutcomeSize; i++) {
+          entry.outcomes[i] += cell->outcomes[i].load(std::memory_order_relaxed);
+        }
+        entry.max = std::max(entry.max, cell->max.load(std::memory_order_relaxed));
+        entry.total_time += cell->total_time.load(std::memory_order_relaxed);
+        entry.cpu_time += cell->cpu_time.load(std::memory_order_relaxed);
+        for (int i = 0; i < histogram_size; i++) {
+          histogram[i] += cell->histogram[i].load(std::memory_order_relaxed);
+        }
+      }
+      if (!found || entry.calls == 0) {
+        continue;
+      }
+      uint64_t total = 0;
+      for (int i = 0; i < histogram_size; i++) {
+        total += histogram[i];
+      }
+      if (total > 0) {
+        entry.p50 = std::min(Percentile(histogram, total, 0.5), entry.max);
+        entry.p99 = std::min(Percentile(histogram, total, 0.99), entry.max);
+        entry.p999 = std::min(Percentile(histogram, total, 0.999), entry.max);
+      }
+      entry.total_time /= 1000;
+      entry.cpu_time /= 1000;
+      entry.check_point = CheckPointRegistry::GetName(cp);
+      entry.plugin = GetPluginName(plugin);
+      entries.push_back(std::move(entry));
+    }
+  }
+  return entries;
+}
+
+namespace {
+void AppendJsonEntries(std::string& json, const std::vector<Metrics::Entry>& entries) {
+  json += '[';
+  bool first = true;
+  for (auto& entry : entries) {
+    json += first ? "{" : ",{";
+    first = false;
+    json += "\"check_point\":";
+    AppendJsonString(json, entry.check_point);
+    json += ",\"plugin\":";
+    AppendJsonString(json, entry.plugin);
+    json += ",\"calls\":" + std::to_string(entry.calls);
+    for (int i = 0; i < kMetricsOutcomeSize; i++) {
+      json += ",\"";
+      json += outcome_names[i];
+      json += "\":" + std::to_string(entry.outcomes[i]);
+    }
+    json += ",\"p50\":" + std::to_string(entry.p50);
+    json += ",\"p99\":" + std::to_string(entry.p99);
+    json += ",\"p999\":" + std::to_string(entry.p999);
+    json += ",\"max\":" + std::to_string(entry.max);
+    json += ",\"total_time\":" + std::to_string(entry.total_time);
+    json += ",\"cpu_time\":" + std::to_string(entry.cpu_time);
+    json += "}";
+  }
+  json += ']';
+}
+}  // namespace
+
+std::string Metrics::ToJson() {
+  std::string json = "{\"oom\":" + std::to_string(GetOomCount()) + ",\"entries\":";
+  AppendJsonEntries(json, Collect());
+  json += '}';
+  return json;
+}
+
+std::vector<Metrics::Entry> Metrics::TopPlugins(size_t n) {
+  auto entries = Collect();
+  entries.erase(std::remove_if(entries.begin(), entries.end(), [](const Entry& entry) { return entry.plugin.empty(); }),
+                entries.end());
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+    if (a.cpu_time != b.cpu_time) {
+      return a.cpu_time > b.cpu_time;
+    }
+    return a.total_time > b.total_time;
+  });
+  if (entries.size() > n) {
+    entries.resize(n);
+  }
+  return entries;
+}
+
+// [{"check_point":"...","plugin":"...",...,"total_time":0,"cpu_time":0}]
+std::string Metrics::TopPluginsJson(size_t n) {
+  std::string json;
+  AppendJsonEntries(json, TopPlugins(n));
+  return json;
+}
+
+void Metrics::SetProfiling(bool enable) {
+  profiling.store(enable, std::memory_order_relaxed);
+}
+
+bool Metrics::IsProfiling() {
+  return profiling.load(std::memory_order_relaxed);
+}
+
+// 只统计当前线程在用户态和内核态实际占用的CPU时间，不包括等锁、被调度出去的时间
+int64_t Metrics::ThreadCpuTime() {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+    return 0;
+  }
+  auto to_ns = [](const FILETIME& time) {
+    return ((static_cast<int64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) * 100;
+  };
+  return to_ns(kernel) + to_ns(user);
+#else
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
+  return static_cast<int64_t>(ts.tv_sec) * 1000 * 1000 * 1000 + ts.tv_nsec;
+#endif
+}
+
+// 只清零计数，已分配的行和单元格保留，与并发的Record之间不保证原子性
+void Metrics::Reset() {
+  for (auto& shard : shards) {
+    for (int cp = 0; cp < max_check_points; cp++) {
+      for (int plugin = 0; plugin <= max_plugins; plugin++) {
+        auto cell = shard.FindCell(cp, plugin);
+        if (!cell) {
+          continue;
+        }
+        cell->calls.store(0, std::memory_order_relaxed);
+        for (auto& counter : cell->outcomes) {
+          counter.store(0, std::memory_order_relaxed);
+        }
+        cell->max.store(0, std::memory_order_relaxed);
+        cell->total_time.store(0, std::memory_order_relaxed);
+        cell->cpu_time.store(0, std::memory_order_relaxed);
+        for (auto& counter : cell->histogram) {
+          counter.store(0, std::memory_order_relaxed);
+        }
+      }
+    }
+  }
+  oom_count.store(0, std::memory_order_relaxed);
+}
+
+}  // namespace openrasp_v8
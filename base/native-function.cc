@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstring>
 #include "bundle.h"
 #include "flex/flex.h"
 #include "request.h"
@@ -14,29 +16,124 @@ void log_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
 
 void flex_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
   Isolate* isolate = reinterpret_cast<Isolate*>(info.GetIsolate());
-  auto context = isolate->GetCurrentContext();
   if (info.Length() < 2 || !info[0]->IsString() || !info[1]->IsString()) {
     return;
   }
-  v8::String::Utf8Value str(isolate, info[0]);
-  v8::String::Utf8Value lexer_mode(isolate, info[1]);
+  flex_tokenizer_type type;
+  char mode[8];
+  auto lexer_mode = info[1].As<v8::String>();
+  int mode_len = lexer_mode->Length();
+  if (mode_len >= sizeof(mode) || !lexer_mode->ContainsOnlyOneByte()) {
+    return;
+  }
+  lexer_mode->WriteOneByte(isolate, reinterpret_cast<uint8_t*>(mode), 0, mode_len, v8::String::NO_NULL_TERMINATION);
+  mode[mode_len] = 0;
+  if (strcmp(mode, "sql") == 0) {
+    type = flex_tokenizer_sql;
+  } else if (strcmp(mode, "bash") == 0) {
+    type = flex_tokenizer_bash;
+  } else {
+    return;
+  }
 
-  char* input = *str;
-  int input_len = str.length();
+  auto data = isolate->GetData();
+  if (!data->tokenizer) {
+    data->tokenizer.reset(flex_tokenizer_new(), flex_tokenizer_free);
+  }
+  auto str = info[0].As<v8::String>();
+  int input_len = str->Utf8Length(isolate);
+  char* input = data->tokenizer ? flex_tokenizer_input(data->tokenizer.get(), input_len) : nullptr;
+  if (!input) {
+    return;
+  }
+  str->WriteUtf8(isolate, input, input_len, nullptr, v8::String::NO_NULL_TERMINATION);
 
-  flex_token_result token_result = flex_lexing(input, input_len, *lexer_mode);
+  const uint32_t* offsets;
+  size_t len;
+  auto& cache = data->token_cache;
+  uint64_t key = TokenCache::Key(input, input_len, type);
+  auto cached = TokenCache::budget ? cache.Get(key, input, input_len, type) : nullptr;
+  if (cached) {
+    offsets = cached->data();
+    len = cached->size();
+  } else {
+    // utf8长度与utf16长度相等说明全部是ascii，tokenizer不必再检测和转换下标
+    flex_token_result token_result =
+        flex_tokenizer_lexing(data->tokenizer.get(), input_len, type, input_len == str->Length());
+    if (!token_result.result) {
+      return;
+    }
+    offsets = token_result.result;
+    // 每个token至少占一个字节，结果不会超过输入长度的两倍
+    len = std::min(uint32_t(input_len) * 2, token_result.result_len);
+    if (TokenCache::budget) {
+      cache.Put(key, input, input_len, type, offsets, len);
+    }
+  }
 
-  size_t len = std::min(uint32_t(input_len), token_result.result_len);
-  auto arr = v8::Array::New(isolate, len);
-  for (int i = 0; i < len; i++) {
-    arr->Set(context, i, v8::Integer::New(isolate, token_result.result[i])).IsJust();
+  // 偏移直接拷贝到Uint32Array，依次是每个token的start和stop，插件可能修改数组，所以缓存的结果也要拷贝
+  auto buffer = v8::ArrayBuffer::New(isolate, len * sizeof(uint32_t));
+  if (len > 0) {
+    memcpy(buffer->GetContents().Data(), offsets, len * sizeof(uint32_t));
   }
-  free(token_result.result);
-  info.GetReturnValue().Set(arr);
+  info.GetReturnValue().Set(v8::Uint32Array::New(buffer, 0, len));
 }
 
+namespace {
+// 请求完成后投递到isolate的前台任务队列，在下一次PumpMessageLoop时settle对应的promise
+// v8 7.8的默认Platform不会在isolate销毁时清理它的任务队列，任务可能落到同一地址上新建的isolate中
+// id全局唯一，找不到对应的resolver时直接丢弃
+class RequestTask : public v8::Task {
+ public:
+  RequestTask(v8::Isolate* isolate, uint64_t id, HTTPResponse&& response)
+      : isolate(reinterpret_cast<Isolate*>(isolate)), id(id), response(std::move(response)) {}
+  void Run() override {
+    auto data = isolate->GetData();
+    auto it = data->pending_requests.find(id);
+    if (it == data->pending_requests.end()) {
+      return;
+    }
+    v8::HandleScope handle_scope(isolate);
+    auto resolver = it->second.Get(isolate);
+    data->pending_requests.erase(it);
+    auto context = resolver->CreationContext();
+    v8::Context::Scope context_scope(context);
+    v8::TryCatch try_catch(isolate);
+    auto object = response.ToObject(isolate);
+    // 插件的then回调在这里执行，检测之外执行时同样受看门狗限制
+    auto& watchdog = Watchdog::GetInstance();
+    bool armed = data->deadline.load() == 0;
+    if (armed) {
+      watchdog.Arm(data, 100);
+    }
+    if (response.error) {
+      resolver->Reject(context, object).IsJust();
+    } else {
+      resolver->Resolve(context, object).IsJust();
+    }
+    isolate->RunMicrotasks();
+    if (!armed) {
+      return;
+    }
+    watchdog.Disarm(data);
+    if (UNLIKELY(data->is_timeout)) {
+      data->is_timeout = false;
+      isolate->CancelTerminateExecution();
+      Platform::logger("Javascript plugin execution timeout\n");
+    }
+  }
+
+ private:
+  Isolate* isolate;
+  uint64_t id;
+  HTTPResponse response;
+};
+}  // namespace
+
+// 请求在AsyncRequest的线程池中执行，不阻塞调用线程，队列已满时立即reject
 void request_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
-  auto isolate = info.GetIsolate();
+  static std::atomic<uint64_t> next_id{0};
+  auto isolate = reinterpret_cast<Isolate*>(info.GetIsolate());
   v8::TryCatch try_catch(isolate);
   auto context = isolate->GetCurrentContext();
   v8::Local<v8::Promise::Resolver> resolver;
@@ -45,26 +142,411 @@ void request_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
     return;
   }
   info.GetReturnValue().Set(resolver->GetPromise());
-  HTTPRequest req(isolate, info[0]);
-  HTTPResponse res = req.GetResponse();
-  auto object = res.ToObject(isolate);
-  if (res.error) {
-    resolver->Reject(context, object).IsJust();
-  } else {
-    resolver->Resolve(context, object).IsJust();
+  // 预热时的检测调用不应该真的发出请求
+  if (UNLIKELY(isolate->GetData()->is_warmup)) {
+    HTTPResponse response;
+    response.error.code = cpr::ErrorCode::UNKNOWN_ERROR;
+    response.error.message = "request is not available during warmup";
+    resolver->Reject(context, response.ToObject(isolate)).IsJust();
+    return;
+  }
+  auto req = std::make_shared<HTTPRequest>(isolate, info[0]);
+  // 配置有误时不必进入队列
+  if (req->HasError()) {
+    resolver->Reject(context, req->GetResponse().ToObject(isolate)).IsJust();
+    return;
+  }
+  uint64_t id = ++next_id;
+  auto& pending_requests = isolate->GetData()->pending_requests;
+  pending_requests.emplace(id, v8::Global<v8::Promise::Resolver>(isolate, resolver));
+  auto runner = Platform::Get()->GetForegroundTaskRunner(isolate);
+  auto signal = isolate->GetData()->request_signal;
+  bool submitted = AsyncRequest::GetInstance().Submit(req, [runner, signal, isolate, id](HTTPResponse& response) {
+    runner->PostTask(std::unique_ptr<v8::Task>(new RequestTask(isolate, id, std::move(response))));
+    signal->Notify();
+  });
+  if (!submitted) {
+    pending_requests.erase(id);
+    HTTPResponse response;
+    response.error.code = cpr::ErrorCode::UNKNOWN_ERROR;
+    response.error.message = "request queue is full";
+    resolver->Reject(context, response.ToObject(isolate)).IsJust();
   }
 }
 
 void request_async_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
+  auto isolate = reinterpret_cast<Isolate*>(info.GetIsolate());
+  if (UNLIKELY(isolate->GetData()->is_warmup)) {
+    return;
+  }
+  auto request = std::make_shared<HTTPRequest>(isolate, info[0]);
+  if (request->IsBatchable()) {
+    RequestBatcher::GetInstance().Add(request);
+  } else {
+    AsyncRequest::GetInstance().Submit(request);
+  }
+}
+
+// 返回str1和str2所有不同的最长公共子串，按在str1中出现的位置排序，与插件中js实现的lcs_search结果一致
+// 对str2构造后缀自动机，str1在上面匹配一遍，复杂度O(n+m)，js实现是O(n*m)
+void lcs_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
+  auto isolate = info.GetIsolate();
+  auto context = isolate->GetCurrentContext();
+  if (info.Length() < 2 || !info[0]->IsString() || !info[1]->IsString()) {
+    return;
+  }
+  auto str1 = info[0].As<v8::String>();
+  auto str2 = info[1].As<v8::String>();
+  std::vector<uint16_t> a(str1->Length()), b(str2->Length());
+  str1->Write(isolate, a.data(), 0, a.size(), v8::String::NO_NULL_TERMINATION);
+  str2->Write(isolate, b.data(), 0, b.size(), v8::String::NO_NULL_TERMINATION);
+
+  struct State {
+    int len;
+    int link;
+    std::vector<std::pair<uint16_t, int>> next;  // 每个状态的出边通常很少，线性查找
+    int Go(uint16_t c) const {
+      for (auto& edge : next) {
+        if (edge.first == c) {
+          return edge.second;
+        }
+      }
+      return -1;
+    }
+    void Set(uint16_t c, int to) {
+      for (auto& edge : next) {
+        if (edge.first == c) {
+          edge.second = to;
+          return;
+        }
+      }
+      next.emplace_back(c, to);
+    }
+  };
+  std::vector<State> states;
+  states.reserve(b.size() * 2 + 1);
+  states.push_back({0, -1, {}});
+  int last = 0;
+  for (uint16_t c : b) {
+    int cur = states.size();
+    states.push_back({states[last].len + 1, 0, {}});
+    int p = last;
+    while (p != -1 && states[p].Go(c) == -1) {
+      states[p].Set(c, cur);
+      p = states[p].link;
+    }
+    if (p != -1) {
+      int q = states[p].Go(c);
+      if (states[p].len + 1 == states[q].len) {
+        states[cur].link = q;
+      } else {
+        int clone = states.size();
+        states.push_back({states[p].len + 1, states[q].link, states[q].next});
+        while (p != -1 && states[p].Go(c) == q) {
+          states[p].Set(c, clone);
+          p = states[p].link;
+        }
+        states[q].link = clone;
+        states[cur].link = clone;
+      }
+    }
+    last = cur;
+  }
+
+  // l是str1中以i结尾、在str2中出现过的最长后缀的长度
+  int v = 0, l = 0, best = 0;
+  std::vector<int> ends;
+  for (int i = 0; i < a.size(); i++) {
+    while (v != 0 && states[v].Go(a[i]) == -1) {
+      v = states[v].link;
+      l = states[v].len;
+    }
+    int to = states[v].Go(a[i]);
+    if (to != -1) {
+      v = to;
+      l++;
+    } else {
+      v = 0;
+      l = 0;
+    }
+    if (l > best) {
+      best = l;
+      ends.clear();
+      ends.push_back(i);
+    } else if (l == best && best > 0) {
+      ends.push_back(i);
+    }
+  }
+
+  auto arr = v8::Array::New(isolate);
+  std::unordered_set<std::u16string> seen;
+  uint32_t length = 0;
+  for (int end : ends) {
+    const uint16_t* start = a.data() + end - best + 1;
+    if (!seen.emplace(reinterpret_cast<const char16_t*>(start), best).second) {
+      continue;
+    }
+    v8::Local<v8::String> str;
+    if (!v8::String::NewFromTwoByte(isolate, start, v8::NewStringType::kNormal, best).ToLocal(&str) ||
+        arr->Set(context, length++, str).IsNothing()) {
+      return;
+    }
+  }
+  info.GetReturnValue().Set(arr);
+}
+
+// 在flex_tokenize返回的偏移中二分查找用户输入覆盖的token范围，返回[start, end]
+// start是第一个stop大于index的token，end是从start开始第一个stop不小于index+length的token
+// 找不到时start为-1，end为token数量
+void token_range_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
+  auto isolate = info.GetIsolate();
+  auto context = isolate->GetCurrentContext();
+  if (info.Length() < 3 || !info[0]->IsUint32Array()) {
+    return;
+  }
+  auto offsets = info[0].As<v8::Uint32Array>();
+  double index, length;
+  if (!info[1]->NumberValue(context).To(&index) || !info[2]->NumberValue(context).To(&length)) {
+    return;
+  }
+  auto data = reinterpret_cast<const uint32_t*>(static_cast<const char*>(offsets->Buffer()->GetContents().Data()) +
+                                                offsets->ByteOffset());
+  int64_t count = offsets->Length() / 2;
+  // 各token的stop单调不减
+  auto search = [&](int64_t from, double target, bool inclusive) {
+    int64_t lo = from, hi = count;
+    while (lo < hi) {
+      int64_t mid = lo + (hi - lo) / 2;
+      double stop = data[mid * 2 + 1];
+      if (inclusive ? stop >= target : stop > target) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return lo;
+  };
+  int64_t start = search(0, index, false);
+  int64_t end = count;
+  if (start == count) {
+    start = -1;
+  } else {
+    end = search(start, index + length, true);
+  }
+  auto arr = v8::Array::New(isolate, 2);
+  arr->Set(context, 0, v8::Number::New(isolate, start)).IsJust();
+  arr->Set(context, 1, v8::Number::New(isolate, end)).IsJust();
+  info.GetReturnValue().Set(arr);
+}
+
+// Aho-Corasick自动机展开成uint32数组保存在ArrayBuffer中，由gc回收，不需要额外的析构
+// 头部依次为：节点数N，边数E，模式串数P
+// 然后是N个节点，每个节点5项：出边起始，出边结束，失配指针，输出的第一个模式串，失配链上下一个有输出的节点
+// 然后是E条边，每条边2项：utf16字符，目标节点，同一节点的边按字符排序
+// 最后是P个模式串，每个2项：长度，与之相同的下一个模式串
+namespace {
+constexpr uint32_t ac_none = 0xFFFFFFFF;
+constexpr size_t ac_header_size = 3;
+constexpr size_t ac_node_size = 5;
+constexpr size_t ac_max_hits = 256;  // 单次匹配中每个模式串最多返回的结果数
+}  // namespace
+
+// 参数是字符串数组，空字符串和非字符串不参与匹配，但占用下标
+void ac_compile_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
+  auto isolate = info.GetIsolate();
+  auto context = isolate->GetCurrentContext();
+  if (info.Length() < 1 || !info[0]->IsArray()) {
+    return;
+  }
+  auto values = info[0].As<v8::Array>();
+  uint32_t pattern_count = values->Length();
+  std::vector<std::vector<std::pair<uint16_t, uint32_t>>> edges(1);
+  std::vector<uint32_t> output(1, ac_none);
+  std::vector<uint32_t> patterns(pattern_count * 2, ac_none);
+  std::vector<uint16_t> buffer;
+  for (uint32_t i = 0; i < pattern_count; i++) {
+    v8::Local<v8::Value> value;
+    if (!values->Get(context, i).ToLocal(&value)) {
+      return;
+    }
+    if (!value->IsString() || value.As<v8::String>()->Length() == 0) {
+      patterns[i * 2] = 0;
+      continue;
+    }
+    auto str = value.As<v8::String>();
+    buffer.resize(str->Length());
+    str->Write(isolate, buffer.data(), 0, buffer.size(), v8::String::NO_NULL_TERMINATION);
+    uint32_t node = 0;
+    for (uint16_t c : buffer) {
+      auto& node_edges = edges[node];
+      auto it = std::find_if(node_edges.begin(), node_edges.end(),
+                             [c](const std::pair<uint16_t, uint32_t>& edge) { return edge.first == c; });
+      if (it != node_edges.end()) {
+        node = it->second;
+        continue;
+      }
+      uint32_t next = edges.size();
+      node_edges.emplace_back(c, next);
+      edges.emplace_back();
+      output.push_back(ac_none);
+      node = next;
+    }
+    // 相同的模式串挂在同一个节点上
+    patterns[i * 2] = buffer.size();
+    patterns[i * 2 + 1] = output[node];
+    output[node] = i;
+  }
+
+  uint32_t node_count = edges.size();
+  uint32_t edge_count = 0;
+  for (auto& node_edges : edges) {
+    std::sort(node_edges.begin(), node_edges.end());
+    edge_count += node_edges.size();
+  }
+  auto go = [&](uint32_t node, uint16_t c) -> uint32_t {
+    auto& node_edges = edges[node];
+    auto it = std::lower_bound(node_edges.begin(), node_edges.end(), std::make_pair(c, uint32_t(0)));
+    return it != node_edges.end() && it->first == c ? it->second : ac_none;
+  };
+  // 按层遍历计算失配指针
+  std::vector<uint32_t> fail(node_count, 0), dict(node_count, ac_none), queue;
+  queue.reserve(node_count);
+  queue.push_back(0);
+  for (size_t head = 0; head < queue.size(); head++) {
+    uint32_t node = queue[head];
+    for (auto& edge : edges[node]) {
+      uint32_t next = edge.second;
+      if (node != 0) {
+        uint32_t f = fail[node];
+        while (f != 0 && go(f, edge.first) == ac_none) {
+          f = fail[f];
+        }
+        uint32_t to = go(f, edge.first);
+        fail[next] = to == ac_none ? 0 : to;
+      }
+      dict[next] = output[fail[next]] != ac_none ? fail[next] : dict[fail[next]];
+      queue.push_back(next);
+    }
+  }
+
+  size_t size = ac_header_size + node_count * ac_node_size + edge_count * 2 + pattern_count * 2;
+  auto array_buffer = v8::ArrayBuffer::New(isolate, size * sizeof(uint32_t));
+  auto data = static_cast<uint32_t*>(array_buffer->GetContents().Data());
+  *data++ = node_count;
+  *data++ = edge_count;
+  *data++ = pattern_count;
+  uint32_t edge_offset = 0;
+  for (uint32_t i = 0; i < node_count; i++) {
+    *data++ = edge_offset;
+    *data++ = edge_offset + edges[i].size();
+    *data++ = fail[i];
+    *data++ = output[i];
+    *data++ = dict[i];
+    edge_offset += edges[i].size();
+  }
+  for (auto& node_edges : edges) {
+    for (auto& edge : node_edges) {
+      *data++ = edge.first;
+      *data++ = edge.second;
+    }
+  }
+  memcpy(data, patterns.data(), patterns.size() * sizeof(uint32_t));
+  info.GetReturnValue().Set(array_buffer);
+}
+
+// 用ac_compile的结果扫描一遍字符串，返回Uint32Array，依次是每次命中的模式串下标和在字符串中的起始位置
+// 每个模式串只返回前ac_max_hits次命中，用大量重复的短参数填充target也不会挤掉其他参数的结果
+// ArrayBuffer可能被插件修改，所有下标都要检查，失配指针和字典指针也可能成环，native代码中的死循环看门狗无法中断
+// 合法的自动机中每个字符最多让深度加1，每走一次失配指针深度至少减1，所以失配指针走的总步数不超过已扫描的字符数
+// 每个字符沿字典指针走的步数不超过节点数，每个节点的输出链不超过模式串数，超出说明成环，返回undefined
+void ac_match_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
   auto isolate = info.GetIsolate();
-  AsyncRequest::GetInstance().Submit(std::make_shared<HTTPRequest>(isolate, info[0]));
+  if (info.Length() < 2 || !info[0]->IsArrayBuffer() || !info[1]->IsString()) {
+    return;
+  }
+  auto contents = info[0].As<v8::ArrayBuffer>()->GetContents();
+  size_t size = contents.ByteLength() / sizeof(uint32_t);
+  auto data = static_cast<const uint32_t*>(contents.Data());
+  if (size < ac_header_size) {
+    return;
+  }
+  uint64_t node_count = data[0], edge_count = data[1], pattern_count = data[2];
+  if (node_count == 0 || size != ac_header_size + node_count * ac_node_size + edge_count * 2 + pattern_count * 2) {
+    return;
+  }
+  const uint32_t* nodes = data + ac_header_size;
+  const uint32_t* edges = nodes + node_count * ac_node_size;
+  const uint32_t* patterns = edges + edge_count * 2;
+  auto go = [&](uint32_t node, uint16_t c) -> uint32_t {
+    uint32_t lo = nodes[node * ac_node_size], hi = nodes[node * ac_node_size + 1];
+    if (lo > hi || hi > edge_count) {
+      return ac_none;
+    }
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (edges[mid * 2] < c) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo < nodes[node * ac_node_size + 1] && edges[lo * 2] == c && edges[lo * 2 + 1] < node_count
+               ? edges[lo * 2 + 1]
+               : ac_none;
+  };
+
+  auto str = info[1].As<v8::String>();
+  std::vector<uint16_t> buffer(str->Length());
+  str->Write(isolate, buffer.data(), 0, buffer.size(), v8::String::NO_NULL_TERMINATION);
+  std::vector<uint32_t> hits;
+  std::vector<uint32_t> counts(pattern_count);
+  uint32_t node = 0;
+  uint64_t fail_budget = 0;
+  for (uint32_t i = 0; i < buffer.size(); i++) {
+    uint32_t next;
+    fail_budget++;
+    while ((next = go(node, buffer[i])) == ac_none && node != 0) {
+      if (UNLIKELY(fail_budget-- == 0)) {
+        return;
+      }
+      node = nodes[node * ac_node_size + 2] < node_count ? nodes[node * ac_node_size + 2] : 0;
+    }
+    node = next == ac_none ? 0 : next;
+    uint32_t out = nodes[node * ac_node_size + 3] != ac_none ? node : nodes[node * ac_node_size + 4];
+    for (uint64_t dict_budget = node_count; out < node_count; out = nodes[out * ac_node_size + 4]) {
+      if (UNLIKELY(dict_budget-- == 0 || nodes[out * ac_node_size + 3] >= pattern_count)) {
+        return;
+      }
+      uint64_t output_budget = pattern_count;
+      for (uint32_t p = nodes[out * ac_node_size + 3]; p < pattern_count; p = patterns[p * 2 + 1]) {
+        uint32_t length = patterns[p * 2];
+        if (UNLIKELY(output_budget-- == 0 || length == 0 || length > i + 1)) {
+          return;
+        }
+        if (counts[p] < ac_max_hits) {
+          counts[p]++;
+          hits.push_back(p);
+          hits.push_back(i + 1 - length);
+        }
+      }
+    }
+  }
+  auto array_buffer = v8::ArrayBuffer::New(isolate, hits.size() * sizeof(uint32_t));
+  if (!hits.empty()) {
+    memcpy(array_buffer->GetContents().Data(), hits.data(), hits.size() * sizeof(uint32_t));
+  }
+  info.GetReturnValue().Set(v8::Uint32Array::New(array_buffer, 0, hits.size()));
 }
 
-intptr_t* Snapshot::external_references = new intptr_t[5]{
+intptr_t* Snapshot::external_references = new intptr_t[9]{
     reinterpret_cast<intptr_t>(log_callback),
     reinterpret_cast<intptr_t>(flex_callback),
     reinterpret_cast<intptr_t>(request_callback),
     reinterpret_cast<intptr_t>(request_async_callback),
+    reinterpret_cast<intptr_t>(lcs_callback),
+    reinterpret_cast<intptr_t>(token_range_callback),
+    reinterpret_cast<intptr_t>(ac_compile_callback),
+    reinterpret_cast<intptr_t>(ac_match_callback),
     0,
 };
 }  // namespace openrasp_v8
\ No newline at end of file
@@ -33,11 +33,14 @@ Platform* Platform::Get() {
 
 void Platform::Startup() {
   if (!default_platform) {
-    default_platform = v8::platform::NewDefaultPlatform(thread_pool_size);
+    // 开启空闲任务，v8会把增量标记、内存缩减等GC工作投递为空闲任务，由Isolate::IdleNotification在请求之间执行
+    default_platform = v8::platform::NewDefaultPlatform(thread_pool_size, v8::platform::IdleTaskSupport::kEnabled);
   }
+  Watchdog::GetInstance().Start();
 }
 
 void Platform::Shutdown() {
+  Watchdog::GetInstance().Stop();
   if (default_platform) {
     default_platform = nullptr;
   }
@@ -56,9 +59,9 @@ Platform::~Platform() {
 bool Platform::PumpMessageLoop(v8::Isolate* isolate, v8::platform::MessageLoopBehavior behavior) {
   return v8::platform::PumpMessageLoop(default_platform.get(), isolate, behavior);
 }
-// void Platform::RunIdleTasks(v8::Isolate* isolate, double idle_time_in_seconds) {
-//   return v8::platform::RunIdleTasks(default_platform.get(), isolate, idle_time_in_seconds);
-// }
+void Platform::RunIdleTasks(v8::Isolate* isolate, double idle_time_in_seconds) {
+  return v8::platform::RunIdleTasks(default_platform.get(), isolate, idle_time_in_seconds);
+}
 int Platform::NumberOfWorkerThreads() {
   return default_platform->NumberOfWorkerThreads();
 }
@@ -77,12 +80,12 @@ void Platform::CallOnForegroundThread(v8::Isolate* isolate, v8::Task* task) {
 void Platform::CallDelayedOnForegroundThread(v8::Isolate* isolate, v8::Task* task, double delay_in_seconds) {
   return default_platform->CallDelayedOnForegroundThread(isolate, task, delay_in_seconds);
 }
-// void Platform::CallIdleOnForegroundThread(v8::Isolate* isolate, v8::IdleTask* task) {
-//   return default_platform->CallIdleOnForegroundThread(isolate, task);
-// }
-// bool Platform::IdleTasksEnabled(v8::Isolate* isolate) {
-//   return default_platform->IdleTasksEnabled(isolate);
-// }
+void Platform::CallIdleOnForegroundThread(v8::Isolate* isolate, v8::IdleTask* task) {
+  return default_platform->CallIdleOnForegroundThread(isolate, task);
+}
+bool Platform::IdleTasksEnabled(v8::Isolate* isolate) {
+  return default_platform->IdleTasksEnabled(isolate);
+}
 double Platform::MonotonicallyIncreasingTime() {
   return default_platform->MonotonicallyIncreasingTime();
 }
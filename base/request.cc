@@ -16,6 +16,9 @@
 
 #include "request.h"
 
+#include <cpr/util.h>
+
+#include <chrono>
 #include <string>
 
 #include "bundle.h"
@@ -24,7 +27,7 @@
 namespace openrasp_v8 {
 
 v8::Local<v8::Object> HTTPResponse::ToObject(v8::Isolate* isolate) {
-  v8::HandleScope handle_scope(isolate);
+  v8::EscapableHandleScope handle_scope(isolate);
   auto context = isolate->GetCurrentContext();
   auto object = v8::Object::New(isolate);
   if (!error) {
@@ -45,7 +48,40 @@ v8::Local<v8::Object> HTTPResponse::ToObject(v8::Isolate* isolate) {
     e->Set(context, NewV8Key(isolate, "message"), message).IsJust();
     object->Set(context, NewV8Key(isolate, "error"), e).IsJust();
   }
-  return object;
+  return handle_scope.Escape(object);
+}
+
+// 流式压缩，依次输入各个片段，输出与zlib compress相同的格式
+bool HTTPRequest::Deflate(const std::vector<const std::string*>& parts, std::string& output, std::string& error) {
+  z_stream stream = {};
+  if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    error = "zlib error: there was not enough memory";
+    return false;
+  }
+  std::string result;
+  char buffer[16 * 1024];
+  int rst = Z_OK;
+  for (size_t i = 0; i < parts.size() && rst == Z_OK; i++) {
+    bool last = i + 1 == parts.size();
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(parts[i]->data()));
+    stream.avail_in = parts[i]->size();
+    do {
+      stream.next_out = reinterpret_cast<Bytef*>(buffer);
+      stream.avail_out = sizeof(buffer);
+      rst = ::deflate(&stream, last ? Z_FINISH : Z_NO_FLUSH);
+      if (rst == Z_STREAM_ERROR) {
+        break;
+      }
+      result.append(buffer, sizeof(buffer) - stream.avail_out);
+    } while (stream.avail_out == 0);
+  }
+  deflateEnd(&stream);
+  if (rst != Z_STREAM_END) {
+    error = "zlib error: unknown error";
+    return false;
+  }
+  output = std::move(result);
+  return true;
 }
 
 HTTPRequest::HTTPRequest(v8::Isolate* isolate, v8::Local<v8::Value> conf) {
@@ -77,7 +113,6 @@ HTTPRequest::HTTPRequest(v8::Isolate* isolate, v8::Local<v8::Value> conf) {
     auto tmp = config->Get(context, NewV8Key(isolate, "url")).FromMaybe(undefined);
     if (tmp->IsString()) {
       url = *v8::String::Utf8Value(isolate, tmp);
-      SetUrl(url);
     }
   }
   {
@@ -94,7 +129,7 @@ HTTPRequest::HTTPRequest(v8::Isolate* isolate, v8::Local<v8::Value> conf) {
             parameters.AddParameter({*v8::String::Utf8Value(isolate, key), *v8::String::Utf8Value(isolate, val)});
           }
         }
-        SetParameters(std::move(parameters));
+        this->parameters = parameters.content;
       }
     }
   }
@@ -112,6 +147,8 @@ HTTPRequest::HTTPRequest(v8::Isolate* isolate, v8::Local<v8::Value> conf) {
       }
       body = cpr::Body(*v8::String::Utf8Value(isolate, json));
       header.emplace("content-type", "application/json");
+      // 只有json数据可以与其他请求合并成数组
+      batch = config->Get(context, NewV8Key(isolate, "batch")).FromMaybe(undefined)->IsTrue();
     } else if (tmp->IsString()) {
       body = cpr::Body(*v8::String::Utf8Value(isolate, tmp));
       // } else if (tmp->IsArrayBuffer()) {
@@ -122,55 +159,38 @@ HTTPRequest::HTTPRequest(v8::Isolate* isolate, v8::Local<v8::Value> conf) {
     }
     if (body.size() != 0) {
       if (config->Get(context, NewV8Key(isolate, "deflate")).FromMaybe(undefined)->IsTrue()) {
-        uLong dest_len = compressBound(body.size());
-        char* dest = new char[dest_len];
-        int rst = compress(reinterpret_cast<Bytef*>(dest), &dest_len, reinterpret_cast<const Bytef*>(body.data()),
-                           body.size());
-        if (rst != Z_OK) {
-          delete[] dest;
-          const char* msg;
-          if (rst == Z_MEM_ERROR) {
-            msg = "zlib error: there was not enough memory";
-          } else if (rst == Z_BUF_ERROR) {
-            msg = "zlib error: there was not enough room in the output buffer";
-          } else {
-            msg = "zlib error: unknown error";
-          }
-          error = msg;
+        header.emplace("content-encoding", "deflate");
+        deflate = true;
+      }
+      this->body = std::move(body);
+      // 合并的请求在合并后统一压缩，没有经过RequestBatcher的在发送前压缩
+      if (deflate && !batch) {
+        if (!Deflate({&this->body}, this->body, error)) {
           return;
         }
-        body = cpr::Body(dest, dest_len);
-        delete[] dest;
-        header.emplace("content-encoding", "deflate");
+        deflated = true;
       }
-      SetBody(std::move(body));
     }
   }
   {
     v8::HandleScope handle_scope(isolate);
     auto tmp = config->Get(context, NewV8Key(isolate, "maxRedirects")).FromMaybe(undefined);
     if (tmp->IsInt32()) {
-      SetMaxRedirects(cpr::MaxRedirects(tmp->Int32Value(context).FromMaybe(3)));
-    } else {
-      SetMaxRedirects(cpr::MaxRedirects(3));
+      max_redirects = tmp->Int32Value(context).FromMaybe(3);
     }
   }
   {
     v8::HandleScope handle_scope(isolate);
     auto tmp = config->Get(context, NewV8Key(isolate, "timeout")).FromMaybe(undefined);
     if (tmp->IsInt32()) {
-      SetTimeout(tmp->Int32Value(context).FromMaybe(5000));
-    } else {
-      SetTimeout(5000);
+      timeout = tmp->Int32Value(context).FromMaybe(5000);
     }
   }
   {
     v8::HandleScope handle_scope(isolate);
     auto tmp = config->Get(context, NewV8Key(isolate, "connectTimeout")).FromMaybe(undefined);
     if (tmp->IsInt32()) {
-      SetConnectTimeout(tmp->Int32Value(context).FromMaybe(5000));
-    } else {
-      SetConnectTimeout(5000);
+      connect_timeout = tmp->Int32Value(context).FromMaybe(5000);
     }
   }
   {
@@ -190,49 +210,444 @@ HTTPRequest::HTTPRequest(v8::Isolate* isolate, v8::Local<v8::Value> conf) {
       }
     }
   }
-  SetHeader(header);
-  SetVerifySsl(false);
+  this->header = std::move(header);
+}
+
+namespace {
+// scheme://host:port，同一个key的请求才可能复用连接
+std::string GetHostKey(const std::string& url) {
+  size_t begin = url.find("://");
+  begin = begin == std::string::npos ? 0 : begin + 3;
+  size_t end = url.find_first_of("/?#", begin);
+  return url.substr(0, end);
+}
+
+HTTPResponse MakeError(cpr::ErrorCode code, const std::string& message) {
+  HTTPResponse r;
+  r.error.code = code;
+  r.error.message = message;
+  return r;
+}
+}  // namespace
+
+size_t HTTPClientPool::max_idle = 16;
+size_t HTTPClientPool::max_per_host = 16;
+
+// 不析构，异步请求线程可能在进程退出时仍持有handle
+HTTPClientPool& HTTPClientPool::GetInstance() {
+  static HTTPClientPool* instance = new HTTPClientPool();
+  return *instance;
+}
+
+HTTPClientPool::HTTPClientPool() {
+  share = curl_share_init();
+  if (share) {
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, &HTTPClientPool::Lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, &HTTPClientPool::Unlock);
+    curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    // 多个线程同时使用共享的连接缓存是不安全的，连接只缓存在各个handle中
+  }
+}
+
+void HTTPClientPool::Lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr) {
+  static_cast<HTTPClientPool*>(userptr)->share_mtx[data].lock();
+}
+
+void HTTPClientPool::Unlock(CURL* handle, curl_lock_data data, void* userptr) {
+  static_cast<HTTPClientPool*>(userptr)->share_mtx[data].unlock();
+}
+
+// 等待超过timeout毫秒仍没有空位时返回nullptr，返回的handle已清除上次请求的选项
+CURL* HTTPClientPool::Acquire(const std::string& host, long timeout) {
+  std::unique_lock<std::mutex> lock(mtx);
+  // 计数归零时会被Release删除，不能在等待期间持有引用
+  auto available = [&] {
+    auto it = active.find(host);
+    return it == active.end() || it->second < max_per_host;
+  };
+  if (!available()) {
+    stats.waits++;
+    if (!cv.wait_for(lock, std::chrono::milliseconds(timeout), available)) {
+      stats.rejects++;
+      return nullptr;
+    }
+  }
+  // 先占住名额再创建handle
+  active[host]++;
+  stats.active++;
+  CURL* curl = nullptr;
+  if (!idle.empty()) {
+    // 优先使用上次访问同一host的handle，它缓存了可以复用的连接
+    auto it = std::find_if(idle.rbegin(), idle.rend(), [&](const std::pair<std::string, CURL*>& item) {
+      return item.first == host;
+    });
+    auto pos = it == idle.rend() ? idle.end() - 1 : std::next(it).base();
+    curl = pos->second;
+    idle.erase(pos);
+  } else {
+    lock.unlock();
+    curl = curl_easy_init();
+    lock.lock();
+    if (!curl) {
+      if (--active[host] == 0) {
+        active.erase(host);
+      }
+      stats.active--;
+      cv.notify_all();
+      return nullptr;
+    }
+    stats.handles++;
+  }
+  stats.requests++;
+  lock.unlock();
+  // reset会清除上次请求的所有选项，但保留缓存的连接、DNS和TLS会话
+  curl_easy_reset(curl);
+  curl_easy_setopt(curl, CURLOPT_SHARE, share);
+  return curl;
+}
+
+void HTTPClientPool::Release(const std::string& host, CURL* curl, bool reused_connection) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = active.find(host);
+    if (it != active.end() && --it->second == 0) {
+      active.erase(it);
+    }
+    stats.active--;
+    if (reused_connection) {
+      stats.reused_connections++;
+    } else {
+      stats.new_connections++;
+    }
+    if (idle.size() < max_idle) {
+      idle.emplace_back(host, curl);
+      curl = nullptr;
+    }
+  }
+  cv.notify_all();
+  if (curl) {
+    curl_easy_cleanup(curl);
+  }
+}
+
+// 关闭空闲handle和它们缓存的连接
+void HTTPClientPool::Clear() {
+  std::vector<std::pair<std::string, CURL*>> handles;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    handles.swap(idle);
+  }
+  for (auto& item : handles) {
+    curl_easy_cleanup(item.second);
+  }
+}
+
+HTTPClientStats HTTPClientPool::GetStats() {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto rst = stats;
+  rst.idle = idle.size();
+  return rst;
 }
 
 HTTPResponse HTTPRequest::GetResponse() {
+  if (deflate && !deflated && error.empty()) {
+    Deflate({&body}, body, error);
+    deflated = true;
+  }
   if (!error.empty()) {
-    cpr::Error e;
-    e.code = cpr::ErrorCode::UNKNOWN_ERROR;
-    e.message = error;
-    HTTPResponse r;
-    r.error = e;
-    return r;
-  } else if (method == "get") {
-    return Get();
+    return MakeError(cpr::ErrorCode::UNKNOWN_ERROR, error);
+  }
+  auto& pool = HTTPClientPool::GetInstance();
+  std::string host = GetHostKey(url);
+  CURL* curl = pool.Acquire(host, connect_timeout);
+  if (!curl) {
+    return MakeError(cpr::ErrorCode::CONNECTION_FAILURE, "too many concurrent requests to " + host);
+  }
+  char error_buffer[CURL_ERROR_SIZE] = {0};
+  auto version_info = curl_version_info(CURLVERSION_NOW);
+  auto user_agent = std::string{"curl/"} + std::string{version_info->version};
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, user_agent.c_str());
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_buffer);
+  // 上次请求收到的cookie不能带到这次请求
+  curl_easy_setopt(curl, CURLOPT_COOKIELIST, "ALL");
+  curl_easy_setopt(curl, CURLOPT_COOKIEFILE, "");
+  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+  curl_easy_setopt(curl, CURLOPT_MAXREDIRS, max_redirects);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, connect_timeout);
+  std::string full_url = parameters.empty() ? url : url + "?" + parameters;
+  curl_easy_setopt(curl, CURLOPT_URL, full_url.c_str());
+
+  struct curl_slist* chunk = nullptr;
+  for (auto& item : header) {
+    auto header_string = item.first + (item.second.empty() ? ";" : ": " + item.second);
+    auto temp = curl_slist_append(chunk, header_string.c_str());
+    if (temp) {
+      chunk = temp;
+    }
+  }
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
+  // 与cpr相同，post、put、patch即使没有数据也发送空body和Content-Length: 0，否则有的服务器返回411
+  bool has_body = method == "post" || method == "put" || method == "patch";
+  if (has_body || !body.empty()) {
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, static_cast<long>(body.size()));
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.data());
+  }
+  if (method == "head") {
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
   } else if (method == "post") {
-    return Post();
-  } else if (method == "put") {
-    return Put();
-  } else if (method == "patch") {
-    return Patch();
-  } else if (method == "head") {
-    return Head();
-  } else if (method == "options") {
-    return Options();
-  } else if (method == "delete") {
-    return Delete();
+    // 不设置CUSTOMREQUEST，301/302/303重定向时由curl按惯例改用GET
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+  } else if (method == "put" || method == "patch" || method == "options" || method == "delete") {
+    std::string custom_request = method;
+    std::transform(custom_request.begin(), custom_request.end(), custom_request.begin(), ::toupper);
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, custom_request.c_str());
   } else {
-    return Get();
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "GET");
   }
+
+  std::string response_string;
+  std::string header_string;
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, cpr::util::writeFunction);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_string);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, cpr::util::writeFunction);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &header_string);
+  auto curl_error = curl_easy_perform(curl);
+
+  char* raw_url = nullptr;
+  long response_code = 0;
+  long new_connections = 0;
+  double elapsed = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &elapsed);
+  curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &raw_url);
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &new_connections);
+  HTTPResponse response(cpr::Response{static_cast<std::int32_t>(response_code), std::move(response_string),
+                                      cpr::util::parseHeader(header_string), std::string(raw_url ? raw_url : ""),
+                                      elapsed, cpr::Cookies{}, cpr::Error(curl_error, std::string(error_buffer))});
+  // 选项中的指针在handle归还前清除，避免下次使用前悬空
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, nullptr);
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, nullptr);
+  curl_slist_free_all(chunk);
+  pool.Release(host, curl, curl_error == CURLE_OK && new_connections == 0);
+  return response;
 }
 
 std::string HTTPRequest::GetUrl() const {
   return this->url;
 }
 
+std::string HTTPRequest::GetBatchKey() const {
+  std::string key;
+  for (auto& field : {method, url, parameters}) {
+    key.append(field).push_back('\0');
+  }
+  for (auto& item : header) {
+    key.append(item.first).push_back('\0');
+    key.append(item.second).push_back('\0');
+  }
+  for (long value : {max_redirects, timeout, connect_timeout, static_cast<long>(deflate)}) {
+    key.append(std::to_string(value)).push_back('\0');
+  }
+  return key;
+}
+
+std::shared_ptr<HTTPRequest> HTTPRequest::Merge(const std::vector<std::shared_ptr<HTTPRequest>>& requests) {
+  auto& first = requests.front();
+  auto merged = std::make_shared<HTTPRequest>();
+  merged->method = first->method;
+  merged->url = first->url;
+  merged->parameters = first->parameters;
+  merged->header = first->header;
+  merged->max_redirects = first->max_redirects;
+  merged->timeout = first->timeout;
+  merged->connect_timeout = first->connect_timeout;
+  // 各片段直接输入压缩流，不拼接出完整的未压缩数据
+  static const std::string open = "[", comma = ",", close = "]";
+  std::vector<std::string> inner;
+  inner.reserve(requests.size());
+  std::vector<const std::string*> parts{&open};
+  for (auto& request : requests) {
+    auto& body = request->body;
+    if (body.size() >= 2 && body.front() == '[' && body.back() == ']') {
+      if (body.size() == 2) {
+        continue;
+      }
+      inner.emplace_back(body, 1, body.size() - 2);
+      parts.push_back(parts.size() > 1 ? &comma : nullptr);
+      parts.push_back(&inner.back());
+    } else {
+      parts.push_back(parts.size() > 1 ? &comma : nullptr);
+      parts.push_back(&body);
+    }
+  }
+  parts.push_back(&close);
+  parts.erase(std::remove(parts.begin(), parts.end(), nullptr), parts.end());
+  if (first->deflate) {
+    merged->deflate = merged->deflated = true;
+    if (!Deflate(parts, merged->body, merged->error)) {
+      return merged;
+    }
+  } else {
+    for (auto part : parts) {
+      merged->body.append(*part);
+    }
+  }
+  return merged;
+}
+
+size_t RequestBatcher::window_ms = 1000;
+size_t RequestBatcher::max_bytes = 1024 * 1024;
+size_t RequestBatcher::capacity = 100;
+
+// 不析构，与HTTPClientPool相同
+RequestBatcher& RequestBatcher::GetInstance() {
+  static RequestBatcher* instance = new RequestBatcher();
+  return *instance;
+}
+
+void RequestBatcher::Add(std::shared_ptr<HTTPRequest> request) {
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    // Stop在锁外join，thread仍是joinable，此时再给它赋值会std::terminate
+    stop_cv.wait(lock, [this] { return !stopping; });
+    if (ring.size() != capacity) {
+      // 容量变化时丢弃旧数据，只在ConfigInstance之后发生
+      stats.dropped += count;
+      ring.assign(std::max<size_t>(capacity, 1), nullptr);
+      head = count = pending_bytes = 0;
+    }
+    if (count == ring.size()) {
+      pending_bytes -= ring[head]->GetBodySize();
+      ring[head] = nullptr;
+      head = (head + 1) % ring.size();
+      count--;
+      stats.dropped++;
+    }
+    if (count == 0) {
+      deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(window_ms);
+    }
+    pending_bytes += request->GetBodySize();
+    ring[(head + count) % ring.size()] = std::move(request);
+    count++;
+    stats.queued++;
+    if (!running) {
+      running = true;
+      thread = std::thread(&RequestBatcher::Run, this);
+    }
+  }
+  cv.notify_one();
+}
+
+void RequestBatcher::Stop(bool flush) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!running) {
+      return;
+    }
+    running = false;
+    stopping = true;
+    flush_on_stop = flush;
+  }
+  cv.notify_one();
+  if (thread.joinable()) {
+    thread.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = false;
+  }
+  stop_cv.notify_all();
+}
+
+RequestBatchStats RequestBatcher::GetStats() {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto rst = stats;
+  rst.pending = count;
+  return rst;
+}
+
+void RequestBatcher::Run() {
+  std::unique_lock<std::mutex> lock(mtx);
+  while (running) {
+    if (count == 0) {
+      cv.wait(lock);
+    } else if (pending_bytes < max_bytes && std::chrono::steady_clock::now() < deadline) {
+      cv.wait_until(lock, deadline);
+    } else {
+      Flush(lock);
+    }
+  }
+  if (flush_on_stop && count > 0) {
+    Flush(lock);
+  }
+  // 与线程池析构时丢弃队列中的任务一致，停止时等待中的请求也被丢弃
+  for (size_t i = 0; i < count; i++) {
+    ring[(head + i) % ring.size()] = nullptr;
+  }
+  stats.dropped += count;
+  head = count = pending_bytes = 0;
+}
+
+// 按key分组，组内保持进入队列的顺序，每个合并的请求不超过max_bytes
+void RequestBatcher::Flush(std::unique_lock<std::mutex>& lock) {
+  std::vector<std::shared_ptr<HTTPRequest>> requests;
+  requests.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    auto& slot = ring[(head + i) % ring.size()];
+    requests.push_back(std::move(slot));
+  }
+  head = count = pending_bytes = 0;
+  lock.unlock();
+
+  std::vector<std::pair<std::string, std::vector<std::shared_ptr<HTTPRequest>>>> groups;
+  std::unordered_map<std::string, size_t> index;
+  for (auto& request : requests) {
+    auto key = request->GetBatchKey();
+    auto it = index.find(key);
+    if (it == index.end()) {
+      it = index.emplace(key, groups.size()).first;
+      groups.emplace_back(key, std::vector<std::shared_ptr<HTTPRequest>>());
+    }
+    groups[it->second].second.push_back(std::move(request));
+  }
+  uint64_t batches = 0, dropped = 0;
+  for (auto& group : groups) {
+    auto& items = group.second;
+    for (size_t begin = 0; begin < items.size();) {
+      size_t end = begin, bytes = 0;
+      while (end < items.size() && (end == begin || bytes + items[end]->GetBodySize() <= max_bytes)) {
+        bytes += items[end++]->GetBodySize();
+      }
+      std::vector<std::shared_ptr<HTTPRequest>> chunk(items.begin() + begin, items.begin() + end);
+      if (AsyncRequest::GetInstance().Submit(HTTPRequest::Merge(chunk))) {
+        batches++;
+      } else {
+        dropped += chunk.size();
+      }
+      begin = end;
+    }
+  }
+
+  lock.lock();
+  stats.batches += batches;
+  stats.dropped += dropped;
+}
+
 size_t AsyncRequest::pool_size = 1;
 size_t AsyncRequest::queue_cap = 1;
 
 AsyncRequest::AsyncRequest(std::shared_ptr<ThreadPool> pool) : pool(pool) {}
 
 bool AsyncRequest::Submit(std::shared_ptr<HTTPRequest> request) {
-  return pool->Post([request]() {
-    auto response = request->GetResponse();
+  return Submit(request, [request](HTTPResponse& response) {
     if (response.error) {
       Platform::logger(std::string("async request failed; url: ") + request->GetUrl() +
                        ", errMsg: " + response.error.message + std::string("\n"));
@@ -243,13 +658,43 @@ bool AsyncRequest::Submit(std::shared_ptr<HTTPRequest> request) {
   });
 }
 
+bool AsyncRequest::Submit(std::shared_ptr<HTTPRequest> request, std::function<void(HTTPResponse&)> callback) {
+  return pool->Post([request, callback]() {
+    auto response = request->GetResponse();
+    callback(response);
+  });
+}
+
 size_t AsyncRequest::GetQueueSize() {
   return pool->GetQueueSize();
 }
 
+ThreadPoolStats AsyncRequest::GetPoolStats() {
+  return pool->GetStats();
+}
+
+RequestBatchStats AsyncRequest::GetBatchStats() {
+  return RequestBatcher::GetInstance().GetStats();
+}
+
+void AsyncRequest::ConfigBatch(size_t window_ms, size_t max_bytes) {
+  RequestBatcher::window_ms = window_ms;
+  RequestBatcher::max_bytes = max_bytes;
+}
+
+HTTPClientStats AsyncRequest::GetClientStats() {
+  return HTTPClientPool::GetInstance().GetStats();
+}
+
+void AsyncRequest::ConfigClient(size_t max_idle, size_t max_per_host) {
+  HTTPClientPool::max_idle = max_idle;
+  HTTPClientPool::max_per_host = std::max<size_t>(max_per_host, 1);
+}
+
 void AsyncRequest::ConfigInstance(size_t pool_size, size_t queue_cap) {
   AsyncRequest::pool_size = pool_size;
   AsyncRequest::queue_cap = queue_cap;
+  RequestBatcher::capacity = queue_cap;
 }
 
 AsyncRequest& AsyncRequest::GetInstance() {
@@ -260,8 +705,14 @@ AsyncRequest& AsyncRequest::GetInstance() {
   return instance;
 }
 
-void AsyncRequest::Terminate() {
-  GetInstance().pool.reset();
+void AsyncRequest::Terminate(size_t drain_ms) {
+  RequestBatcher::GetInstance().Stop(drain_ms > 0);
+  auto& pool = GetInstance().pool;
+  if (pool && drain_ms > 0) {
+    pool->Drain(std::chrono::milliseconds(drain_ms));
+  }
+  pool.reset();
+  HTTPClientPool::GetInstance().Clear();
 }
 
 }  // namespace openrasp_v8
\ No newline at end of file
@@ -16,10 +16,16 @@
 
 #pragma once
 #include <cpr/cpr.h>
+#include <curl/curl.h>
 #include <zlib.h>
 
 #include <algorithm>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "bundle.h"
 
@@ -32,18 +38,98 @@ class HTTPResponse : public cpr::Response {
   v8::Local<v8::Object> ToObject(v8::Isolate* isolate);
 };
 
-class HTTPRequest : public cpr::Session {
+// 复用curl easy handle，连接缓存在各个handle中，DNS和TLS会话缓存通过curl share共享
+// 同一host同时进行的请求数有上限，超出时等待其他请求归还handle
+class HTTPClientPool {
+ public:
+  static HTTPClientPool& GetInstance();
+  CURL* Acquire(const std::string& host, long timeout);
+  void Release(const std::string& host, CURL* curl, bool reused_connection);
+  void Clear();
+  HTTPClientStats GetStats();
+
+  static size_t max_idle;
+  static size_t max_per_host;
+
+ private:
+  HTTPClientPool();
+  static void Lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr);
+  static void Unlock(CURL* handle, curl_lock_data data, void* userptr);
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::vector<std::pair<std::string, CURL*>> idle;  // 空闲handle和它上次访问的host
+  std::unordered_map<std::string, size_t> active;
+  HTTPClientStats stats = {};
+  CURLSH* share = nullptr;
+  std::mutex share_mtx[CURL_LOCK_DATA_LAST];
+};
+
+// request_async的合并队列，同一key的请求在时间窗口内合并为一个请求发出
+// 等待合并的请求存放在固定容量的环形缓冲中，满时丢弃最早的请求
+class RequestBatcher {
+ public:
+  static RequestBatcher& GetInstance();
+  void Add(std::shared_ptr<HTTPRequest> request);
+  // 停止后台线程，flush为false时丢弃等待中的请求，下次Add时重新启动
+  void Stop(bool flush);
+  RequestBatchStats GetStats();
+
+  static size_t window_ms;
+  static size_t max_bytes;
+  static size_t capacity;
+
+ private:
+  RequestBatcher() = default;
+  void Run();
+  void Flush(std::unique_lock<std::mutex>& lock);
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::condition_variable stop_cv;  // Stop等待后台线程结束期间，Add在此等待
+  std::thread thread;
+  bool running = false;
+  bool stopping = false;
+  bool flush_on_stop = false;
+  std::vector<std::shared_ptr<HTTPRequest>> ring;
+  size_t head = 0;
+  size_t count = 0;
+  size_t pending_bytes = 0;
+  std::chrono::steady_clock::time_point deadline;
+  RequestBatchStats stats = {};
+};
+
+class HTTPRequest {
  public:
   HTTPRequest() = default;
   HTTPRequest(v8::Isolate* isolate, v8::Local<v8::Value> conf);
   void SetMethod(const std::string& method) { this->method = method; }
+  void SetUrl(const std::string& url) { this->url = url; }
   HTTPResponse GetResponse();
   std::string GetUrl() const;
+  bool HasError() const { return !error.empty(); }
+  // 配置了batch且数据是json时，可以与其他请求合并
+  bool IsBatchable() const { return batch && error.empty(); }
+  // 除数据外所有配置相同的请求才能合并
+  std::string GetBatchKey() const;
+  size_t GetBodySize() const { return body.size(); }
+  // 把数据合并为一个json数组，数组类型的数据会被展开，需要时压缩一次
+  static std::shared_ptr<HTTPRequest> Merge(const std::vector<std::shared_ptr<HTTPRequest>>& requests);
+  static bool Deflate(const std::vector<const std::string*>& parts, std::string& output, std::string& error);
 
  private:
   std::string method;
   std::string url;
   std::string error;
+  std::string parameters;
+  cpr::Header header;
+  cpr::Body body;
+  bool batch = false;
+  bool deflate = false;
+  bool deflated = false;  // body已经压缩，配置了batch的请求等到合并或发送时才压缩
+  long max_redirects = 3;
+  long timeout = 5000;
+  long connect_timeout = 5000;
 };
 
 }  // namespace openrasp_v8
\ No newline at end of file
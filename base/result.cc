@@ -0,0 +1,125 @@
+/*
+ * Copyright 2017-2019 Baidu Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include "bundle.h"
+
+namespace openrasp_v8 {
+
+namespace {
+// 空间不足时只累计长度不写入，调用方根据返回的长度扩容后重新编码
+class ResultWriter {
+ public:
+  ResultWriter(char* buffer, size_t capacity) : buffer(buffer), capacity(capacity) {}
+  template <typename T>
+  void Write(T value) {
+    Write(&value, sizeof(value));
+  }
+  void Write(const void* data, size_t length) {
+    if (size + length <= capacity) {
+      memcpy(buffer + size, data, length);
+    }
+    size += length;
+  }
+  void Write(v8::Isolate* isolate, v8::Local<v8::String> str) {
+    uint32_t length = str->Utf8Length(isolate);
+    Write(length);
+    if (size + length <= capacity) {
+      str->WriteUtf8(isolate, buffer + size, length, nullptr,
+                     v8::String::NO_NULL_TERMINATION | v8::String::REPLACE_INVALID_UTF8);
+    }
+    size += length;
+  }
+  size_t size = 0;
+
+ private:
+  char* buffer;
+  size_t capacity;
+};
+
+ResultAction ParseAction(v8::Isolate* isolate, v8::Local<v8::String> action) {
+  char buf[16];
+  int length = action->Length();
+  if (length >= sizeof(buf) || !action->ContainsOnlyOneByte()) {
+    return kResultOther;
+  }
+  action->WriteOneByte(isolate, reinterpret_cast<uint8_t*>(buf), 0, length, v8::String::NO_NULL_TERMINATION);
+  buf[length] = 0;
+  if (strcmp(buf, "log") == 0) {
+    return kResultLog;
+  } else if (strcmp(buf, "block") == 0) {
+    return kResultBlock;
+  } else if (strcmp(buf, "ignore") == 0) {
+    return kResultIgnore;
+  } else if (strcmp(buf, "exception") == 0) {
+    return kResultException;
+  }
+  return kResultOther;
+}
+}  // namespace
+
+size_t Isolate::WriteResults(v8::Local<v8::Context> context,
+                             v8::Local<v8::Array> results,
+                             char* buffer,
+                             size_t capacity) {
+  auto isolate = this;
+  v8::HandleScope handle_scope(isolate);
+  v8::TryCatch try_catch(isolate);
+  auto key_action = NewV8Key(isolate, "action", 6);
+  auto key_message = NewV8Key(isolate, "message", 7);
+  auto key_name = NewV8Key(isolate, "name", 4);
+  auto key_confidence = NewV8Key(isolate, "confidence", 10);
+  ResultWriter writer(buffer, capacity);
+  for (uint32_t i = 0; i < results->Length(); i++) {
+    v8::Local<v8::Value> item;
+    if (!results->Get(context, i).ToLocal(&item) || !item->IsObject()) {
+      continue;
+    }
+    auto result = item.As<v8::Object>();
+    v8::Local<v8::Value> value;
+    v8::Local<v8::String> action, message, name;
+    int32_t confidence = 0;
+    if (!result->Get(context, key_action).ToLocal(&value) || !value->ToString(context).ToLocal(&action) ||
+        !result->Get(context, key_message).ToLocal(&value) || !value->ToString(context).ToLocal(&message) ||
+        !result->Get(context, key_name).ToLocal(&value) || !value->ToString(context).ToLocal(&name) ||
+        !result->Get(context, key_confidence).ToLocal(&value) || !value->Int32Value(context).To(&confidence)) {
+      continue;
+    }
+    // make_result只保证这四个字段，插件附加了其他字段或者action无法用枚举表示时，带上完整的json
+    uint8_t type = ParseAction(isolate, action);
+    uint8_t flags = 0;
+    v8::Local<v8::Array> keys;
+    v8::Local<v8::String> json;
+    if (type == kResultOther ||
+        (result->GetOwnPropertyNames(context).ToLocal(&keys) && keys->Length() > 4)) {
+      if (v8::JSON::Stringify(context, result).ToLocal(&json)) {
+        flags |= kResultHasJson;
+      }
+    }
+    writer.Write(type);
+    writer.Write(flags);
+    writer.Write<uint16_t>(0);
+    writer.Write(confidence);
+    writer.Write(isolate, name);
+    writer.Write(isolate, message);
+    if (flags & kResultHasJson) {
+      writer.Write(isolate, json);
+    }
+  }
+  return writer.size;
+}
+
+}  // namespace openrasp_v8
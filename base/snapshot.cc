@@ -15,39 +15,274 @@
  */
 
 #include <cstdio>
+#include <cstring>
 #include "bundle.h"
 #include "flex/flex.h"
 #include "gen/builtins.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace openrasp_v8 {
 
+static const char snapshot_magic[8] = {'O', 'R', 'V', '8', 'S', 'N', 'A', 'P'};
+static const uint32_t snapshot_format_version = 1;
+
+uint64_t Snapshot::flags_hash = 0;
+
+// FNV-1a
+uint64_t Snapshot::Hash(const char* data, size_t size, uint64_t seed) {
+  uint64_t hash = seed;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint32_t Snapshot::Crc32(const char* data, size_t size) {
+  static const std::vector<uint32_t> table = []() {
+    std::vector<uint32_t> table(256);
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+    return table;
+  }();
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < size; i++) {
+    crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+// 函数地址受ASLR影响，但同一份二进制中各函数相对第一个函数的偏移不变，native方法表变化或者换了二进制都会改变hash
+static uint64_t ExternalReferencesHash() {
+  uint64_t hash = Snapshot::Hash(nullptr, 0);
+  for (intptr_t* ref = Snapshot::external_references; *ref; ref++) {
+    intptr_t offset = *ref - Snapshot::external_references[0];
+    hash = Snapshot::Hash(reinterpret_cast<const char*>(&offset), sizeof(offset), hash);
+  }
+  return hash;
+}
+
+void Snapshot::FillHeader(SnapshotHeader& header) const {
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+  header.format_version = snapshot_format_version;
+  header.header_size = sizeof(header);
+  const char* version = v8::V8::GetVersion();
+  header.v8_version_hash = Hash(version, strlen(version));
+  header.flags_hash = flags_hash;
+  header.external_references_hash = ExternalReferencesHash();
+  header.plugin_digest = plugin_digest;
+  header.data_size = raw_size;
+  header.checksum = Crc32(data, raw_size);
+}
+
+bool Snapshot::IsCompatible(const SnapshotHeader& header) {
+  const char* version = v8::V8::GetVersion();
+  return memcmp(header.magic, snapshot_magic, sizeof(header.magic)) == 0 &&
+         header.format_version == snapshot_format_version && header.header_size == sizeof(header) &&
+         header.v8_version_hash == Hash(version, strlen(version)) && header.flags_hash == flags_hash &&
+         header.external_references_hash == ExternalReferencesHash();
+}
+
 Snapshot::Snapshot(const char* data, size_t raw_size, uint64_t timestamp)
     : v8::StartupData({data, static_cast<int>(raw_size)}), timestamp(timestamp) {}
+// 只读映射快照文件，多个进程载入同一个文件时共享物理页，头部不兼容或者校验失败时IsOk()为false
 Snapshot::Snapshot(const std::string& path, uint64_t timestamp) : v8::StartupData({nullptr, 0}), timestamp(timestamp) {
-  char* buffer = nullptr;
+  Load(path);
+}
+
+bool Snapshot::Load(const std::string& path, uint64_t digest) {
+  char* base = nullptr;
   size_t size = 0;
-  std::ifstream file(path, std::ios::in | std::ios::binary);
-  if (file) {
-    file.seekg(0, std::ios::end);
-    size = file.tellg();
-    file.seekg(0, std::ios::beg);
-    if (size > 0) {
-      buffer = new char[size];
-      if (!file.read(buffer, size)) {
-        delete[] buffer;
-        return;
-      }
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER file_size;
+  if (GetFileSizeEx(file, &file_size) && file_size.QuadPart >= static_cast<LONGLONG>(sizeof(SnapshotHeader))) {
+    HANDLE file_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (file_mapping) {
+      base = static_cast<char*>(MapViewOfFile(file_mapping, FILE_MAP_READ, 0, 0, 0));
+      size = file_size.QuadPart;
+      CloseHandle(file_mapping);
+    }
+  }
+  CloseHandle(file);
+  if (!base) {
+    return false;
+  }
+#else
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(SnapshotHeader))) {
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr != MAP_FAILED) {
+      base = static_cast<char*>(addr);
+      size = st.st_size;
     }
   }
-  this->data = buffer;
-  this->raw_size = size;
+  close(fd);
+  if (!base) {
+    return false;
+  }
+#endif
+  SnapshotHeader header;
+  memcpy(&header, base, sizeof(header));
+  // 先比较头部，最后才计算整个快照数据的校验和
+  if (!IsCompatible(header) || (digest && header.plugin_digest != digest) ||
+      header.data_size != size - sizeof(header) || header.data_size > INT32_MAX || header.checksum != Crc32(base + sizeof(header), header.data_size)) {
+#ifdef _WIN32
+    UnmapViewOfFile(base);
+#else
+    munmap(base, size);
+#endif
+    return false;
+  }
+  this->mapping = base;
+  this->mapping_size = size;
+  this->data = base + sizeof(header);
+  this->raw_size = static_cast<int>(header.data_size);
+  this->plugin_digest = header.plugin_digest;
+  return true;
+}
+
+static std::mutex cache_mtx;
+static std::string cache_directory;
+static bool cache_in_memory = false;
+static uint64_t cache_digest = 0;
+static std::vector<char> cache_blob;
+
+void Snapshot::ConfigCache(const std::string& directory, bool in_memory) {
+  std::lock_guard<std::mutex> lock(cache_mtx);
+  cache_directory = directory;
+  cache_in_memory = in_memory;
+  if (!in_memory) {
+    std::vector<char>().swap(cache_blob);
+  }
+}
+
+static std::string CachePath(const std::string& directory, uint64_t digest) {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.snapshot", static_cast<unsigned long long>(digest));
+  return directory + "/" + name;
+}
+
+// 内存中只保留最近一次生成的快照，重复下发相同配置时命中
+bool Snapshot::LoadFromCache() {
+  std::lock_guard<std::mutex> lock(cache_mtx);
+  if (cache_in_memory && cache_digest == plugin_digest && !cache_blob.empty()) {
+    char* buffer = new char[cache_blob.size()];
+    memcpy(buffer, cache_blob.data(), cache_blob.size());
+    this->data = buffer;
+    this->raw_size = cache_blob.size();
+    return true;
+  }
+  return !cache_directory.empty() && Load(CachePath(cache_directory, plugin_digest), plugin_digest);
 }
+
+void Snapshot::SaveToCache() const {
+  if (!IsOk()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(cache_mtx);
+  if (cache_in_memory) {
+    cache_digest = plugin_digest;
+    cache_blob.assign(data, data + raw_size);
+  }
+  if (!cache_directory.empty()) {
+    Save(CachePath(cache_directory, plugin_digest));
+  }
+}
+static std::mutex warmup_mtx;
+static std::vector<WarmupCall> warmup_corpus;
+
+void Snapshot::ConfigWarmup(const std::vector<WarmupCall>& corpus) {
+  std::lock_guard<std::mutex> lock(warmup_mtx);
+  warmup_corpus = corpus;
+}
+
+// 通过RASP.check执行预热调用，检测函数被编译后，字节码随快照保存
+static void Warmup(Isolate* isolate, v8::Local<v8::Context> context, const std::vector<WarmupCall>& corpus) {
+  v8::HandleScope handle_scope(isolate);
+  v8::TryCatch try_catch(isolate);
+  v8::Local<v8::Value> rasp, check;
+  if (!context->Global()->Get(context, NewV8Key(isolate, "RASP")).ToLocal(&rasp) || !rasp->IsObject() ||
+      !rasp.As<v8::Object>()->Get(context, NewV8Key(isolate, "check")).ToLocal(&check) || !check->IsFunction()) {
+    return;
+  }
+  auto data = isolate->GetData();
+  auto& watchdog = Watchdog::GetInstance();
+  watchdog.Register(isolate);
+  data->is_warmup = true;
+  for (auto& call : corpus) {
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Value> params;
+    if (!v8::JSON::Parse(context, NewV8String(isolate, call.params)).ToLocal(&params) || !params->IsObject()) {
+      try_catch.Reset();
+      continue;
+    }
+    v8::Local<v8::Value> argv[]{NewV8String(isolate, call.type), params, v8::Object::New(isolate)};
+    watchdog.Arm(data, 100);
+    check.As<v8::Function>()->Call(context, rasp, 3, argv).IsEmpty();
+    watchdog.Disarm(data);
+    if (data->is_timeout || try_catch.HasTerminated()) {
+      data->is_timeout = false;
+      isolate->CancelTerminateExecution();
+    }
+    isolate->RunMicrotasks();
+    try_catch.Reset();
+  }
+  data->is_warmup = false;
+  watchdog.Unregister(isolate);
+}
+
 Snapshot::Snapshot(const std::string& config,
                    const std::vector<PluginFile>& plugin_list,
                    const std::string& version,
                    uint64_t timestamp,
                    void* custom_data)
     : v8::StartupData({nullptr, 0}), timestamp(timestamp) {
+  // 内置js和v8 flags变化后缓存的快照也不能再用，内存缓存不经过IsCompatible，所以一并计入digest
+  plugin_digest = Hash(reinterpret_cast<const char*>(gen_builtins), gen_builtins_len);
+  plugin_digest = Hash(reinterpret_cast<const char*>(&flags_hash), sizeof(flags_hash), plugin_digest);
+  plugin_digest = Hash(version.data(), version.size(), plugin_digest);
+  plugin_digest = Hash(config.data(), config.size(), plugin_digest);
+  for (auto& plugin_src : plugin_list) {
+    plugin_digest = Hash(plugin_src.filename.data(), plugin_src.filename.size() + 1, plugin_digest);
+    plugin_digest = Hash(plugin_src.source.data(), plugin_src.source.size() + 1, plugin_digest);
+  }
+  std::vector<WarmupCall> corpus;
+  {
+    std::lock_guard<std::mutex> lock(warmup_mtx);
+    corpus = warmup_corpus;
+  }
+  for (auto& call : corpus) {
+    plugin_digest = Hash(call.type.data(), call.type.size() + 1, plugin_digest);
+    plugin_digest = Hash(call.params.data(), call.params.size() + 1, plugin_digest);
+  }
+  // 内容相同的快照已经生成过，不必再执行插件
+  if (LoadFromCache()) {
+    return;
+  }
   IsolateData data;
   data.custom_data = custom_data;
   v8::SnapshotCreator creator(external_references);
@@ -86,6 +321,26 @@ Snapshot::Snapshot(const std::string& config,
             context, NewV8Key(isolate, "request_async"),
             v8::Function::New(context, reinterpret_cast<v8::FunctionCallback>(external_references[3])).ToLocalChecked())
         .IsJust();
+    global
+        ->Set(
+            context, NewV8Key(isolate, "lcs_search"),
+            v8::Function::New(context, reinterpret_cast<v8::FunctionCallback>(external_references[4])).ToLocalChecked())
+        .IsJust();
+    global
+        ->Set(
+            context, NewV8Key(isolate, "token_range"),
+            v8::Function::New(context, reinterpret_cast<v8::FunctionCallback>(external_references[5])).ToLocalChecked())
+        .IsJust();
+    global
+        ->Set(
+            context, NewV8Key(isolate, "ac_compile"),
+            v8::Function::New(context, reinterpret_cast<v8::FunctionCallback>(external_references[6])).ToLocalChecked())
+        .IsJust();
+    global
+        ->Set(
+            context, NewV8Key(isolate, "ac_match"),
+            v8::Function::New(context, reinterpret_cast<v8::FunctionCallback>(external_references[7])).ToLocalChecked())
+        .IsJust();
     if (isolate->ExecScript({reinterpret_cast<const char*>(gen_builtins), gen_builtins_len}, "builtins.js").IsEmpty()) {
       Exception e(isolate, try_catch);
       Platform::logger(e);
@@ -102,28 +357,52 @@ Snapshot::Snapshot(const std::string& config,
         Platform::logger(e);
       }
     }
+    if (!corpus.empty()) {
+      Warmup(isolate, context, corpus);
+    }
+    // 插件载入时发出的请求不会在这个isolate中完成，data在creator之后析构，其中的v8::Global必须先释放
+    data.pending_requests.clear();
     creator.SetDefaultContext(context);
   }
-  v8::StartupData snapshot = creator.CreateBlob(v8::SnapshotCreator::FunctionCodeHandling::kClear);
+  v8::StartupData snapshot = creator.CreateBlob(corpus.empty() ? v8::SnapshotCreator::FunctionCodeHandling::kClear
+                                                                 : v8::SnapshotCreator::FunctionCodeHandling::kKeep);
   this->data = snapshot.data;
   this->raw_size = snapshot.raw_size;
+  SaveToCache();
 }
 Snapshot::~Snapshot() {
+  if (mapping) {
+#ifdef _WIN32
+    UnmapViewOfFile(mapping);
+#else
+    munmap(mapping, mapping_size);
+#endif
+    return;
+  }
   delete[] data;
 }
 bool Snapshot::Save(const std::string& path) const {
+  if (!IsOk()) {
+    return false;
+  }
+  SnapshotHeader header;
+  FillHeader(header);
   std::string tmp_path = path + ".tmp";
   std::ofstream file(tmp_path, std::ios::out | std::ios::binary | std::ios::trunc);
   if (file) {
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
     file.write(data, raw_size);
     file.close();
-    if (!static_cast<bool>(file)) {
-      return false;
+    // windows上rename不能覆盖已存在的文件
+#ifdef _WIN32
+    bool ok = static_cast<bool>(file) && MoveFileExA(tmp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    bool ok = static_cast<bool>(file) && std::rename(tmp_path.c_str(), path.c_str()) == 0;
+#endif
+    if (!ok) {
+      std::remove(tmp_path.c_str());
     }
-    if (std::rename(tmp_path.c_str(), path.c_str())) {
-      return false;
-    }
-    return true;
+    return ok;
   }
   // check errno when return value is false
   return false;
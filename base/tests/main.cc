@@ -2,10 +2,17 @@
 #define CATCH_CONFIG_ENABLE_BENCHMARKING
 #include <atomic>
 #include <chrono>
+#include <fstream>
 #include <iostream>
 #include <thread>
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 #include "../bundle.h"
+#include "../flex/flex.h"
 #include "../request.h"
 #include "../thread-pool.h"
 #include "catch2/catch.hpp"
@@ -27,7 +34,14 @@ typedef std::unique_ptr<openrasp_v8::Isolate, IsolateDeleter> IsolatePtr;
 
 struct Listener : Catch::TestEventListenerBase {
   using TestEventListenerBase::TestEventListenerBase;  // inherit constructor
-  void testRunStarting(Catch::TestRunInfo const& testRunInfo) override { Initialize(0, plugin_log); }
+  void testRunStarting(Catch::TestRunInfo const& testRunInfo) override {
+    // 内存配置只能在Initialize之前选择，OPENRASP_V8_TEST_PROFILE=throughput时使用吞吐优先的配置
+    const char* profile = std::getenv("OPENRASP_V8_TEST_PROFILE");
+    if (profile && std::string(profile) == "throughput") {
+      Isolate::ConfigMemoryProfile(MemoryProfile::Throughput());
+    }
+    Initialize(0, plugin_log);
+  }
   void testRunEnded(Catch::TestRunStats const& testRunStats) override { Dispose(); }
 };
 CATCH_REGISTER_LISTENER(Listener);
@@ -92,6 +106,38 @@ TEST_CASE("Bench", "[!benchmark]") {
     printf("total_heap_size:     %zu (KB)\n", stat.total_heap_size() / 1024);
     printf("used_heap_size:      %zu (KB)\n", stat.used_heap_size() / 1024);
   }
+
+  // 对比预热并保留编译代码的快照：快照大小和新isolate首次检测的耗时
+  for (bool warmup : {false, true}) {
+    if (warmup) {
+      Snapshot::ConfigWarmup({{"request", R"({"action":"ignore","message":"1234567890","name":"test","confidence":0})"}});
+    }
+    Snapshot snapshot("", {{"test", R"(
+        const plugin = new RASP('test')
+        plugin.register('request', params => params)
+    )"}},
+                      "1.2.3", 100);
+    Snapshot::ConfigWarmup({});
+    auto start = std::chrono::steady_clock::now();
+    auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+    REQUIRE(isolate != nullptr);
+    IsolatePtr ptr(isolate);
+    isolate->Initialize();
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+    v8::Context::Scope context_scope(v8_context);
+    auto type = NewV8String(isolate, "request");
+    auto json = NewV8String(isolate, R"({"action":"log","message":"1234567890","name":"test","confidence":0})");
+    auto params = v8::JSON::Parse(v8_context, json).ToLocalChecked().As<v8::Object>();
+    auto rst = isolate->Check(type, params, v8::Object::New(isolate), 100);
+    auto end = std::chrono::steady_clock::now();
+    REQUIRE(rst->Length() == 1);
+    printf("\nsnapshot %s\n", warmup ? "with warmup" : "without warmup");
+    printf("raw_size:            %d (KB)\n", snapshot.raw_size / 1024);
+    printf("first check:         %lld (us)\n",
+           static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()));
+  }
 }
 class DummyTask : public v8::Task {
  public:
@@ -175,6 +221,123 @@ TEST_CASE("Snapshot") {
     Snapshot snapshot2("openrasp-v8-base-tests-snapshot", 1000);
     REQUIRE(snapshot1.raw_size == snapshot2.raw_size);
     REQUIRE(memcmp(snapshot1.data, snapshot2.data, snapshot1.raw_size) == 0);
+    REQUIRE(snapshot1.plugin_digest == snapshot2.plugin_digest);
+  }
+
+  SECTION("Header") {
+    Snapshot snapshot1("", std::vector<PluginFile>(), "1.2.3", 1000, nullptr);
+    Snapshot snapshot2("", std::vector<PluginFile>(), "1.2.4", 1000, nullptr);
+    REQUIRE(snapshot1.plugin_digest != snapshot2.plugin_digest);
+    snapshot1.Save("openrasp-v8-base-tests-snapshot");
+    std::string content;
+    {
+      std::ifstream file("openrasp-v8-base-tests-snapshot", std::ios::in | std::ios::binary);
+      content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    REQUIRE(content.size() == sizeof(SnapshotHeader) + snapshot1.raw_size);
+    SnapshotHeader header;
+    memcpy(&header, content.data(), sizeof(header));
+    REQUIRE(Snapshot::IsCompatible(header));
+    auto load = [](const std::string& content) {
+      {
+        std::ofstream file("openrasp-v8-base-tests-snapshot", std::ios::out | std::ios::binary | std::ios::trunc);
+        file.write(content.data(), content.size());
+      }
+      return Snapshot("openrasp-v8-base-tests-snapshot", 1000).IsOk();
+    };
+    REQUIRE(load(content));
+    SECTION("headerless") {
+      REQUIRE_FALSE(load(content.substr(sizeof(SnapshotHeader))));
+    }
+    SECTION("truncated") {
+      REQUIRE_FALSE(load(content.substr(0, content.size() - 1)));
+    }
+    SECTION("corrupted") {
+      content[content.size() / 2] ^= 1;
+      REQUIRE_FALSE(load(content));
+    }
+    SECTION("incompatible") {
+      header.v8_version_hash++;
+      memcpy(&content[0], &header, sizeof(header));
+      REQUIRE_FALSE(load(content));
+    }
+  }
+
+  SECTION("Cache") {
+    std::vector<PluginFile> plugin_list{{"wrong-syntax", "wrong syntax"}};
+    SECTION("memory") {
+      Snapshot::ConfigCache("", true);
+    }
+    SECTION("directory") {
+      Snapshot::ConfigCache(".", false);
+    }
+    message = "";
+    Snapshot snapshot1("", plugin_list, "1.2.3", 1000, nullptr);
+    REQUIRE(message != "");
+    message = "";
+    Snapshot snapshot2("", plugin_list, "1.2.3", 2000, nullptr);
+    REQUIRE(message == "");
+    REQUIRE(snapshot2.timestamp == 2000);
+    REQUIRE(snapshot1.plugin_digest == snapshot2.plugin_digest);
+    REQUIRE(snapshot1.raw_size == snapshot2.raw_size);
+    REQUIRE(memcmp(snapshot1.data, snapshot2.data, snapshot1.raw_size) == 0);
+    Snapshot snapshot3("", plugin_list, "1.2.4", 1000, nullptr);
+    REQUIRE(message != "");
+    message = "";
+    uint64_t flags_hash = Snapshot::flags_hash;
+    Snapshot::flags_hash++;
+    Snapshot snapshot4("", plugin_list, "1.2.3", 1000, nullptr);
+    Snapshot::flags_hash = flags_hash;
+    REQUIRE(message != "");
+    REQUIRE(snapshot4.plugin_digest != snapshot1.plugin_digest);
+    Snapshot::ConfigCache("", false);
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.snapshot", static_cast<unsigned long long>(snapshot1.plugin_digest));
+    std::remove(name);
+    snprintf(name, sizeof(name), "%016llx.snapshot", static_cast<unsigned long long>(snapshot3.plugin_digest));
+    std::remove(name);
+    snprintf(name, sizeof(name), "%016llx.snapshot", static_cast<unsigned long long>(snapshot4.plugin_digest));
+    std::remove(name);
+  }
+
+  SECTION("Warmup") {
+    std::vector<PluginFile> plugin_list{{"test", R"(
+        const plugin = new RASP('test')
+        plugin.register('request', params => {
+          if (params.loop) {
+            while (true);
+          }
+          if (params.throw) {
+            throw new Error('warmup')
+          }
+          if (params.request) {
+            RASP.request_async({ url: 'http://127.0.0.1:1/' })
+            return RASP.request({ url: 'http://127.0.0.1:1/' }).catch(e => { global.request_error = e.error.message })
+          }
+          global.warmed = (global.warmed || 0) + 1
+        })
+    )"}};
+    Snapshot::ConfigWarmup({{"request", "{}"}, {"request", R"({"loop":true})"}, {"request", R"({"throw":true})"},
+                            {"request", "wrong json"}, {"unknown", "{}"}, {"request", R"({"request":true})"},
+                            {"request", "{}"}});
+    Snapshot snapshot1("", plugin_list, "1.2.3", 1000, nullptr);
+    Snapshot::ConfigWarmup({});
+    Snapshot snapshot2("", plugin_list, "1.2.3", 1000, nullptr);
+    REQUIRE(snapshot1.IsOk());
+    REQUIRE(snapshot1.plugin_digest != snapshot2.plugin_digest);
+    auto isolate = Isolate::New(&snapshot1, snapshot1.timestamp);
+    REQUIRE(isolate != nullptr);
+    IsolatePtr ptr(isolate);
+    isolate->Initialize();
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+    v8::Context::Scope context_scope(v8_context);
+    auto maybe_rst = isolate->ExecScript("warmed", "warmed");
+    REQUIRE(maybe_rst.ToLocalChecked()->Int32Value(v8_context).FromJust() == 2);
+    maybe_rst = isolate->ExecScript("request_error", "request_error");
+    REQUIRE(*v8::String::Utf8Value(isolate, maybe_rst.ToLocalChecked()) ==
+            std::string("request is not available during warmup"));
   }
 
   SECTION("IsOK") {
@@ -254,6 +417,23 @@ TEST_CASE("Isolate") {
       REQUIRE(maybe_rst.ToLocalChecked()->NumberValue(isolate->GetCurrentContext()).ToChecked() == 2);
     }
   }
+
+  SECTION("late register") {
+    auto type = NewV8String(isolate, "command");
+    auto params = v8::Object::New(isolate);
+    auto context = v8::Object::New(isolate);
+    REQUIRE(isolate->Check(type, params, context)->Length() == 0);
+    REQUIRE_FALSE(isolate->ExecScript(R"(
+        const plugin = new RASP('late')
+        plugin.register('command', () => ({ action: 'log', message: 'late', confidence: 90 }))
+      )",
+                                      "late.js")
+                      .IsEmpty());
+    REQUIRE(isolate->Check(type, params, context)->Length() == 1);
+    // 改坏的检测点不影响其他检测点
+    REQUIRE_FALSE(isolate->ExecScript("RASP.checkPoints.sql = 1; RASP.checkPoints.xss = [1, {}]", "bad.js").IsEmpty());
+    REQUIRE(isolate->Check(type, params, context)->Length() == 1);
+  }
 }
 
 TEST_CASE("Exception") {
@@ -331,6 +511,52 @@ TEST_CASE("TimeoutTask") {
   }
 }
 
+TEST_CASE("Watchdog") {
+  Snapshot snapshot("", std::vector<PluginFile>(), "1.2.3", 1000);
+  auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+  REQUIRE(isolate != nullptr);
+  IsolatePtr ptr(isolate);
+  isolate->Initialize();
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+  v8::Context::Scope context_scope(v8_context);
+  auto& watchdog = Watchdog::GetInstance();
+
+  SECTION("Not Timeout") {
+    watchdog.Arm(isolate->GetData(), 100);
+    isolate->ExecScript("for(let i=0;i<10;i++);", "loop");
+    watchdog.Disarm(isolate->GetData());
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    REQUIRE_FALSE(isolate->GetData()->is_timeout);
+    auto maybe_rst = isolate->ExecScript("1+1", "test");
+    REQUIRE_FALSE(maybe_rst.IsEmpty());
+  }
+
+  SECTION("Timeout") {
+    auto start = std::chrono::high_resolution_clock::now().time_since_epoch().count() / 1000;
+    watchdog.Arm(isolate->GetData(), 100);
+    isolate->ExecScript("for(;;);", "loop");
+    watchdog.Disarm(isolate->GetData());
+    auto end = std::chrono::high_resolution_clock::now().time_since_epoch().count() / 1000;
+    REQUIRE(end - start >= 100);
+    REQUIRE(isolate->GetData()->is_timeout);
+    isolate->GetData()->is_timeout = false;
+    isolate->CancelTerminateExecution();
+  }
+
+  SECTION("Restart") {
+    watchdog.Stop();
+    watchdog.Start();
+    watchdog.Arm(isolate->GetData(), 100);
+    isolate->ExecScript("for(;;);", "loop");
+    watchdog.Disarm(isolate->GetData());
+    REQUIRE(isolate->GetData()->is_timeout);
+    isolate->GetData()->is_timeout = false;
+    isolate->CancelTerminateExecution();
+  }
+}
+
 TEST_CASE("Flex") {
   Snapshot snapshot("", std::vector<PluginFile>(), "1.2.3", 1000);
   auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
@@ -347,6 +573,276 @@ TEST_CASE("Flex") {
   REQUIRE(
       std::string(*v8::String::Utf8Value(isolate, maybe_rst.ToLocalChecked())) ==
       R"([{"start":0,"stop":1,"text":"a"},{"start":2,"stop":4,"text":"bb"},{"start":11,"stop":14,"text":"ccc"},{"start":15,"stop":19,"text":"dddd"}])");
+  maybe_rst = isolate->ExecScript(R"(
+    const view = RASP.sql_tokenize_view('a bb       ccc dddd   ')
+    JSON.stringify([view.length, view.start(1), view.stop(1), view.text(2), view.token(3), RASP.sql_tokenize('')])
+  )",
+                                  "flex");
+  REQUIRE(std::string(*v8::String::Utf8Value(isolate, maybe_rst.ToLocalChecked())) ==
+          R"([4,2,4,"ccc",{"start":15,"stop":19,"text":"dddd"},[]])");
+  maybe_rst = isolate->ExecScript(R"((function () {
+    'use strict'
+    const token = RASP.sql_tokenize('a bb')[1]
+    const keys = Object.keys(token).join()
+    const own = token.hasOwnProperty('text')
+    token.text = 'cc'
+    return JSON.stringify([keys, own, { ...token }])
+  })())",
+                                  "flex");
+  REQUIRE(std::string(*v8::String::Utf8Value(isolate, maybe_rst.ToLocalChecked())) ==
+          R"(["start,stop,text",true,{"start":2,"stop":4,"text":"cc"}])");
+}
+
+TEST_CASE("Tokenizer") {
+  std::vector<std::pair<std::string, flex_tokenizer_type>> inputs{
+      {"select * from users where id = '1' or 1=1 -- ", flex_tokenizer_sql},
+      {"echo `cat $(ls \"$(pwd)\")` | grep 'a b' && (whoami)", flex_tokenizer_bash},
+      {"select '中文😀' from dual", flex_tokenizer_sql},
+      {"", flex_tokenizer_sql},
+      {std::string(2000, '(') + "ls", flex_tokenizer_bash},
+      {"echo $($($(id)))", flex_tokenizer_bash},
+      {[]() {
+         std::string s;
+         for (int i = 0; i < 2000; i++) s += "$(";
+         return s;
+       }(),
+       flex_tokenizer_bash},
+  };
+  flex_tokenizer* tokenizer = flex_tokenizer_new();
+  REQUIRE(tokenizer != nullptr);
+  for (int round = 0; round < 3; round++) {
+    for (auto& input : inputs) {
+      auto expected =
+          flex_lexing(input.first.data(), input.first.size(), input.second == flex_tokenizer_sql ? "sql" : "bash");
+      char* buffer = flex_tokenizer_input(tokenizer, input.first.size());
+      REQUIRE(buffer != nullptr);
+      memcpy(buffer, input.first.data(), input.first.size());
+      auto result = flex_tokenizer_lexing(tokenizer, input.first.size(), input.second, 0);
+      REQUIRE(result.result_len == expected.result_len);
+      REQUIRE((expected.result_len == 0 ||
+               memcmp(result.result, expected.result, expected.result_len * sizeof(uint32_t)) == 0));
+      free(expected.result);
+    }
+  }
+  // flex_lexing与flex_tokenizer_lexing共用utf8len，这里用手算的utf16下标校验
+  // 16字节以上的ascii片段之后紧跟多字节字符，覆盖ascii_prefix的批量扫描路径
+  struct Case {
+    std::string input;
+    flex_tokenizer_type type;
+    int is_ascii;
+    std::vector<uint32_t> offsets;
+  };
+  std::vector<Case> cases{
+      {"select 'aaaaaaaaaaaaaaaaaaaa中文😀' from dual", flex_tokenizer_sql, 0, {0, 6, 7, 33, 34, 38, 39, 43}},
+      {"select aaaaaaaaaaaaaaaaaaaaaaaa,'é' from t",
+       flex_tokenizer_sql,
+       0,
+       {0, 6, 7, 31, 31, 32, 32, 35, 36, 40, 41, 42}},
+      {"echo 0123456789abcdefghij😀 x", flex_tokenizer_bash, 0, {0, 4, 5, 27, 28, 29}},
+      {"select * from users where id = 1",
+       flex_tokenizer_sql,
+       0,
+       {0, 6, 7, 8, 9, 13, 14, 19, 20, 25, 26, 28, 29, 30, 31, 32}},
+      {"select * from users where id = 1",
+       flex_tokenizer_sql,
+       1,
+       {0, 6, 7, 8, 9, 13, 14, 19, 20, 25, 26, 28, 29, 30, 31, 32}},
+      {"echo 0123456789abcdefghij x", flex_tokenizer_bash, 1, {0, 4, 5, 25, 26, 27}},
+  };
+  for (auto& c : cases) {
+    char* buffer = flex_tokenizer_input(tokenizer, c.input.size());
+    REQUIRE(buffer != nullptr);
+    memcpy(buffer, c.input.data(), c.input.size());
+    auto result = flex_tokenizer_lexing(tokenizer, c.input.size(), c.type, c.is_ascii);
+    REQUIRE(std::vector<uint32_t>(result.result, result.result + result.result_len) == c.offsets);
+  }
+  flex_tokenizer_free(tokenizer);
+}
+
+TEST_CASE("TokenCache") {
+  SECTION("lru") {
+    TokenCache cache;
+    uint32_t offsets[]{0, 1, 2, 3};
+    std::string a(1000, 'a'), b(1000, 'b'), c(1000, 'c');
+    auto key_a = TokenCache::Key(a.data(), a.size(), 0);
+    REQUIRE(key_a != TokenCache::Key(a.data(), a.size(), 1));
+    REQUIRE(cache.Get(key_a, a.data(), a.size(), 0) == nullptr);
+    cache.Put(key_a, a.data(), a.size(), 0, offsets, 4);
+    auto rst = cache.Get(key_a, a.data(), a.size(), 0);
+    REQUIRE(rst != nullptr);
+    REQUIRE(*rst == std::vector<uint32_t>{0, 1, 2, 3});
+    // 相同hash不同输入
+    REQUIRE(cache.Get(key_a, b.data(), b.size(), 0) == nullptr);
+    REQUIRE(cache.Get(key_a, a.data(), a.size(), 1) == nullptr);
+    REQUIRE(cache.hits == 1);
+    REQUIRE(cache.misses == 3);
+    auto key_b = TokenCache::Key(b.data(), b.size(), 0);
+    auto key_c = TokenCache::Key(c.data(), c.size(), 0);
+    cache.Put(key_b, b.data(), b.size(), 0, offsets, 4);
+    REQUIRE(cache.Get(key_a, a.data(), a.size(), 0) != nullptr);
+    cache.Trim(cache.GetSize() - 1);
+    REQUIRE(cache.GetCount() == 1);
+    REQUIRE(cache.Get(key_b, b.data(), b.size(), 0) == nullptr);
+    cache.Put(key_c, c.data(), c.size(), 0, offsets, 4);
+    REQUIRE(cache.GetCount() == 2);
+    cache.Clear();
+    REQUIRE(cache.GetCount() == 0);
+    REQUIRE(cache.GetSize() == 0);
+  }
+
+  SECTION("flex_tokenize") {
+    Snapshot snapshot("", std::vector<PluginFile>(), "1.2.3", 1000);
+    auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+    REQUIRE(isolate != nullptr);
+    IsolatePtr ptr(isolate);
+    isolate->Initialize();
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+    v8::Context::Scope context_scope(v8_context);
+    auto& cache = isolate->GetData()->token_cache;
+    auto maybe_rst = isolate->ExecScript(R"(
+      const a = flex_tokenize('select 1', 'sql')
+      a[0] = 100
+      const b = flex_tokenize('select 1', 'sql')
+      JSON.stringify([Array.from(b), Array.from(flex_tokenize('select 1', 'bash'))])
+    )",
+                                         "cache");
+    REQUIRE(std::string(*v8::String::Utf8Value(isolate, maybe_rst.ToLocalChecked())) == "[[0,6,7,8],[0,6,7,8]]");
+    REQUIRE(cache.hits == 1);
+    REQUIRE(cache.misses == 2);
+    REQUIRE(cache.GetCount() == 2);
+  }
+}
+
+TEST_CASE("TextHelpers") {
+  Snapshot snapshot("", std::vector<PluginFile>(), "1.2.3", 1000);
+  auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+  REQUIRE(isolate != nullptr);
+  IsolatePtr ptr(isolate);
+  isolate->Initialize();
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+  v8::Context::Scope context_scope(v8_context);
+
+  SECTION("lcs_search") {
+    // 与官方插件中的js实现比较
+    auto maybe_rst = isolate->ExecScript(R"(
+      function js_lcs_search(str1, str2) {
+        var len1 = str1.length, len2 = str2.length, dp_arr = [[], []], pre = 1, now = 0, result = 0, result_pos = []
+        for (var i = 0; i <= len2 + 1; i++) { dp_arr[0][i] = 0; dp_arr[1][i] = 0 }
+        for (var i = 0; i <= len1; i++) {
+          for (var j = 0; j <= len2; j++) {
+            if (i == 0 || j == 0) {
+              dp_arr[now][j] = 0
+            } else if (str1[i - 1] == str2[j - 1]) {
+              dp_arr[now][j] = dp_arr[pre][j - 1] + 1
+              if (dp_arr[now][j] > result) { result = dp_arr[now][j]; result_pos = [i - result] }
+              else if (dp_arr[now][j] == result) { result_pos.push(i - result) }
+            } else {
+              dp_arr[now][j] = 0
+            }
+          }
+          now = 1 - now; pre = 1 - pre
+        }
+        var result_str = new Set()
+        for (var item of new Set(result_pos)) { result_str.add(str1.substr(item, result)) }
+        return Array.from(result_str)
+      }
+      const chars = ['a', 'b', 'c', '中', '😀', '/']
+      let seed = 1
+      const random = () => (seed = seed * 48271 % 2147483647) / 2147483647
+      const randomString = () => Array.from({ length: Math.floor(random() * 30) }, () => chars[Math.floor(random() * chars.length)]).join('')
+      let mismatch = 0
+      for (let i = 0; i < 500; i++) {
+        const a = randomString(), b = randomString()
+        if (JSON.stringify(RASP.lcs_search(a, b)) != JSON.stringify(js_lcs_search(a, b))) {
+          mismatch++
+        }
+      }
+      JSON.stringify([mismatch, RASP.lcs_search('/etc/passwd', '../../etc/passwd%00'), RASP.lcs_search('', 'a')])
+    )",
+                                         "lcs");
+    REQUIRE(std::string(*v8::String::Utf8Value(isolate, maybe_rst.ToLocalChecked())) == R"([0,["/etc/passwd"],[]])");
+  }
+
+  SECTION("token_range") {
+    auto maybe_rst = isolate->ExecScript(R"(
+      const query = "select * from users where id = '1' or '1'='1' -- "
+      const tokens = RASP.sql_tokenize(query)
+      const view = RASP.sql_tokenize_view(query)
+      const plain = tokens.map(token => ({ stop: token.stop }))
+      let mismatch = 0
+      for (let index = 0; index < query.length; index++) {
+        for (let length = 1; index + length <= query.length; length++) {
+          let start = -1, end = tokens.length
+          for (let i = 0; i < tokens.length; i++) { if (tokens[i].stop > index) { start = i; break } }
+          for (let i = start; start >= 0 && i < tokens.length; i++) { if (tokens[i].stop >= index + length) { end = i; break } }
+          const expected = JSON.stringify([start, end])
+          if (JSON.stringify(RASP.token_range(tokens, index, length)) != expected ||
+              JSON.stringify(RASP.token_range(view, index, length)) != expected ||
+              JSON.stringify(RASP.token_range(plain, index, length)) != expected) {
+            mismatch++
+          }
+        }
+      }
+      JSON.stringify([mismatch, RASP.token_range(tokens, 1000, 1), RASP.token_range(flex_tokenize('a b', 'sql'), 2, 1), Array.from(flex_tokenize('a b', 'sql'))])
+    )",
+                                         "token_range");
+    REQUIRE(std::string(*v8::String::Utf8Value(isolate, maybe_rst.ToLocalChecked())) == R"([0,[-1,12],[1,1],[0,1,2,3]])");
+  }
+
+  SECTION("match_userinput") {
+    // 与逐个indexOf的结果比较
+    auto maybe_rst = isolate->ExecScript(R"(
+      const chars = ['a', 'b', '中', '😀', "'"]
+      let seed = 7
+      const random = () => (seed = seed * 48271 % 2147483647) / 2147483647
+      const randomString = (max) => Array.from({ length: Math.floor(random() * max) }, () => chars[Math.floor(random() * chars.length)]).join('')
+      const sort = (hits) => hits.map(hit => [hit.offset, hit.key, hit.value]).sort().join('|')
+      let mismatch = 0
+      for (let i = 0; i < 200; i++) {
+        const context = { parameter: { a: [randomString(4), randomString(4)], b: [randomString(3)], c: randomString(2), d: [] } }
+        const target = randomString(40)
+        const expected = []
+        for (const key of Object.keys(context.parameter)) {
+          for (const value of [].concat(context.parameter[key])) {
+            for (let j = value ? target.indexOf(value) : -1; j >= 0; j = target.indexOf(value, j + 1)) {
+              expected.push({ key, value, offset: j })
+            }
+          }
+        }
+        if (sort(RASP.match_userinput(context, target)) != sort(expected) ||
+            sort(RASP.match_userinput(context, target)) != sort(expected)) {
+          mismatch++
+        }
+      }
+      const context = { parameter: { id: ["1' or '1'='1"], name: ['admin'] } }
+      JSON.stringify([mismatch, RASP.match_userinput(context, "select * from users where id='1' or '1'='1' and name='admin'"),
+        RASP.match_userinput({}, 'abc'), ac_match(new ArrayBuffer(7), 'abc'), Array.from(ac_match(ac_compile(['', 'aa']), 'aaa'))])
+    )",
+                                         "match_userinput");
+    REQUIRE(std::string(*v8::String::Utf8Value(isolate, maybe_rst.ToLocalChecked())) ==
+            R"([0,[{"key":"id","value":"1' or '1'='1","offset":30},{"key":"name","value":"admin","offset":54}],[],null,[1,0,1,1]])");
+    // 节点1的失配指针或字典指针指向自己，不应死循环
+    maybe_rst = isolate->ExecScript(R"(
+      const none = 0xFFFFFFFF
+      const automaton = (fail, dict) =>
+        new Uint32Array([2, 1, 0, 0, 1, 0, none, none, 1, 1, fail, none, dict, 'a'.charCodeAt(0), 1]).buffer
+      JSON.stringify([ac_match(automaton(1, none), 'ab'), ac_match(automaton(0, 1), 'ab'), ac_match(automaton(0, none), 'ab').length])
+    )",
+                                    "ac_match");
+    REQUIRE(std::string(*v8::String::Utf8Value(isolate, maybe_rst.ToLocalChecked())) == "[null,null,0]");
+    // 重复的单字符参数只返回前256次命中，不能挤掉之后注入的参数
+    maybe_rst = isolate->ExecScript(R"(
+      const result = RASP.match_userinput({ parameter: { pad: 'a', id: "1' or 1=1" } }, 'a'.repeat(10000) + "1' or 1=1")
+      JSON.stringify([result.filter(item => item.key == 'pad').length, result.filter(item => item.key == 'id')])
+    )",
+                                    "ac_match");
+    REQUIRE(std::string(*v8::String::Utf8Value(isolate, maybe_rst.ToLocalChecked())) ==
+            R"([256,[{"key":"id","value":"1' or 1=1","offset":10000}]])");
+  }
 }
 
 TEST_CASE("Log") {
@@ -365,6 +861,104 @@ TEST_CASE("Log") {
   REQUIRE(message == "{}\n");
 }
 
+#ifndef _WIN32
+// 本地keep-alive服务，每个请求都返回ok，记录建立的连接数和收到的请求数据
+class LocalHTTPServer {
+ public:
+  explicit LocalHTTPServer(int delay_ms = 0) : delay_ms(delay_ms) {
+    server = socket(AF_INET, SOCK_STREAM, 0);
+    REQUIRE(server >= 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    REQUIRE(bind(server, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    REQUIRE(listen(server, 16) == 0);
+    REQUIRE(getsockname(server, reinterpret_cast<sockaddr*>(&addr), &addr_len) == 0);
+    port = ntohs(addr.sin_port);
+    acceptor = std::thread([this] {
+      for (;;) {
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0) {
+          return;
+        }
+        connections++;
+        std::thread([this, client] { Serve(client); }).detach();
+      }
+    });
+  }
+  ~LocalHTTPServer() {
+    shutdown(server, SHUT_RDWR);
+    close(server);
+    acceptor.join();
+  }
+  std::string GetUrl() const { return "http://127.0.0.1:" + std::to_string(port) + "/get"; }
+  std::vector<std::string> GetBodies() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return bodies;
+  }
+  std::vector<std::string> GetHeaders() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return headers;
+  }
+  std::atomic<int> connections{0};
+
+ private:
+  void Serve(int client) {
+    std::string buffer;
+    char buf[1024];
+    for (;;) {
+      ssize_t n = read(client, buf, sizeof(buf));
+      if (n <= 0) {
+        break;
+      }
+      buffer.append(buf, n);
+      size_t pos;
+      while ((pos = buffer.find("\r\n\r\n")) != std::string::npos) {
+        size_t length = 0;
+        auto header = buffer.substr(0, pos);
+        std::transform(header.begin(), header.end(), header.begin(), ::tolower);
+        auto field = header.find("content-length: ");
+        if (field != std::string::npos) {
+          length = std::stoul(header.substr(field + 16));
+        }
+        if (buffer.size() < pos + 4 + length) {
+          break;
+        }
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          bodies.emplace_back(buffer.substr(pos + 4, length));
+          headers.emplace_back(header);
+        }
+        buffer.erase(0, pos + 4 + length);
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+        const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+        if (write(client, response, sizeof(response) - 1) < 0) {
+          break;
+        }
+      }
+    }
+    close(client);
+  }
+  int server;
+  int port;
+  int delay_ms;
+  std::thread acceptor;
+  std::mutex mtx;
+  std::vector<std::string> bodies;
+  std::vector<std::string> headers;  // 请求行和头部，已转为小写
+};
+#endif
+
+// RASP.request在请求线程池中完成后才会settle，pump直到promise不再pending
+static v8::Local<v8::Promise> WaitPromise(Isolate* isolate, v8::Local<v8::Value> value) {
+  auto promise = value.As<v8::Promise>();
+  while (promise->State() == v8::Promise::PromiseState::kPending) {
+    Platform::Get()->PumpMessageLoop(isolate, v8::platform::MessageLoopBehavior::kWaitForWork);
+  }
+  return promise;
+}
+
 TEST_CASE("Request", "[!mayfail]") {
   Snapshot snapshot("", std::vector<PluginFile>(), "1.2.3", 1000);
   auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
@@ -398,7 +992,7 @@ RASP.request({
 })
           )",
         "request");
-    auto promise = maybe_rst.ToLocalChecked().As<v8::Promise>();
+    auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
     REQUIRE(promise->State() == v8::Promise::PromiseState::kFulfilled);
     auto rst = std::string(*v8::String::Utf8Value(isolate, promise->Result()));
     REQUIRE_THAT(rst, Catch::Matchers::Contains(R"===("args":{"a":"2333","b":"6666"})==="));
@@ -427,7 +1021,7 @@ RASP.request({
 })
           )",
           "request");
-      auto promise = maybe_rst.ToLocalChecked().As<v8::Promise>();
+      auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
       REQUIRE(promise->State() == v8::Promise::PromiseState::kFulfilled);
       auto rst = std::string(*v8::String::Utf8Value(isolate, promise->Result()));
       REQUIRE_THAT(rst, Catch::Matchers::Contains(R"===("args":{"a":"2333","b":"6666"})==="));
@@ -461,7 +1055,7 @@ RASP.request({
 })
           )",
           "request");
-      auto promise = maybe_rst.ToLocalChecked().As<v8::Promise>();
+      auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
       REQUIRE(promise->State() == v8::Promise::PromiseState::kFulfilled);
       auto rst = std::string(*v8::String::Utf8Value(isolate, promise->Result()));
       REQUIRE_THAT(rst, Catch::Matchers::Contains(R"===("args":{"a":"2333","b":"6666"})==="));
@@ -484,7 +1078,7 @@ RASP.request({
 })
           )",
           "request");
-      auto promise = maybe_rst.ToLocalChecked().As<v8::Promise>();
+      auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
       REQUIRE(promise->State() == v8::Promise::PromiseState::kFulfilled);
       auto rst = std::string(*v8::String::Utf8Value(isolate, promise->Result()));
       REQUIRE_THAT(rst, Catch::Matchers::Contains(R"===(eJyrVkpUsjKsBQAIKgIJ)==="));
@@ -500,7 +1094,7 @@ RASP.request({
 }).catch(err => Promise.reject(JSON.stringify(err)))
           )",
         "request");
-    auto promise = maybe_rst.ToLocalChecked().As<v8::Promise>();
+    auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
     REQUIRE(promise->State() == v8::Promise::PromiseState::kRejected);
     auto rst = std::string(*v8::String::Utf8Value(isolate, promise->Result()));
     REQUIRE_THAT(rst, Catch::Matchers::Matches(R"===(.*timed out.*)==="));
@@ -513,7 +1107,7 @@ RASP.request({
 }).catch(err => Promise.reject(JSON.stringify(err)))
           )",
         "request");
-    auto promise = maybe_rst.ToLocalChecked().As<v8::Promise>();
+    auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
     REQUIRE(promise->State() == v8::Promise::PromiseState::kRejected);
     auto rst = std::string(*v8::String::Utf8Value(isolate, promise->Result()));
     REQUIRE_THAT(rst, Catch::Matchers::Contains(R"===("code":3)==="));
@@ -528,7 +1122,7 @@ RASP.request({
 }).then(ret => JSON.stringify(ret))
           )",
         "request");
-    auto promise = maybe_rst.ToLocalChecked().As<v8::Promise>();
+    auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
     REQUIRE(promise->State() == v8::Promise::PromiseState::kFulfilled);
     auto rst = std::string(*v8::String::Utf8Value(isolate, promise->Result()));
     REQUIRE_THAT(rst, Catch::Matchers::Contains(R"===("/relative-redirect/1")==="));
@@ -539,7 +1133,7 @@ RASP.request({
 RASP.request().catch(err => err.error.message)
           )",
         "request");
-    auto promise = maybe_rst.ToLocalChecked().As<v8::Promise>();
+    auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
     REQUIRE(promise->State() == v8::Promise::PromiseState::kFulfilled);
     auto rst = std::string(*v8::String::Utf8Value(isolate, promise->Result()));
     REQUIRE(rst == "Uncaught TypeError: Cannot convert undefined or null to object");
@@ -550,7 +1144,7 @@ RASP.request().catch(err => err.error.message)
 RASP.request({}).catch(err => Promise.reject(JSON.stringify(err)))
           )",
         "request");
-    auto promise = maybe_rst.ToLocalChecked().As<v8::Promise>();
+    auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
     REQUIRE(promise->State() == v8::Promise::PromiseState::kRejected);
     auto rst = std::string(*v8::String::Utf8Value(isolate, promise->Result()));
     REQUIRE_THAT(rst, Catch::Matchers::Contains(R"===("code":5)==="));
@@ -568,6 +1162,271 @@ RASP.request({method: 'options', url: 'https://www.httpbin.org/options', timeout
   }
 }
 
+#ifndef _WIN32
+TEST_CASE("RequestPromise") {
+  Snapshot snapshot("", std::vector<PluginFile>(), "1.2.3", 1000);
+  auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+  IsolatePtr ptr(isolate);
+  isolate->Initialize();
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+  v8::Context::Scope context_scope(v8_context);
+  LocalHTTPServer server(50);
+  auto url = server.GetUrl();
+
+  SECTION("async") {
+    // 请求不阻塞脚本执行，结果在之后的PumpMessageLoop中返回
+    auto maybe_rst = isolate->ExecScript("RASP.request({url: '" + url + "'}).then(ret => ret.status + ret.data)", "request");
+    auto promise = maybe_rst.ToLocalChecked().As<v8::Promise>();
+    REQUIRE(promise->State() == v8::Promise::PromiseState::kPending);
+    REQUIRE(isolate->GetData()->pending_requests.size() == 1);
+    WaitPromise(isolate, promise);
+    REQUIRE(promise->State() == v8::Promise::PromiseState::kFulfilled);
+    REQUIRE(std::string(*v8::String::Utf8Value(isolate, promise->Result())) == "200ok");
+    REQUIRE(isolate->GetData()->pending_requests.empty());
+  }
+
+  SECTION("queue full") {
+    AsyncRequest::Terminate();
+    AsyncRequest::ConfigInstance(1, 1);
+    auto maybe_rst = isolate->ExecScript(R"(
+      Promise.all(Array.from({ length: 4 }, () => RASP.request({url: ')" + url + R"('}).then(ret => ret.data, err => err.error.message)))
+    )",
+                                         "request");
+    auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
+    REQUIRE(promise->State() == v8::Promise::PromiseState::kFulfilled);
+    auto rst = std::string(*v8::String::Utf8Value(isolate, promise->Result()));
+    REQUIRE_THAT(rst, Catch::Matchers::StartsWith("ok,"));
+    REQUIRE_THAT(rst, Catch::Matchers::EndsWith(",request queue is full"));
+    AsyncRequest::Terminate();
+    AsyncRequest::ConfigInstance(10, 1000);
+  }
+
+  SECTION("disposed") {
+    // isolate销毁后才完成的请求被丢弃
+    {
+      Snapshot snapshot("", std::vector<PluginFile>(), "1.2.3", 1000);
+      auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+      IsolatePtr ptr(isolate);
+      isolate->Initialize();
+      v8::Isolate::Scope isolate_scope(isolate);
+      v8::HandleScope handle_scope(isolate);
+      v8::Context::Scope context_scope(isolate->GetData()->context.Get(isolate));
+      isolate->ExecScript("RASP.request({url: '" + url + "'})", "request");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto maybe_rst = isolate->ExecScript("RASP.request({url: '" + url + "'}).then(ret => ret.data)", "request");
+    auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
+    REQUIRE(std::string(*v8::String::Utf8Value(isolate, promise->Result())) == "ok");
+  }
+
+  SECTION("empty body") {
+    for (std::string method : {"post", "put", "patch"}) {
+      auto maybe_rst = isolate->ExecScript(
+          "RASP.request({method: '" + method + "', url: '" + url + "'}).then(ret => ret.data)", "request");
+      auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
+      REQUIRE(std::string(*v8::String::Utf8Value(isolate, promise->Result())) == "ok");
+      auto header = server.GetHeaders().back();
+      REQUIRE_THAT(header, Catch::Matchers::StartsWith(method + " /get http/1.1"));
+      REQUIRE_THAT(header, Catch::Matchers::Contains("content-length: 0"));
+    }
+  }
+
+  SECTION("batch deflate") {
+    // RASP.request不经过RequestBatcher，batch被忽略，仍然要压缩
+    auto maybe_rst = isolate->ExecScript("RASP.request({method: 'post', url: '" + url +
+                                             "', data: {a: 1}, batch: true, deflate: true}).then(ret => ret.data)",
+                                         "request");
+    auto promise = WaitPromise(isolate, maybe_rst.ToLocalChecked());
+    REQUIRE(std::string(*v8::String::Utf8Value(isolate, promise->Result())) == "ok");
+    auto body = server.GetBodies().back();
+    std::string rst(1024, 0);
+    uLong size = rst.size();
+    REQUIRE(uncompress(reinterpret_cast<Bytef*>(&rst[0]), &size, reinterpret_cast<const Bytef*>(body.data()),
+                       body.size()) == Z_OK);
+    rst.resize(size);
+    REQUIRE(rst == R"({"a":1})");
+  }
+}
+
+TEST_CASE("CheckPromise") {
+  Snapshot snapshot("", {{"test", R"(
+        const plugin = new RASP('test')
+        plugin.register('request', async params => {
+            const ret = await RASP.request({ url: params.url })
+            if (params.loop) { for(;;) {} }
+            return { action: 'log', message: ret.data }
+        })
+    )"}},
+                    "1.2.3", 1000);
+  auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+  IsolatePtr ptr(isolate);
+  isolate->Initialize();
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+  v8::Context::Scope context_scope(v8_context);
+  LocalHTTPServer server(50);
+  auto params = v8::Object::New(isolate);
+  params->Set(v8_context, NewV8Key(isolate, "url"), NewV8String(isolate, server.GetUrl())).IsJust();
+  auto context = v8::Object::New(isolate);
+  int check_point = isolate->GetData()->check_point_ids.at("request");
+
+  SECTION("settled") {
+    auto rst = isolate->Check(v8_context, check_point, params, context, 1000).ToLocalChecked();
+    REQUIRE(rst->Length() == 1);
+    auto message = rst->Get(v8_context, 0)
+                       .ToLocalChecked()
+                       .As<v8::Object>()
+                       ->Get(v8_context, NewV8Key(isolate, "message"))
+                       .ToLocalChecked();
+    REQUIRE(std::string(*v8::String::Utf8Value(isolate, message)) == "ok");
+  }
+
+  SECTION("pending") {
+    // 截止时间之前请求没有完成，没有结果
+    auto rst = isolate->Check(v8_context, check_point, params, context, 10).ToLocalChecked();
+    REQUIRE(rst->Length() == 0);
+    while (!isolate->GetData()->pending_requests.empty()) {
+      Platform::Get()->PumpMessageLoop(isolate, v8::platform::MessageLoopBehavior::kWaitForWork);
+    }
+  }
+
+  SECTION("continuation timeout") {
+    // then回调在等待期间执行，超过检测的截止时间被中断
+    params->Set(v8_context, NewV8Key(isolate, "loop"), v8::True(isolate)).IsJust();
+    auto start = Watchdog::Now();
+    auto rst = isolate->Check(v8_context, check_point, params, context, 300).ToLocalChecked();
+    REQUIRE(rst->Length() == 0);
+    REQUIRE(Watchdog::Now() - start < 1000 * 1000 * 1000);
+    REQUIRE_FALSE(isolate->GetData()->is_timeout);
+    REQUIRE(isolate->ExecScript("1 + 1", "after").ToLocalChecked()->IsNumber());
+  }
+}
+#endif
+
+#ifndef _WIN32
+TEST_CASE("RequestBatch") {
+  Snapshot snapshot("", std::vector<PluginFile>(), "1.2.3", 1000);
+  auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+  IsolatePtr ptr(isolate);
+  isolate->Initialize();
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+  v8::Context::Scope context_scope(v8_context);
+  LocalHTTPServer server;
+  auto url = server.GetUrl();
+  auto wait_bodies = [&](size_t n) {
+    for (int i = 0; i < 100 && server.GetBodies().size() < n; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return server.GetBodies();
+  };
+  auto inflate = [](const std::string& data) {
+    std::string rst(64 * 1024, 0);
+    uLong size = rst.size();
+    REQUIRE(uncompress(reinterpret_cast<Bytef*>(&rst[0]), &size, reinterpret_cast<const Bytef*>(data.data()),
+                       data.size()) == Z_OK);
+    rst.resize(size);
+    return rst;
+  };
+  AsyncRequest::Terminate();
+  AsyncRequest::ConfigInstance(1, 100);
+  AsyncRequest::ConfigBatch(100, 1024 * 1024);
+  auto before = AsyncRequest::GetInstance().GetBatchStats();
+
+  SECTION("merge") {
+    isolate->ExecScript("for (let i = 0; i < 20; i++) { RASP.request_async({method: 'post', url: '" + url +
+                            "', data: i % 2 ? {i} : [{i}], batch: true, deflate: true}) }",
+                        "batch");
+    auto bodies = wait_bodies(1);
+    REQUIRE(bodies.size() == 1);
+    std::string expected = "[";
+    for (int i = 0; i < 20; i++) {
+      expected += (i ? ",{\"i\":" : "{\"i\":") + std::to_string(i) + "}";
+    }
+    REQUIRE(inflate(bodies[0]) == expected + "]");
+    // 服务端收到请求时批处理线程可能还没来得及更新统计
+    auto after = AsyncRequest::GetInstance().GetBatchStats();
+    for (int i = 0; i < 100 && after.batches == before.batches; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      after = AsyncRequest::GetInstance().GetBatchStats();
+    }
+    REQUIRE(after.queued - before.queued == 20);
+    REQUIRE(after.batches - before.batches == 1);
+    REQUIRE(after.pending == 0);
+  }
+
+  SECTION("different config") {
+    isolate->ExecScript("for (let i = 0; i < 4; i++) { RASP.request_async({method: 'post', url: '" + url +
+                            "', data: {i}, batch: true, headers: {n: i % 2}}) }"
+                            "RASP.request_async({method: 'post', url: '" +
+                            url + "', data: 'raw', batch: true})",
+                        "batch");
+    auto bodies = wait_bodies(3);
+    std::sort(bodies.begin(), bodies.end());
+    REQUIRE(bodies == std::vector<std::string>{R"([{"i":0},{"i":2}])", R"([{"i":1},{"i":3}])", "raw"});
+  }
+
+  SECTION("size limit") {
+    AsyncRequest::ConfigBatch(60 * 1000, 20);
+    isolate->ExecScript("for (let i = 0; i < 6; i++) { RASP.request_async({method: 'post', url: '" + url +
+                            "', data: {i}, batch: true}) }",
+                        "batch");
+    // 每条数据7字节，达到20字节时发出，每个合并的请求最多2条
+    auto bodies = wait_bodies(2);
+    REQUIRE(bodies.size() >= 2);
+    REQUIRE(bodies[0] == R"([{"i":0},{"i":1}])");
+    REQUIRE_THAT(bodies[1], Catch::Matchers::StartsWith(R"([{"i":2})"));
+  }
+
+  SECTION("drop") {
+    AsyncRequest::Terminate();
+    AsyncRequest::ConfigInstance(1, 5);
+    isolate->ExecScript("for (let i = 0; i < 8; i++) { RASP.request_async({method: 'post', url: '" + url +
+                            "', data: {i}, batch: true}) }",
+                        "batch");
+    auto bodies = wait_bodies(1);
+    REQUIRE(bodies.size() == 1);
+    REQUIRE(bodies[0] == R"([{"i":3},{"i":4},{"i":5},{"i":6},{"i":7}])");
+    auto after = AsyncRequest::GetInstance().GetBatchStats();
+    REQUIRE(after.dropped - before.dropped == 3);
+  }
+
+  SECTION("stop while adding") {
+    // Stop在锁外join期间Add不能重新启动线程
+    auto& batcher = RequestBatcher::GetInstance();
+    std::atomic<bool> done{false};
+    std::vector<std::thread> adders;
+    for (int i = 0; i < 4; i++) {
+      adders.emplace_back([&] {
+        while (!done) {
+          auto request = std::make_shared<HTTPRequest>();
+          request->SetMethod("post");
+          request->SetUrl(url);
+          batcher.Add(request);
+        }
+      });
+    }
+    for (int i = 0; i < 1000; i++) {
+      batcher.Stop(false);
+    }
+    done = true;
+    for (auto& adder : adders) {
+      adder.join();
+    }
+    batcher.Stop(false);
+    REQUIRE(batcher.GetStats().pending == 0);
+  }
+
+  AsyncRequest::Terminate();
+  AsyncRequest::ConfigInstance(10, 1000);
+  AsyncRequest::ConfigBatch(1000, 1024 * 1024);
+}
+#endif
+
 TEST_CASE("Check") {
   Snapshot snapshot("", {{"test", R"(
         const plugin = new RASP('test')
@@ -656,6 +1515,334 @@ TEST_CASE("Check") {
     // vs error C2017: illegal escape sequence
     // REQUIRE(str == R"([{"action":"exception","message":"{\"action\":\"log\"}","name":"test","confidence":0}])");
   }
+
+  SECTION("write results") {
+    params->Set(v8_context, NewV8Key(isolate, "action"), NewV8String(isolate, "block")).IsJust();
+    params->Set(v8_context, NewV8Key(isolate, "message"), NewV8String(isolate, "中文")).IsJust();
+    params->Set(v8_context, NewV8Key(isolate, "confidence"), v8::Integer::New(isolate, 90)).IsJust();
+    auto rst = isolate->Check(type, params, context);
+    REQUIRE(isolate->WriteResults(v8_context, v8::Array::New(isolate), nullptr, 0) == 0);
+    size_t size = isolate->WriteResults(v8_context, rst, nullptr, 0);
+    REQUIRE(size == 8 + 4 + 4 + 4 + 6);
+    std::vector<char> buf(size);
+    REQUIRE(isolate->WriteResults(v8_context, rst, buf.data(), buf.size()) == size);
+    REQUIRE(static_cast<uint8_t>(buf[0]) == kResultBlock);
+    REQUIRE(buf[1] == 0);
+    int32_t confidence;
+    memcpy(&confidence, buf.data() + 4, 4);
+    REQUIRE(confidence == 90);
+    REQUIRE(std::string(buf.data() + 12, 4) == "test");
+    REQUIRE(std::string(buf.data() + 20, 6) == "中文");
+  }
+
+  SECTION("write results with json") {
+    params->Set(v8_context, NewV8Key(isolate, "action"), NewV8String(isolate, "log")).IsJust();
+    params->Set(v8_context, NewV8Key(isolate, "algorithm"), NewV8String(isolate, "test")).IsJust();
+    auto rst = isolate->Check(type, params, context);
+    std::vector<char> buf(isolate->WriteResults(v8_context, rst, nullptr, 0));
+    REQUIRE(isolate->WriteResults(v8_context, rst, buf.data(), buf.size()) == buf.size());
+    REQUIRE(static_cast<uint8_t>(buf[0]) == kResultLog);
+    REQUIRE(buf[1] == kResultHasJson);
+    uint32_t length;
+    memcpy(&length, buf.data() + 20, 4);
+    REQUIRE(std::string(buf.data() + 24, length) ==
+            R"({"action":"log","algorithm":"test","message":"","name":"test","confidence":0})");
+  }
+}
+
+TEST_CASE("CheckBudget") {
+  Snapshot snapshot("", {{"budget", R"(
+        const plugin = new RASP('budget-slow')
+        plugin.register('budget', (params) => {
+            if (params.case === 'timeout') { for(;;) {} }
+        })
+        const plugin2 = new RASP('budget-fast')
+        plugin2.register('budget', (params) => ({ action: 'log' }))
+    )"}},
+                    "1.2.3", 1000);
+  auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+  REQUIRE(isolate != nullptr);
+  IsolatePtr ptr(isolate);
+  isolate->Initialize();
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+  v8::Context::Scope context_scope(v8_context);
+  auto type = NewV8String(isolate, "budget");
+  auto params = v8::Object::New(isolate);
+  auto context = v8::Object::New(isolate);
+  params->Set(v8_context, NewV8Key(isolate, "case"), NewV8String(isolate, "timeout")).IsJust();
+  auto& slow = isolate->GetData()->check_tables[CheckPointRegistry::Lookup("budget")][0];
+
+  SECTION("keep results of other plugins") {
+    auto start = Watchdog::Now();
+    auto rst = isolate->Check(type, params, context, 100);
+    auto elapsed = Watchdog::Now() - start;
+    REQUIRE(message == "Javascript plugin execution timeout\n");
+    REQUIRE(rst->Length() == 1);
+    REQUIRE(std::string(*v8::String::Utf8Value(
+                isolate, v8::JSON::Stringify(v8_context, rst).ToLocalChecked())) ==
+            R"([{"action":"log","message":"","name":"budget-fast","confidence":0}])");
+    // 慢的检测函数只分到一半时间
+    REQUIRE(elapsed >= 50 * 1000 * 1000);
+    REQUIRE(elapsed < 100 * 1000 * 1000);
+    REQUIRE(slow.timeouts == 1);
+    REQUIRE_FALSE(isolate->IsDead());
+    REQUIRE_FALSE(isolate->ExecScript("1+1", "test").IsEmpty());
+  }
+
+  SECTION("skip repeat offender") {
+    Isolate::ConfigPluginBudget(3, 10 * 1000);
+    for (int i = 0; i < CheckProcess::max_timeouts; i++) {
+      REQUIRE(isolate->Check(type, params, context, 20)->Length() == 1);
+    }
+    REQUIRE(slow.timeouts == 0);
+    REQUIRE(slow.skip_until > Watchdog::Now());
+    REQUIRE_THAT(message, Catch::Matchers::Contains("budget-slow timed out repeatedly"));
+    auto start = Watchdog::Now();
+    REQUIRE(isolate->Check(type, params, context, 20)->Length() == 1);
+    REQUIRE(Watchdog::Now() - start < 10 * 1000 * 1000);
+    // 暂停结束后恢复调用
+    slow.skip_until = 0;
+    params->Set(v8_context, NewV8Key(isolate, "case"), NewV8String(isolate, "fast")).IsJust();
+    REQUIRE(isolate->Check(type, params, context, 20)->Length() == 1);
+    REQUIRE(slow.timeouts == 0);
+    Isolate::ConfigPluginBudget(0, 10 * 1000);
+  }
+
+  SECTION("keep skip state across ExecScript") {
+    Isolate::ConfigPluginBudget(3, 10 * 1000);
+    for (int i = 0; i < CheckProcess::max_timeouts; i++) {
+      REQUIRE(isolate->Check(type, params, context, 20)->Length() == 1);
+    }
+    auto skip_until = slow.skip_until;
+    REQUIRE(skip_until > Watchdog::Now());
+    // 没有注册检测函数的脚本不重新展开检测函数表
+    auto generation = isolate->GetData()->check_points_generation;
+    REQUIRE_FALSE(isolate->ExecScript("1+1", "test").IsEmpty());
+    REQUIRE(isolate->GetData()->check_points_generation == generation);
+    REQUIRE(slow.skip_until == skip_until);
+    // 重新展开后已有检测函数的暂停状态不变
+    REQUIRE_FALSE(isolate->ExecScript("new RASP('budget-late').register('budget', () => {})", "late.js").IsEmpty());
+    REQUIRE(isolate->GetData()->check_points_generation == generation + 1);
+    auto& table = isolate->GetData()->check_tables[CheckPointRegistry::Lookup("budget")];
+    REQUIRE(table.size() == 3);
+    REQUIRE(table[0].skip_until == skip_until);
+    REQUIRE(table[2].skip_until == 0);
+    Isolate::ConfigPluginBudget(0, 10 * 1000);
+  }
+
+  SECTION("skip disabled by default") {
+    for (int i = 0; i < 5; i++) {
+      REQUIRE(isolate->Check(type, params, context, 20)->Length() == 1);
+    }
+    REQUIRE(slow.skip_until == 0);
+  }
+}
+
+TEST_CASE("Metrics") {
+  SECTION("histogram") {
+    for (uint64_t v : {0, 1, 7, 8, 15, 16, 100, 1000, 123456, 10000000}) {
+      auto index = Metrics::HistogramIndex(v);
+      REQUIRE(Metrics::HistogramValue(index) >= v);
+      REQUIRE(Metrics::HistogramValue(index) <= v + v / 8);
+      REQUIRE((index == 0 || Metrics::HistogramValue(index - 1) < v));
+    }
+    REQUIRE(Metrics::HistogramIndex(UINT64_MAX) == Metrics::histogram_size - 1);
+  }
+
+  SECTION("check") {
+    Snapshot snapshot("", {{"metrics", R"(
+        const plugin = new RASP('metrics-a')
+        plugin.register('metrics', (params) => {
+            if (params.case === 'throw') { a.a() }
+            if (params.case === 'timeout') { for(;;) {} }
+            return params
+        })
+        const plugin2 = new RASP('metrics-b')
+        plugin2.register('metrics', (params) => ({ action: 'log' }))
+    )"}},
+                      "1.2.3", 1000);
+    auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+    REQUIRE(isolate != nullptr);
+    IsolatePtr ptr(isolate);
+    isolate->Initialize();
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+    v8::Context::Scope context_scope(v8_context);
+    Metrics::Reset();
+    auto type = NewV8String(isolate, "metrics");
+    auto context = v8::Object::New(isolate);
+    for (auto action : {"ignore", "block", "block"}) {
+      auto params = v8::Object::New(isolate);
+      params->Set(v8_context, NewV8Key(isolate, "action"), NewV8String(isolate, action)).IsJust();
+      isolate->Check(type, params, context);
+    }
+    for (auto c : {"throw", "timeout"}) {
+      auto params = v8::Object::New(isolate);
+      params->Set(v8_context, NewV8Key(isolate, "case"), NewV8String(isolate, c)).IsJust();
+      isolate->Check(type, params, context, 100);
+    }
+    std::map<std::string, Metrics::Entry> entries;
+    for (auto& entry : Metrics::Collect()) {
+      if (entry.check_point == "metrics") {
+        entries.emplace(entry.plugin, entry);
+      }
+    }
+    REQUIRE(entries.size() == 3);
+    auto& total = entries[""];
+    REQUIRE(total.calls == 5);
+    REQUIRE(total.outcomes[kMetricsLog] == 1);
+    REQUIRE(total.outcomes[kMetricsBlock] == 2);
+    REQUIRE(total.outcomes[kMetricsException] == 1);
+    REQUIRE(total.outcomes[kMetricsTimeout] == 1);
+    // 两个检测函数，超时的检测函数只分到一半时间
+    REQUIRE(total.p999 >= 50 * 1000);
+    REQUIRE(total.max >= total.p99);
+    auto& a = entries["metrics-a"];
+    REQUIRE(a.calls == 5);
+    REQUIRE(a.outcomes[kMetricsIgnore] == 1);
+    REQUIRE(a.outcomes[kMetricsBlock] == 2);
+    REQUIRE(a.outcomes[kMetricsException] == 1);
+    REQUIRE(a.outcomes[kMetricsTimeout] == 1);
+    auto& b = entries["metrics-b"];
+    REQUIRE(b.calls == 4);
+    REQUIRE(b.outcomes[kMetricsLog] == 4);
+    REQUIRE(b.p50 < 100 * 1000);
+    auto json = Metrics::ToJson();
+    REQUIRE_THAT(json, Catch::Matchers::Contains(
+                           R"("check_point":"metrics","plugin":"metrics-b","calls":4,"ignore":0,"log":4,"block":0)"));
+  }
+
+  SECTION("profiling") {
+    Snapshot snapshot("", {{"profiling", R"(
+        const plugin = new RASP('profiling-fast')
+        plugin.register('profiling', () => {})
+        const plugin2 = new RASP('profiling-slow')
+        plugin2.register('profiling', () => { for (let i = 0; i < 1e6; i++); })
+    )"}},
+                      "1.2.3", 1000);
+    auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+    REQUIRE(isolate != nullptr);
+    IsolatePtr ptr(isolate);
+    isolate->Initialize();
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+    v8::Context::Scope context_scope(v8_context);
+    Metrics::Reset();
+    auto type = NewV8String(isolate, "profiling");
+    isolate->Check(type, v8::Object::New(isolate), v8::Object::New(isolate), 1000);
+    for (auto& entry : Metrics::Collect()) {
+      REQUIRE(entry.cpu_time == 0);
+    }
+    Metrics::SetProfiling(true);
+    int64_t cpu = Metrics::ThreadCpuTime();
+    for (int i = 0; i < 5; i++) {
+      isolate->Check(type, v8::Object::New(isolate), v8::Object::New(isolate), 1000);
+    }
+    cpu = Metrics::ThreadCpuTime() - cpu;
+    Metrics::SetProfiling(false);
+    auto top = Metrics::TopPlugins(2);
+    REQUIRE(top.size() == 2);
+    REQUIRE(top[0].plugin == "profiling-slow");
+    REQUIRE(top[0].calls == 6);
+    REQUIRE(top[0].cpu_time > 0);
+    REQUIRE(top[0].cpu_time <= cpu / 1000);
+    REQUIRE(top[0].total_time >= top[0].cpu_time);
+    REQUIRE(top[1].plugin == "profiling-fast");
+    REQUIRE(top[0].cpu_time > top[1].cpu_time);
+    REQUIRE_THAT(Metrics::TopPluginsJson(1),
+                 Catch::Matchers::StartsWith(R"([{"check_point":"profiling","plugin":"profiling-slow","calls":6)"));
+  }
+
+  SECTION("threads") {
+    int cp = CheckPointRegistry::Register("metrics-threads");
+    int plugin = Metrics::RegisterPlugin("metrics-threads");
+    REQUIRE(Metrics::RegisterPlugin("metrics-threads") == plugin);
+    Metrics::Reset();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 16; i++) {
+      threads.emplace_back([=]() {
+        for (int j = 0; j < 1000; j++) {
+          Metrics::Record(cp, plugin, j * 1000, kMetricsIgnore);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    Metrics::RecordOom();
+    REQUIRE(Metrics::GetOomCount() == 1);
+    bool found = false;
+    for (auto& entry : Metrics::Collect()) {
+      if (entry.check_point == "metrics-threads" && entry.plugin == "metrics-threads") {
+        found = true;
+        REQUIRE(entry.calls == 16000);
+        REQUIRE(entry.outcomes[kMetricsIgnore] == 16000);
+        REQUIRE(entry.max == 999);
+        REQUIRE(entry.p50 >= 499);
+        REQUIRE(entry.p50 <= 499 + 499 / 8);
+      }
+    }
+    REQUIRE(found);
+  }
+}
+
+TEST_CASE("FlatParams") {
+  Snapshot snapshot("", {{"test", R"(
+        const plugin = new RASP('test')
+        plugin.register('request', (params) => {
+            global.saved = params
+            return { action: params.action, message: params.json.a + params.query }
+        })
+    )"}},
+                    "1.2.3", 1000);
+  auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+  REQUIRE(isolate != nullptr);
+  IsolatePtr ptr(isolate);
+  isolate->Initialize();
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+  v8::Context::Scope context_scope(v8_context);
+
+  std::string flat;
+  auto add = [&](const std::string& key, FlatParamType type, const std::string& value) {
+    uint32_t length = key.size();
+    flat.append(reinterpret_cast<char*>(&length), sizeof(length)).append(key);
+    length = value.size();
+    flat.append(1, type).append(reinterpret_cast<char*>(&length), sizeof(length)).append(value);
+  };
+  add("action", kFlatString, "log");
+  add("query", kFlatString, "中文");
+  add("json", kFlatJson, R"({"a":1})");
+  add("cmd", kFlatString, std::string(1024 * 1024, 'a'));
+
+  SECTION("check") {
+    v8::Local<v8::Object> params;
+    REQUIRE(isolate->NewFlatParams(v8_context, flat.data(), flat.size()).ToLocal(&params));
+    auto rst = isolate->Check(NewV8String(isolate, "request"), params, v8::Object::New(isolate));
+    isolate->ReleaseFlatParams();
+    REQUIRE(std::string(*v8::String::Utf8Value(isolate, v8::JSON::Stringify(v8_context, rst).ToLocalChecked())) ==
+            R"([{"action":"log","message":"1中文","name":"test","confidence":0}])");
+    // 检测结束后未访问过的属性不再解码
+    auto saved = isolate->ExecScript("[saved.action, saved.cmd]", "test").ToLocalChecked();
+    REQUIRE(std::string(*v8::String::Utf8Value(isolate, v8::JSON::Stringify(v8_context, saved).ToLocalChecked())) ==
+            R"(["log",null])");
+  }
+
+  SECTION("truncated") {
+    REQUIRE(isolate->NewFlatParams(v8_context, flat.data(), flat.size() - 1).IsEmpty());
+    REQUIRE(isolate->NewFlatParams(v8_context, flat.data(), 3).IsEmpty());
+  }
+
+  SECTION("empty") {
+    v8::Local<v8::Object> params;
+    REQUIRE(isolate->NewFlatParams(v8_context, flat.data(), 0).ToLocal(&params));
+    REQUIRE(params->GetOwnPropertyNames(v8_context).ToLocalChecked()->Length() == 0);
+  }
 }
 
 TEST_CASE("Plugins") {
@@ -703,6 +1890,20 @@ TEST_CASE("Plugins") {
     auto rst = isolate->Check(type, params, context);
     REQUIRE(rst->Length() == 2);
   }
+
+  SECTION("check point id") {
+    int id = CheckPointRegistry::Lookup("request");
+    REQUIRE(id >= 0);
+    REQUIRE(data->check_point_ids.at("request") == id);
+    REQUIRE(CheckPointRegistry::Lookup("xxxx") < 0);
+    REQUIRE(data->check_tables[id].size() == 2);
+    params->Set(v8_context, NewV8Key(isolate, "action"), NewV8String(isolate, "log")).IsJust();
+    v8::Local<v8::Array> rst;
+    REQUIRE(isolate->Check(v8_context, id, params, context).ToLocal(&rst));
+    REQUIRE(rst->Length() == 2);
+    REQUIRE(isolate->Check(v8_context, CheckPointRegistry::Size(), params, context).IsEmpty());
+    REQUIRE(isolate->Check(v8_context, -1, params, context).IsEmpty());
+  }
 }
 
 TEST_CASE("AsyncRequest") {
@@ -776,6 +1977,30 @@ TEST_CASE("AsyncRequest") {
   Platform::logger = plugin_log;
 }
 
+#ifndef _WIN32
+TEST_CASE("HTTPClientPool") {
+  LocalHTTPServer server;
+  std::string url = server.GetUrl();
+
+  auto before = AsyncRequest::GetInstance().GetClientStats();
+  for (int i = 0; i < 5; i++) {
+    HTTPRequest req;
+    req.SetUrl(url);
+    req.SetMethod("get");
+    auto res = req.GetResponse();
+    REQUIRE_FALSE(res.error);
+    REQUIRE(res.status_code == 200);
+    REQUIRE(res.text == "ok");
+  }
+  auto after = AsyncRequest::GetInstance().GetClientStats();
+  REQUIRE(server.connections == 1);
+  REQUIRE(after.requests - before.requests == 5);
+  REQUIRE(after.reused_connections - before.reused_connections == 4);
+  REQUIRE(after.active == 0);
+  REQUIRE(after.idle >= 1);
+}
+#endif
+
 TEST_CASE("ThreadPool") {
   SECTION("basic") {
     auto pool = new ThreadPool(10, 21);
@@ -825,6 +2050,90 @@ TEST_CASE("ThreadPool") {
     auto dur = end - begin;
     REQUIRE(dur.count() < 100 * 1000 * 1000);
   }
+
+  SECTION("drain") {
+    ThreadPool pool(2, 100);
+    std::atomic<int> count(0);
+    for (int i = 0; i < 20; i++) {
+      REQUIRE(pool.Post([&count] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        count++;
+      }));
+    }
+    REQUIRE(pool.Drain(std::chrono::milliseconds(5000)));
+    REQUIRE(count == 20);
+    REQUIRE(pool.GetQueueSize() == 0);
+    REQUIRE_FALSE(pool.Post([] {}));
+    auto stats = pool.GetStats();
+    REQUIRE(stats.posted == 20);
+    REQUIRE(stats.executed == 20);
+    REQUIRE(stats.rejected == 1);
+    REQUIRE(stats.wait_time >= stats.max_wait_time);
+    REQUIRE(stats.max_wait_time > 0);
+  }
+
+  SECTION("drop") {
+    std::promise<void> pro;
+    auto pool = new ThreadPool(1, 10);
+    pool->Post([&pro] {
+      pro.set_value();
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    });
+    pro.get_future().get();
+    for (int i = 0; i < 5; i++) {
+      pool->Post([] {});
+    }
+    REQUIRE_FALSE(pool->Drain(std::chrono::milliseconds(0)));
+    delete pool;
+  }
+
+  SECTION("task") {
+    // 小的可调用对象存放在task内部，大的分配在堆上，都只能移动
+    auto counter = std::make_shared<int>(0);
+    ThreadPool::Task small([counter] { (*counter)++; });
+    char padding[ThreadPool::Task::inline_size] = {1};
+    ThreadPool::Task large([counter, padding] { (*counter) += padding[0]; });
+    REQUIRE(counter.use_count() == 3);
+    ThreadPool::Task moved(std::move(small));
+    REQUIRE_FALSE(small);
+    moved();
+    large = std::move(moved);
+    large();
+    REQUIRE(*counter == 2);
+    large.Reset();
+    REQUIRE(counter.use_count() == 1);
+  }
+}
+
+TEST_CASE("ThreadPoolBench", "[!benchmark]") {
+  for (size_t producers : {1, 4}) {
+    ThreadPool pool(4, 1024);
+    BENCHMARK("post and run 10000 tasks, " + std::to_string(producers) + " producers") {
+      std::atomic<int> done(0);
+      std::vector<std::thread> threads;
+      for (size_t p = 0; p < producers; p++) {
+        threads.emplace_back([&] {
+          for (int i = 0; i < 10000 / producers; i++) {
+            while (!pool.Post([&done] { done++; })) {
+              std::this_thread::yield();
+            }
+          }
+        });
+      }
+      for (auto& t : threads) {
+        t.join();
+      }
+      while (done < 10000 / producers * producers) {
+        std::this_thread::yield();
+      }
+    };
+    auto stats = pool.GetStats();
+    printf("\nposted: %llu, rejected: %llu, avg enqueue: %llu ns, avg wait: %llu ns, max wait: %llu ns\n",
+           static_cast<unsigned long long>(stats.posted), static_cast<unsigned long long>(stats.rejected),
+           static_cast<unsigned long long>(stats.enqueue_time / std::max<uint64_t>(stats.posted, 1)),
+           static_cast<unsigned long long>(stats.wait_time / std::max<uint64_t>(stats.executed, 1)),
+           static_cast<unsigned long long>(stats.max_wait_time));
+  }
 }
 
 TEST_CASE("HeapLimit") {
@@ -856,7 +2165,147 @@ TEST_CASE("HeapLimit") {
   REQUIRE(e == "Terminated\n");
 }
 
+TEST_CASE("IdleNotification") {
+  Snapshot snapshot("", std::vector<PluginFile>(), "1.2.3", 1000);
+  auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+  REQUIRE(isolate != nullptr);
+  IsolatePtr ptr(isolate);
+  isolate->Initialize();
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+  v8::Context::Scope context_scope(v8_context);
+  auto data = isolate->GetData();
+  REQUIRE(Platform::Get()->IdleTasksEnabled(isolate));
+  REQUIRE(isolate->IdleNotification(0));
+
+  SECTION("pressure") {
+    isolate->ExecScript("global.garbage = new Array(2e5).fill(0).map((_, i) => ({ i }))", "garbage");
+    isolate->ExecScript("global.garbage = null", "garbage");
+    isolate->GetHeapStatistics(&data->hs);
+    size_t used = data->hs.used_heap_size();
+    // 堆使用超过阈值的3/4，通知内存压力后在空闲时间内完成GC
+    data->oom_threshold = used;
+    auto gc_count = data->gc_count;
+    for (int i = 0; i < 20 && !isolate->IdleNotification(100); i++) {
+    }
+    isolate->GetHeapStatistics(&data->hs);
+    REQUIRE(data->gc_count > gc_count);
+    REQUIRE(data->idle_gc_count == data->gc_count - gc_count);
+    REQUIRE(data->hs.used_heap_size() < used);
+  }
+
+  SECTION("budget") {
+    auto start = Watchdog::Now();
+    for (int i = 0; i < 10; i++) {
+      isolate->ExecScript("new Array(1e4).fill(0).map((_, i) => ({ i }))", "garbage");
+      isolate->IdleNotification(2);
+    }
+    // 每次最多超出一个增量步骤的时间
+    REQUIRE(Watchdog::Now() - start < 500 * 1000 * 1000);
+    Isolate::ConfigIdleBudget(0);
+    REQUIRE(isolate->IdleNotification());
+    Isolate::ConfigIdleBudget(1);
+  }
+}
+
+TEST_CASE("MemoryProfile") {
+  auto& profile = Isolate::GetMemoryProfile();
+  auto flags_hash = Snapshot::flags_hash;
+  // Initialize之后flags已经生效，新的配置被忽略
+  auto late = MemoryProfile::Throughput();
+  late.oom_threshold_mb = 8;
+  REQUIRE_FALSE(Isolate::ConfigMemoryProfile(late));
+  REQUIRE(profile.oom_threshold_mb != 8);
+  REQUIRE(Snapshot::flags_hash == flags_hash);
+  Isolate::ApplyFlags();
+  REQUIRE(Snapshot::flags_hash == flags_hash);
+
+  Snapshot snapshot("", std::vector<PluginFile>(), "1.2.3", 1000);
+  auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+  REQUIRE(isolate != nullptr);
+  IsolatePtr ptr(isolate);
+  isolate->Initialize();
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+  v8::Context::Scope context_scope(v8_context);
+  REQUIRE(isolate->GetData()->oom_threshold == profile.oom_threshold_mb * 1024 * 1024);
+  // 短命对象被GC回收，不会触发OOM
+  REQUIRE_FALSE(isolate->ExecScript("for (let i = 0; i < 1e6; i++) { [i, {i}] }", "young").IsEmpty());
+  REQUIRE(isolate->GetData()->gc_count > 0);
+  REQUIRE(isolate->GetData()->max_gc_pause > 0);
+  REQUIRE(isolate->GetData()->gc_time >= isolate->GetData()->max_gc_pause);
+  REQUIRE_FALSE(isolate->GetData()->is_oom);
+  v8::TryCatch try_catch(isolate);
+  isolate->ExecScript(R"==(
+      let arr = []
+      for (let i = 0;; i++) {
+        arr.push(new Array(1000).fill(i))
+      }
+    )==",
+                      "limit");
+  REQUIRE(isolate->GetData()->is_oom);
+  REQUIRE(isolate->GetData()->hs.used_heap_size() < 2 * isolate->GetData()->oom_threshold);
+}
+
 #ifndef _WIN32
+static size_t GetRss() {
+  std::ifstream statm("/proc/self/statm");
+  size_t size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// 对比不同内存配置下的检测吞吐、GC停顿和进程RSS，内存配置只能在Initialize之前选择，
+// 分别以默认和OPENRASP_V8_TEST_PROFILE=throughput运行
+TEST_CASE("MemoryProfileBench", "[!benchmark]") {
+  std::string name = Isolate::GetMemoryProfile().stress_compaction ? "compact" : "throughput";
+  Snapshot snapshot("", {{"bench", R"(
+      const plugin = new RASP('bench')
+      plugin.register('bench', (params) => {
+          const words = params.query.split(' ').map(w => ({ word: w, upper: w.toUpperCase() }))
+          if (words.some(w => w.upper === 'UNION')) {
+              return { action: 'log', message: JSON.stringify(words.slice(0, 4)) }
+          }
+      })
+  )"}},
+                    "1.2.3", 1000);
+  auto isolate = Isolate::New(&snapshot, snapshot.timestamp);
+  REQUIRE(isolate != nullptr);
+  IsolatePtr ptr(isolate);
+  isolate->Initialize();
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> v8_context = isolate->GetData()->context.Get(isolate);
+  v8::Context::Scope context_scope(v8_context);
+  auto type = NewV8String(isolate, "bench");
+  auto params = v8::Object::New(isolate);
+  params
+      ->Set(v8_context, NewV8Key(isolate, "query"),
+            NewV8String(isolate, "select a, b, c from t where id = 1 union select user, password from users"))
+      .IsJust();
+  auto context = v8::Object::New(isolate);
+  auto data = isolate->GetData();
+  size_t checks = 0;
+  auto start = Watchdog::Now();
+  BENCHMARK(name + " 1000 checks") {
+    for (int i = 0; i < 1000; i++) {
+      v8::HandleScope handle_scope(isolate);
+      isolate->Check(type, params, context, 1000);
+    }
+    checks += 1000;
+  };
+  auto elapsed = Watchdog::Now() - start;
+  isolate->GetHeapStatistics(&data->hs);
+  printf("\n%s: %.0f checks/s, gc: %llu, avg pause: %llu us, max pause: %llu us, heap: %zu KB, rss: %zu KB\n",
+         name.c_str(), checks * 1e9 / std::max<int64_t>(elapsed, 1),
+         static_cast<unsigned long long>(data->gc_count),
+         static_cast<unsigned long long>(data->gc_time / std::max<uint64_t>(data->gc_count, 1) / 1000),
+         static_cast<unsigned long long>(data->max_gc_pause / 1000), data->hs.total_heap_size() / 1024,
+         GetRss() / 1024);
+}
+
 #include <sys/wait.h>
 int wait(pid_t pid) {
   int status;
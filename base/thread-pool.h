@@ -15,32 +15,133 @@
  */
 
 #pragma once
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace openrasp_v8 {
+// 可调用对象较小时直接存放在内部缓冲中，不分配内存，只能移动
+class ThreadPoolTask {
+ public:
+  ThreadPoolTask() = default;
+  template <typename F,
+            typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, ThreadPoolTask>::value>::type>
+  ThreadPoolTask(F&& f) {
+    typedef typename std::decay<F>::type Fn;
+    Emplace<Fn>(std::forward<F>(f), std::integral_constant<bool, IsInline<Fn>()>());
+  }
+  ThreadPoolTask(ThreadPoolTask&& other) noexcept { MoveFrom(other); }
+  ThreadPoolTask& operator=(ThreadPoolTask&& other) noexcept {
+    if (this != &other) {
+      Reset();
+      MoveFrom(other);
+    }
+    return *this;
+  }
+  ThreadPoolTask(const ThreadPoolTask&) = delete;
+  ThreadPoolTask& operator=(const ThreadPoolTask&) = delete;
+  ~ThreadPoolTask() { Reset(); }
+
+  void operator()() { ops->call(&storage); }
+  explicit operator bool() const { return ops != nullptr; }
+  void Reset() {
+    if (ops) {
+      ops->destroy(&storage);
+      ops = nullptr;
+    }
+  }
+
+  static constexpr size_t inline_size = 64;
+
+ private:
+  struct Ops {
+    void (*call)(void*);
+    void (*move)(void* dst, void* src);  // 移动后销毁src
+    void (*destroy)(void*);
+  };
+  template <typename Fn>
+  static constexpr bool IsInline() {
+    return sizeof(Fn) <= inline_size && alignof(Fn) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible<Fn>::value;
+  }
+  template <typename Fn, typename F>
+  void Emplace(F&& f, std::true_type) {
+    static const Ops inline_ops = {
+        [](void* p) { (*static_cast<Fn*>(p))(); },
+        [](void* dst, void* src) {
+          new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+          static_cast<Fn*>(src)->~Fn();
+        },
+        [](void* p) { static_cast<Fn*>(p)->~Fn(); }};
+    new (&storage) Fn(std::forward<F>(f));
+    ops = &inline_ops;
+  }
+  template <typename Fn, typename F>
+  void Emplace(F&& f, std::false_type) {
+    static const Ops heap_ops = {
+        [](void* p) { (**static_cast<Fn**>(p))(); },
+        [](void* dst, void* src) { *static_cast<Fn**>(dst) = *static_cast<Fn**>(src); },
+        [](void* p) { delete *static_cast<Fn**>(p); }};
+    *reinterpret_cast<Fn**>(&storage) = new Fn(std::forward<F>(f));
+    ops = &heap_ops;
+  }
+  void MoveFrom(ThreadPoolTask& other) {
+    if (other.ops) {
+      other.ops->move(&storage, &other.storage);
+      ops = other.ops;
+      other.ops = nullptr;
+    }
+  }
+
+  typename std::aligned_storage<inline_size, alignof(std::max_align_t)>::type storage;
+  const Ops* ops = nullptr;
+};
+
+// 线程池的统计，时间单位为纳秒
+struct ThreadPoolStats {
+  uint64_t posted;        // 进入队列的任务数
+  uint64_t rejected;      // 队列已满或已停止而被拒绝的任务数
+  uint64_t executed;      // 执行完的任务数
+  uint64_t dropped;       // 停止时未执行就被丢弃的任务数
+  uint64_t enqueue_time;  // Post入队耗时合计
+  uint64_t wait_time;     // 任务从入队到开始执行的时间合计
+  uint64_t max_wait_time;
+};
+
+// 有界的无锁多生产者多消费者队列（Vyukov环形队列），只有工作线程空闲时才使用条件变量休眠
 class ThreadPool {
  public:
-  typedef std::function<void()> Task;
+  typedef ThreadPoolTask Task;
 
   ThreadPool(size_t thread_size, size_t queue_cap) : queue_cap(queue_cap) {
+    size_t capacity = 1;
+    while (capacity < queue_cap) {
+      capacity <<= 1;
+    }
+    mask = capacity - 1;
+    cells.reset(new Cell[capacity]);
+    for (size_t i = 0; i < capacity; i++) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
     for (size_t i = 0; i < thread_size; i++) {
-      threads.emplace_back([this]() {
-        while (auto task = GetNext()) {
-          task();
-        }
-      });
+      threads.emplace_back([this]() { Work(); });
     }
   }
 
+  // 立即停止，正在执行的任务完成后退出，队列中剩余的任务被丢弃
   ~ThreadPool() {
     {
       std::lock_guard<std::mutex> lock(mtx);
-      terminated = true;
+      terminated.store(true);
+      accepting.store(false);
     }
     cv.notify_all();
     for (auto& t : threads) {
@@ -48,48 +149,171 @@ class ThreadPool {
         t.join();
       }
     }
+    Task task;
+    int64_t enqueued;
+    while (Pop(task, enqueued)) {
+      task.Reset();
+      dropped.fetch_add(1, std::memory_order_relaxed);
+    }
   }
 
   bool Post(Task&& task) {
-    {
-      std::lock_guard<std::mutex> lock(mtx);
-      if (terminated || tasks.size() >= queue_cap) {
+    int64_t begin = Now();
+    if (!accepting.load(std::memory_order_acquire)) {
+      rejected.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    // 先占用名额，保证队列中的任务数不超过queue_cap，环形队列的实际容量不小于queue_cap
+    if (size.fetch_add(1) >= queue_cap) {
+      size.fetch_sub(1);
+      rejected.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    Push(std::move(task), begin);
+    posted.fetch_add(1, std::memory_order_relaxed);
+    enqueue_time.fetch_add(Now() - begin, std::memory_order_relaxed);
+    if (sleepers.load() > 0) {
+      // 加锁保证工作线程要么在检查队列之前看到新任务，要么已经在等待并被唤醒
+      { std::lock_guard<std::mutex> lock(mtx); }
+      cv.notify_one();
+    }
+    return true;
+  }
+
+  // 不再接受新任务，等待队列中的任务执行完，超时返回false
+  bool Drain(std::chrono::milliseconds timeout) {
+    accepting.store(false);
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (size.load() > 0 || running.load() > 0) {
+      if (std::chrono::steady_clock::now() >= deadline) {
         return false;
       }
-      tasks.emplace(std::forward<Task>(task));
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
-    cv.notify_one();
     return true;
   }
 
-  Task GetNext() {
-    std::unique_lock<std::mutex> lock(mtx);
+  size_t GetQueueSize() {
+    size_t n = size.load(std::memory_order_relaxed);
+    return n > queue_cap ? queue_cap : n;
+  }
+
+  ThreadPoolStats GetStats() {
+    ThreadPoolStats stats;
+    stats.posted = posted.load(std::memory_order_relaxed);
+    stats.rejected = rejected.load(std::memory_order_relaxed);
+    stats.executed = executed.load(std::memory_order_relaxed);
+    stats.dropped = dropped.load(std::memory_order_relaxed);
+    stats.enqueue_time = enqueue_time.load(std::memory_order_relaxed);
+    stats.wait_time = wait_time.load(std::memory_order_relaxed);
+    stats.max_wait_time = max_wait_time.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    int64_t enqueued;
+    Task task;
+  };
+
+  static int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // 调用前已占用名额，槽位只会被尚未写回sequence的消费者短暂占用
+  void Push(Task&& task, int64_t enqueued) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
     for (;;) {
-      if (terminated) {
-        return nullptr;
-      } else if (!tasks.empty()) {
-        auto task = std::move(tasks.front());
-        tasks.pop();
-        return task;
+      Cell& cell = cells[pos & mask];
+      size_t seq = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.task = std::move(task);
+          cell.enqueued = enqueued;
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return;
+        }
+      } else if (diff < 0) {
+        std::this_thread::yield();
+        pos = enqueue_pos.load(std::memory_order_relaxed);
       } else {
-        cv.wait(lock);
+        pos = enqueue_pos.load(std::memory_order_relaxed);
       }
     }
   }
 
-  size_t GetQueueSize() {
-    {
-      std::lock_guard<std::mutex> lock(mtx);
-      return tasks.size();
+  bool Pop(Task& task, int64_t& enqueued) {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = cells[pos & mask];
+      size_t seq = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          task = std::move(cell.task);
+          enqueued = cell.enqueued;
+          cell.sequence.store(pos + mask + 1, std::memory_order_release);
+          size.fetch_sub(1);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
     }
   }
 
- private:
-  std::condition_variable cv;
+  void Work() {
+    Task task;
+    int64_t enqueued;
+    for (;;) {
+      if (terminated.load(std::memory_order_acquire)) {
+        return;
+      }
+      running.fetch_add(1);
+      if (Pop(task, enqueued)) {
+        uint64_t wait = Now() - enqueued;
+        wait_time.fetch_add(wait, std::memory_order_relaxed);
+        uint64_t max = max_wait_time.load(std::memory_order_relaxed);
+        while (wait > max && !max_wait_time.compare_exchange_weak(max, wait, std::memory_order_relaxed)) {
+        }
+        task();
+        task.Reset();
+        executed.fetch_add(1, std::memory_order_relaxed);
+        running.fetch_sub(1);
+        continue;
+      }
+      running.fetch_sub(1);
+      std::unique_lock<std::mutex> lock(mtx);
+      sleepers.fetch_add(1);
+      cv.wait(lock, [this] { return terminated.load() || size.load() > 0; });
+      sleepers.fetch_sub(1);
+    }
+  }
+
+  std::unique_ptr<Cell[]> cells;
+  size_t mask;
+  size_t queue_cap;
+  alignas(64) std::atomic<size_t> enqueue_pos{0};
+  alignas(64) std::atomic<size_t> dequeue_pos{0};
+  alignas(64) std::atomic<size_t> size{0};  // 已占用的名额，包括正在入队的任务
+  std::atomic<size_t> running{0};
+  std::atomic<size_t> sleepers{0};
+  std::atomic<bool> accepting{true};
+  std::atomic<bool> terminated{false};
+  std::atomic<uint64_t> posted{0};
+  std::atomic<uint64_t> rejected{0};
+  std::atomic<uint64_t> executed{0};
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<uint64_t> enqueue_time{0};
+  std::atomic<uint64_t> wait_time{0};
+  std::atomic<uint64_t> max_wait_time{0};
   std::mutex mtx;
+  std::condition_variable cv;
   std::vector<std::thread> threads;
-  std::queue<Task> tasks;
-  size_t queue_cap;
-  bool terminated = false;
 };
-}  // namespace openrasp_v8
\ No newline at end of file
+}  // namespace openrasp_v8
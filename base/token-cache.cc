@@ -0,0 +1,68 @@
+/*
+ * Copyright 2017-2019 Baidu Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include "bundle.h"
+
+namespace openrasp_v8 {
+
+size_t TokenCache::budget = 2 * 1024 * 1024;
+
+uint64_t TokenCache::Key(const char* input, size_t length, int type) {
+  return Snapshot::Hash(input, length, Snapshot::Hash(reinterpret_cast<const char*>(&type), sizeof(type)));
+}
+
+// hash相同时还要比较原始输入，不能把别的语句的结果交给插件
+const std::vector<uint32_t>* TokenCache::Get(uint64_t key, const char* input, size_t length, int type) {
+  auto it = index.find(key);
+  if (it == index.end() || it->second->type != type || it->second->input.size() != length ||
+      memcmp(it->second->input.data(), input, length) != 0) {
+    misses++;
+    return nullptr;
+  }
+  hits++;
+  entries.splice(entries.begin(), entries, it->second);
+  return &it->second->offsets;
+}
+
+void TokenCache::Put(uint64_t key, const char* input, size_t length, int type, const uint32_t* offsets, size_t count) {
+  size_t entry_size = sizeof(Entry) + length + count * sizeof(uint32_t);
+  // 单条结果超过上限的1/8时不缓存，避免一条超长语句挤掉所有结果
+  if (entry_size > budget / 8) {
+    return;
+  }
+  auto it = index.find(key);
+  if (it != index.end()) {
+    size -= it->second->Size();
+    entries.erase(it->second);
+    index.erase(it);
+  }
+  Trim(budget - entry_size);
+  entries.push_front({key, type, std::string(input, length), std::vector<uint32_t>(offsets, offsets + count)});
+  index.emplace(key, entries.begin());
+  size += entry_size;
+}
+
+void TokenCache::Trim(size_t budget) {
+  while (size > budget && !entries.empty()) {
+    auto& entry = entries.back();
+    size -= entry.Size();
+    index.erase(entry.key);
+    entries.pop_back();
+  }
+}
+
+}  // namespace openrasp_v8
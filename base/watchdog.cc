@@ -0,0 +1,128 @@
+/*
+ * Copyright 2017-2019 Baidu Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include "bundle.h"
+
+namespace openrasp_v8 {
+
+constexpr int64_t Watchdog::firing;
+constexpr int64_t Watchdog::resolution;
+
+// 不析构，避免进程退出时与Platform的析构顺序问题
+Watchdog& Watchdog::GetInstance() {
+  static Watchdog* instance = new Watchdog();
+  return *instance;
+}
+
+int64_t Watchdog::Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// 随Platform::Startup启动，php fork前会Shutdown，所以线程不会跨越fork
+void Watchdog::Start() {
+  std::lock_guard<std::mutex> lock(mtx);
+  if (running) {
+    return;
+  }
+  running = true;
+  thread = std::thread(&Watchdog::Run, this);
+}
+
+void Watchdog::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!running) {
+      return;
+    }
+    running = false;
+  }
+  cv.notify_all();
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+void Watchdog::Register(Isolate* isolate) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    isolates.push_back(isolate);
+  }
+  cv.notify_all();
+}
+
+// 持锁移除，保证看门狗线程不会再访问即将销毁的isolate
+void Watchdog::Unregister(Isolate* isolate) {
+  std::lock_guard<std::mutex> lock(mtx);
+  isolates.erase(std::remove(isolates.begin(), isolates.end(), isolate), isolates.end());
+}
+
+void Watchdog::Arm(IsolateData* data, int milliseconds) {
+  ArmAt(data, Now() + static_cast<int64_t>(milliseconds) * 1000 * 1000);
+}
+
+// 看门狗线程按resolution定时扫描，不需要唤醒它，超时最多晚resolution被发现
+void Watchdog::ArmAt(IsolateData* data, int64_t deadline) {
+  data->deadline.store(deadline);
+}
+
+void Watchdog::Disarm(IsolateData* data) {
+  int64_t deadline = data->deadline.load(std::memory_order_acquire);
+  for (;;) {
+    // 看门狗正在中断，等它结束，之后由调用方根据is_timeout处理
+    if (UNLIKELY(deadline == firing)) {
+      std::this_thread::yield();
+      deadline = data->deadline.load(std::memory_order_acquire);
+      continue;
+    }
+    if (data->deadline.compare_exchange_weak(deadline, 0)) {
+      return;
+    }
+  }
+}
+
+// 中断所有已超时的isolate
+void Watchdog::Scan(int64_t now) {
+  for (auto isolate : isolates) {
+    auto data = isolate->GetData();
+    int64_t deadline = data->deadline.load();
+    if (deadline <= 0 || deadline > now) {
+      continue;
+    }
+    // 与Disarm竞争，只有截止时间未被清除才中断
+    if (data->deadline.compare_exchange_strong(deadline, firing)) {
+      data->is_timeout = true;
+      isolate->TerminateExecution();
+      data->deadline.store(0, std::memory_order_release);
+    }
+  }
+}
+
+// 有isolate时每隔resolution扫描一次，没有isolate时等待Register唤醒
+void Watchdog::Run() {
+  std::unique_lock<std::mutex> lock(mtx);
+  while (running) {
+    if (isolates.empty()) {
+      cv.wait(lock);
+      continue;
+    }
+    Scan(Now());
+    cv.wait_for(lock, std::chrono::nanoseconds(resolution));
+  }
+}
+
+}  // namespace openrasp_v8
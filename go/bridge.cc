@@ -57,39 +57,108 @@ char CreateSnapshot(Buffer config) {
   return true;
 }
 
-Buffer Check(Buffer type, Buffer params, int context_index, int timeout) {
-  Isolate* isolate = GetIsolate();
+void ConfigSnapshotCache(Buffer directory, char in_memory) {
+  Snapshot::ConfigCache({*directory, directory.length()}, in_memory);
+}
+
+char ConfigMemoryProfile(size_t max_old_space_mb,
+                         size_t max_semi_space_kb,
+                         size_t oom_threshold_mb,
+                         char stress_compaction) {
+  MemoryProfile profile;
+  profile.max_old_space_mb = max_old_space_mb;
+  profile.max_semi_space_kb = max_semi_space_kb;
+  if (oom_threshold_mb) {
+    profile.oom_threshold_mb = oom_threshold_mb;
+  }
+  profile.stress_compaction = stress_compaction;
+  return Isolate::ConfigMemoryProfile(profile);
+}
+
+void ConfigIdleBudget(int budget_ms) {
+  Isolate::ConfigIdleBudget(budget_ms);
+}
+
+// 使用当前线程的isolate，与Check在同一线程调用，线程上没有可用的isolate时无事可做，不为此创建isolate
+char IdleNotification() {
+  Isolate* isolate = PeekIsolate();
   if (!isolate) {
-    return {nullptr, 0};
+    return true;
   }
+  v8::HandleScope handle_scope(isolate);
+  return isolate->IdleNotification();
+}
+
+void ConfigPluginBudget(int max_timeouts, int cooldown_ms) {
+  Isolate::ConfigPluginBudget(max_timeouts, cooldown_ms);
+}
+
+// type是CheckPointRegistry中的id，flat为true时params是扁平key/value编码，否则是json
+static v8::Local<v8::Array> CheckImpl(Isolate* isolate,
+                                      int type,
+                                      Buffer params,
+                                      bool flat,
+                                      int context_index,
+                                      int timeout) {
   auto data = isolate->GetData();
+  if (type < 0 || type >= data->check_tables.size() || data->check_tables[type].empty()) {
+    return {};
+  }
   auto custom_data = GetCustomData(data);
   custom_data->context_index = context_index;
-  v8::HandleScope handle_scope(isolate);
   auto context = isolate->GetCurrentContext();
   v8::Local<v8::String> tmp_str;
-  v8::Local<v8::String> request_type;
   v8::Local<v8::Value> request_params;
   v8::Local<v8::Object> request_context;
 
-  if (!v8::String::NewFromUtf8(isolate, *type, v8::NewStringType::kNormal, type.length()).ToLocal(&request_type)) {
-    return {nullptr, 0};
+  if (flat) {
+    v8::Local<v8::Object> obj;
+    if (!isolate->NewFlatParams(context, *params, params.length()).ToLocal(&obj)) {
+      return {};
+    }
+    request_params = obj;
+  } else {
+    if (!v8::String::NewFromUtf8(isolate, *params, v8::NewStringType::kNormal, params.length()).ToLocal(&tmp_str)) {
+      return {};
+    }
+    if (!v8::JSON::Parse(context, tmp_str).ToLocal(&request_params)) {
+      return {};
+    }
   }
 
-  if (!v8::String::NewFromUtf8(isolate, *params, v8::NewStringType::kNormal, params.length()).ToLocal(&tmp_str)) {
-    return {nullptr, 0};
-  }
-  if (!v8::JSON::Parse(context, tmp_str).ToLocal(&request_params)) {
-    return {nullptr, 0};
+  if (!data->request_context_templ.Get(isolate)->NewInstance(context).ToLocal(&request_context)) {
+    if (flat) {
+      isolate->ReleaseFlatParams();
+    }
+    return {};
   }
 
-  if (!data->request_context_templ.Get(isolate)->NewInstance(context).ToLocal(&request_context)) {
-    return {nullptr, 0};
+  v8::Local<v8::Array> rst;
+  isolate->Check(context, type, request_params.As<v8::Object>(), request_context, timeout).ToLocal(&rst);
+  if (flat) {
+    isolate->ReleaseFlatParams();
   }
+  return rst;
+}
 
-  auto rst = isolate->Check(request_type, request_params.As<v8::Object>(), request_context, timeout);
+int RegisterCheckPoint(Buffer name) {
+  return CheckPointRegistry::Register({*name, name.length()});
+}
 
-  if (rst->Length() == 0) {
+Buffer Check(Buffer type, Buffer params, int context_index, int timeout) {
+  Isolate* isolate = GetIsolate();
+  if (!isolate) {
+    return {nullptr, 0};
+  }
+  v8::HandleScope handle_scope(isolate);
+  auto context = isolate->GetCurrentContext();
+  auto& ids = isolate->GetData()->check_point_ids;
+  auto it = ids.find({*type, type.length()});
+  if (it == ids.end()) {
+    return {nullptr, 0};
+  }
+  auto rst = CheckImpl(isolate, it->second, params, false, context_index, timeout);
+  if (rst.IsEmpty() || rst->Length() == 0) {
     return {nullptr, 0};
   }
   v8::Local<v8::String> json;
@@ -103,6 +172,63 @@ Buffer Check(Buffer type, Buffer params, int context_index, int timeout) {
   return {str, len};
 }
 
+// 结果编码到out中，空间不足时编码到新分配的内存中，由调用方释放
+static Buffer WriteResults(Isolate* isolate, v8::Local<v8::Array> rst, void* out, size_t capacity) {
+  if (rst.IsEmpty() || rst->Length() == 0) {
+    return {nullptr, 0};
+  }
+  auto context = isolate->GetCurrentContext();
+  size_t len = isolate->WriteResults(context, rst, reinterpret_cast<char*>(out), capacity);
+  if (LIKELY(len <= capacity)) {
+    return {out, len};
+  }
+  char* buf = reinterpret_cast<char*>(malloc(len));
+  isolate->WriteResults(context, rst, buf, len);
+  return {buf, len};
+}
+
+Buffer CheckBuffer(int type, Buffer params, int context_index, int timeout, void* out, size_t capacity) {
+  Isolate* isolate = GetIsolate();
+  if (!isolate) {
+    return {nullptr, 0};
+  }
+  v8::HandleScope handle_scope(isolate);
+  auto rst = CheckImpl(isolate, type, params, false, context_index, timeout);
+  return WriteResults(isolate, rst, out, capacity);
+}
+
+Buffer CheckFlat(int type, Buffer params, int context_index, int timeout, void* out, size_t capacity) {
+  Isolate* isolate = GetIsolate();
+  if (!isolate) {
+    return {nullptr, 0};
+  }
+  v8::HandleScope handle_scope(isolate);
+  auto rst = CheckImpl(isolate, type, params, true, context_index, timeout);
+  return WriteResults(isolate, rst, out, capacity);
+}
+
+// 使用malloc分配，由go侧free
+static Buffer NewMallocBuffer(const std::string& json) {
+  char* str = reinterpret_cast<char*>(malloc(json.size()));
+  if (!str) {
+    return {nullptr, 0};
+  }
+  memcpy(str, json.data(), json.size());
+  return {str, json.size()};
+}
+
+Buffer GetMetrics() {
+  return NewMallocBuffer(Metrics::ToJson());
+}
+
+void SetProfiling(char enable) {
+  Metrics::SetProfiling(enable);
+}
+
+Buffer GetTopPlugins(int n) {
+  return NewMallocBuffer(Metrics::TopPluginsJson(n > 0 ? n : 0));
+}
+
 Buffer ExecScript(Buffer source, Buffer name) {
   Isolate* isolate = GetIsolate();
   if (!isolate) {
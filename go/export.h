@@ -38,8 +38,22 @@ char Dispose();
 char ClearPlugin();
 char AddPlugin(Buffer source, Buffer name);
 char CreateSnapshot(Buffer config);
+void ConfigSnapshotCache(Buffer directory, char in_memory);
+void ConfigPluginBudget(int max_timeouts, int cooldown_ms);
+void ConfigIdleBudget(int budget_ms);
+char IdleNotification();
+char ConfigMemoryProfile(size_t max_old_space_mb,
+                         size_t max_semi_space_kb,
+                         size_t oom_threshold_mb,
+                         char stress_compaction);
+int RegisterCheckPoint(Buffer name);
 Buffer Check(Buffer type, Buffer params, int context_index, int timeout);
+Buffer CheckBuffer(int type, Buffer params, int context_index, int timeout, void* out, size_t capacity);
+Buffer CheckFlat(int type, Buffer params, int context_index, int timeout, void* out, size_t capacity);
 Buffer ExecScript(Buffer source, Buffer name);
+Buffer GetMetrics();
+void SetProfiling(char enable);
+Buffer GetTopPlugins(int n);
 
 #ifdef __cplusplus
 }
@@ -40,8 +40,12 @@ class IsolateDeleter {
   }
 };
 typedef std::unique_ptr<openrasp_v8::Isolate, IsolateDeleter> IsolatePtr;
-inline openrasp_v8::Isolate* GetIsolate() {
+inline IsolatePtr& GetIsolatePtr() {
   static thread_local IsolatePtr isolate_ptr;
+  return isolate_ptr;
+}
+inline openrasp_v8::Isolate* GetIsolate() {
+  auto& isolate_ptr = GetIsolatePtr();
   auto isolate = isolate_ptr.get();
   if (snapshot) {
     if (!isolate || isolate->IsExpired(snapshot->timestamp)) {
@@ -53,4 +57,12 @@ inline openrasp_v8::Isolate* GetIsolate() {
     }
   }
   return isolate;
+}
+// 只返回当前线程已有且未过期的isolate，不创建新的
+inline openrasp_v8::Isolate* PeekIsolate() {
+  auto isolate = GetIsolatePtr().get();
+  if (!isolate || !snapshot || isolate->IsExpired(snapshot->timestamp)) {
+    return nullptr;
+  }
+  return isolate;
 }
\ No newline at end of file
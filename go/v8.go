@@ -25,6 +25,7 @@ package v8
 */
 import "C"
 import (
+	"encoding/binary"
 	"sync"
 	"unsafe"
 )
@@ -63,6 +64,54 @@ func CreateSnapshot(config string, plugins []Plugin) bool {
 	return C.CreateSnapshot(underlyingString(config)) != 0
 }
 
+//ConfigSnapshotCache reuses snapshots built from the same config and plugins,
+//directory is where snapshot files are cached, empty string disables the file cache
+func ConfigSnapshotCache(directory string, inMemory bool) {
+	var flag C.char
+	if inMemory {
+		flag = 1
+	}
+	C.ConfigSnapshotCache(underlyingString(directory), flag)
+}
+
+//MemoryProfile isolate heap settings, zero values use v8 defaults
+type MemoryProfile struct {
+	MaxOldSpaceMB  uint
+	MaxSemiSpaceKB uint
+	//OOMThresholdMB isolate is terminated when used heap exceeds it, 20 if zero
+	OOMThresholdMB uint
+	//StressCompaction compacts the whole heap on every gc, saves memory but pauses longer
+	StressCompaction bool
+}
+
+//ConfigMemoryProfile must be called before Initialize, later calls are ignored and return false
+func ConfigMemoryProfile(profile MemoryProfile) bool {
+	var flag C.char
+	if profile.StressCompaction {
+		flag = 1
+	}
+	return C.ConfigMemoryProfile(C.size_t(profile.MaxOldSpaceMB), C.size_t(profile.MaxSemiSpaceKB),
+		C.size_t(profile.OOMThresholdMB), flag) != 0
+}
+
+//ConfigIdleBudget sets how long IdleNotification may spend on gc, 1ms by default, <= 0 disables it
+func ConfigIdleBudget(budgetMs int) {
+	C.ConfigIdleBudget(C.int(budgetMs))
+}
+
+//IdleNotification lets v8 do gc work of the current thread's isolate between requests,
+//call it at the end of a request so that gc pauses do not land inside checks,
+//returns true if there is no more gc work to do
+func IdleNotification() bool {
+	return C.IdleNotification() != 0
+}
+
+//ConfigPluginBudget skips a check function for cooldownMs milliseconds after it times out
+//maxTimeouts times in a row, maxTimeouts <= 0 disables skipping, which is the default
+func ConfigPluginBudget(maxTimeouts int, cooldownMs int) {
+	C.ConfigPluginBudget(C.int(maxTimeouts), C.int(cooldownMs))
+}
+
 //Check check request
 func Check(requestType string, requestParams []byte, requestContext *ContextGetters, timeout int) []byte {
 	rw.RLock()
@@ -74,6 +123,129 @@ func Check(requestType string, requestParams []byte, requestContext *ContextGett
 	return C.GoBytes(unsafe.Pointer(buf.data), C.int(buf.raw_size))
 }
 
+//Result actions, same as ResultAction in base/bundle.h
+const (
+	ActionLog       = 0
+	ActionBlock     = 1
+	ActionIgnore    = 2
+	ActionException = 3
+	ActionOther     = 255
+)
+
+//Result check result decoded from binary records
+type Result struct {
+	Action     int
+	Confidence int
+	Name       string
+	Message    string
+	//JSON full result, only set when plugin returns extra fields or unknown action
+	JSON []byte
+}
+
+var resultBufferPool = sync.Pool{
+	New: func() interface{} {
+		return make([]byte, 4096)
+	},
+}
+
+//RegisterCheckPoint returns the id of check point, ids are stable in process
+func RegisterCheckPoint(name string) int {
+	return int(C.RegisterCheckPoint(underlyingString(name)))
+}
+
+//CheckResults check request, requestType is the id returned by RegisterCheckPoint,
+//results are written as binary records instead of json
+func CheckResults(requestType int, requestParams []byte, requestContext *ContextGetters, timeout int) []Result {
+	return checkResults(requestType, requestParams, false, requestContext, timeout)
+}
+
+//CheckFlat check request with flat params, plugins only decode the fields they touch
+func CheckFlat(requestType int, requestParams *FlatParams, requestContext *ContextGetters, timeout int) []Result {
+	return checkResults(requestType, requestParams.buf, true, requestContext, timeout)
+}
+
+func checkResults(requestType int, requestParams []byte, flat bool, requestContext *ContextGetters, timeout int) []Result {
+	rw.RLock()
+	defer rw.RUnlock()
+	contextIndex := RegisterContext(requestContext)
+	defer UnregisterContext(contextIndex)
+	out := resultBufferPool.Get().([]byte)
+	defer resultBufferPool.Put(out)
+	var buf C.Buffer
+	if flat {
+		buf = C.CheckFlat(C.int(requestType), underlyingBytes(requestParams), C.int(contextIndex), C.int(timeout),
+			unsafe.Pointer(&out[0]), C.size_t(len(out)))
+	} else {
+		buf = C.CheckBuffer(C.int(requestType), underlyingBytes(requestParams), C.int(contextIndex), C.int(timeout),
+			unsafe.Pointer(&out[0]), C.size_t(len(out)))
+	}
+	if buf.data == nil || buf.raw_size == 0 {
+		return nil
+	}
+	var data []byte
+	if buf.data == unsafe.Pointer(&out[0]) {
+		data = out[:buf.raw_size]
+	} else {
+		defer C.free(buf.data)
+		data = C.GoBytes(buf.data, C.int(buf.raw_size))
+	}
+	return decodeResults(data)
+}
+
+//FlatParams flat key/value params, see FlatParamType in base/bundle.h
+type FlatParams struct {
+	buf []byte
+}
+
+//AddString add string field
+func (p *FlatParams) AddString(key string, value string) *FlatParams {
+	return p.add(key, 0, value)
+}
+
+//AddJSON add json field, it is parsed only when plugin touches it
+func (p *FlatParams) AddJSON(key string, value []byte) *FlatParams {
+	return p.add(key, 1, string(value))
+}
+
+//Reset clear all fields
+func (p *FlatParams) Reset() {
+	p.buf = p.buf[:0]
+}
+
+func (p *FlatParams) add(key string, kind byte, value string) *FlatParams {
+	var length [4]byte
+	binary.LittleEndian.PutUint32(length[:], uint32(len(key)))
+	p.buf = append(append(p.buf, length[:]...), key...)
+	binary.LittleEndian.PutUint32(length[:], uint32(len(value)))
+	p.buf = append(append(append(p.buf, kind), length[:]...), value...)
+	return p
+}
+
+// 目前支持的平台都是小端，与native的本机字节序一致
+func decodeResults(data []byte) []Result {
+	var results []Result
+	readBytes := func() []byte {
+		length := binary.LittleEndian.Uint32(data)
+		bytes := data[4 : 4+length]
+		data = data[4+length:]
+		return bytes
+	}
+	for len(data) >= 8 {
+		result := Result{}
+		result.Action = int(data[0])
+		flags := data[1]
+		result.Confidence = int(int32(binary.LittleEndian.Uint32(data[4:])))
+		data = data[8:]
+		result.Name = string(readBytes())
+		result.Message = string(readBytes())
+		if flags&1 != 0 {
+			result.JSON = append([]byte(nil), readBytes()...)
+		}
+		results = append(results, result)
+	}
+	return results
+}
+
 //ExecScript execute any script
 func ExecScript(source string, filename string) string {
 	rw.RLock()
@@ -81,3 +253,32 @@ func ExecScript(source string, filename string) string {
 	buf := C.ExecScript(underlyingString(source), underlyingString(filename))
 	return C.GoStringN((*C.char)(buf.data), C.int(buf.raw_size))
 }
+
+//GetMetrics returns a json snapshot of check statistics in process,
+//calls, results by action and latency percentiles in microseconds per check point and plugin
+func GetMetrics() string {
+	return takeMallocString(C.GetMetrics())
+}
+
+//SetProfiling enables per plugin thread cpu time accounting, which is off by default
+func SetProfiling(enable bool) {
+	if enable {
+		C.SetProfiling(1)
+	} else {
+		C.SetProfiling(0)
+	}
+}
+
+//GetTopPlugins returns a json array of the n plugins which cost the most cpu time,
+//or the most wall time when profiling is off, on each check point
+func GetTopPlugins(n int) string {
+	return takeMallocString(C.GetTopPlugins(C.int(n)))
+}
+
+func takeMallocString(buf C.Buffer) string {
+	if buf.data == nil {
+		return ""
+	}
+	defer C.free(buf.data)
+	return C.GoStringN((*C.char)(buf.data), C.int(buf.raw_size))
+}
@@ -18,6 +18,7 @@ package v8
 
 import (
 	"encoding/json"
+	"strings"
 	"testing"
 
 	"github.com/stretchr/testify/assert"
@@ -105,6 +106,121 @@ func TestCheck(t *testing.T) {
 	assert.Equal(t, string(rst), `[{"action":"log","message":"Javascript plugin execution timeout"}]`)
 }
 
+func TestCheckResults(t *testing.T) {
+	Initialize(nil)
+	CreateSnapshot("", []Plugin{
+		Plugin{
+			Source: `const plugin = new RASP('test')
+			plugin.register('request', () => {
+				return {
+					action: 'ignore'
+				}
+			})
+			plugin.register('command', () => {
+				return {
+					action: 'block',
+					confidence: 90,
+					algorithm: 'test'
+				}
+			})`,
+			Filename: "plugin.js",
+		},
+	})
+	params := []byte("{}")
+	contextGetters := &ContextGetters{}
+	assert.Nil(t, CheckResults(RegisterCheckPoint("request"), params, contextGetters, 100))
+
+	command := RegisterCheckPoint("command")
+	assert.Equal(t, command, RegisterCheckPoint("command"))
+	rst := CheckResults(command, params, contextGetters, 100)
+	assert.Equal(t, len(rst), 1)
+	assert.Equal(t, rst[0].Action, ActionBlock)
+	assert.Equal(t, rst[0].Confidence, 90)
+	assert.Equal(t, rst[0].Name, "test")
+	assert.Equal(t, rst[0].Message, "")
+	assert.Equal(t, string(rst[0].JSON), `{"action":"block","confidence":90,"algorithm":"test","message":"","name":"test"}`)
+}
+
+func TestCheckFlat(t *testing.T) {
+	Initialize(nil)
+	CreateSnapshot("", []Plugin{
+		Plugin{
+			Source: `const plugin = new RASP('test')
+			plugin.register('command', (params) => {
+				return {
+					action: params.action,
+					message: params.command + params.json.a
+				}
+			})`,
+			Filename: "plugin.js",
+		},
+	})
+	params := &FlatParams{}
+	params.AddString("action", "block").AddString("command", "test 中文 & 😊").AddJSON("json", []byte(`{"a":1}`))
+	contextGetters := &ContextGetters{}
+	command := RegisterCheckPoint("command")
+	rst := CheckFlat(command, params, contextGetters, 100)
+	assert.Equal(t, len(rst), 1)
+	assert.Equal(t, rst[0].Action, ActionBlock)
+	assert.Equal(t, rst[0].Message, "test 中文 & 😊1")
+
+	params.Reset()
+	params.AddString("action", "ignore")
+	assert.Nil(t, CheckFlat(command, params, contextGetters, 100))
+}
+
+func TestGetMetrics(t *testing.T) {
+	Initialize(nil)
+	CreateSnapshot("", []Plugin{
+		Plugin{
+			Source: `const plugin = new RASP('metrics')
+			plugin.register('command', (params) => params)`,
+			Filename: "plugin.js",
+		},
+	})
+	params := &FlatParams{}
+	params.AddString("action", "block")
+	CheckFlat(RegisterCheckPoint("command"), params, &ContextGetters{}, 100)
+	metrics := GetMetrics()
+	assert.True(t, strings.HasPrefix(metrics, `{"oom":`))
+	assert.Contains(t, metrics, `"check_point":"command","plugin":"metrics"`)
+}
+
+func TestIdleNotification(t *testing.T) {
+	Initialize(nil)
+	CreateSnapshot("", []Plugin{})
+	ExecScript(`global.garbage = new Array(1e5).fill(0).map((_, i) => ({ i })); global.garbage = null`, "garbage.js")
+	IdleNotification()
+	ConfigIdleBudget(0)
+	assert.True(t, IdleNotification())
+	ConfigIdleBudget(1)
+}
+
+func TestConfigMemoryProfile(t *testing.T) {
+	Initialize(nil)
+	assert.False(t, ConfigMemoryProfile(MemoryProfile{MaxOldSpaceMB: 64}))
+}
+
+func TestGetTopPlugins(t *testing.T) {
+	Initialize(nil)
+	CreateSnapshot("", []Plugin{
+		Plugin{
+			Source: `const plugin = new RASP('slow')
+			plugin.register('command', () => { for (let i = 0; i < 1e6; i++); })
+			const plugin2 = new RASP('fast')
+			plugin2.register('command', () => {})`,
+			Filename: "plugin.js",
+		},
+	})
+	SetProfiling(true)
+	defer SetProfiling(false)
+	command := RegisterCheckPoint("command")
+	for i := 0; i < 10; i++ {
+		CheckFlat(command, &FlatParams{}, &ContextGetters{}, 1000)
+	}
+	assert.True(t, strings.HasPrefix(GetTopPlugins(1), `[{"check_point":"command","plugin":"slow"`))
+}
+
 func TestPluginLog(t *testing.T) {
 	Initialize(func(s string) {
 		assert.Equal(t, s, "2333\n")
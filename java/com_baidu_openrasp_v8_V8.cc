@@ -16,6 +16,9 @@
 
 #include "com_baidu_openrasp_v8_V8.h"
 
+#include <algorithm>
+#include <limits>
+
 #include "header.h"
 
 using namespace openrasp_v8;
@@ -25,6 +28,10 @@ ALIGN_FUNCTION JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void* reserved) {
   return JNI_VERSION_1_6;
 }
 
+// request和requestEnd决定插件context对象的生命周期
+static int request_check_point = -1;
+static int request_end_check_point = -1;
+
 /*
  * Class:     com_baidu_openrasp_v8_V8
  * Method:    Initialize
@@ -36,10 +43,12 @@ ALIGN_FUNCTION JNIEXPORT jboolean JNICALL Java_com_baidu_openrasp_v8_V8_Initiali
                                                                                    jint request_pool_size,
                                                                                    jint request_queue_size) {
   if (!is_initialized) {
-    isolate_pool::size = isolate_pool_size;
+    isolate_pool::Configure(std::max<jint>(isolate_pool_size, 1));
     v8_class = V8Class(env);
     ctx_class = ContextClass(env);
     is_initialized = Initialize(0, plugin_log, request_pool_size, request_queue_size);
+    request_check_point = CheckPointRegistry::Register("request");
+    request_end_check_point = CheckPointRegistry::Register("requestEnd");
   }
   return is_initialized;
 }
@@ -51,7 +60,9 @@ ALIGN_FUNCTION JNIEXPORT jboolean JNICALL Java_com_baidu_openrasp_v8_V8_Initiali
  */
 ALIGN_FUNCTION JNIEXPORT jboolean JNICALL Java_com_baidu_openrasp_v8_V8_Dispose(JNIEnv* env, jclass cls) {
   if (is_initialized) {
-    delete snapshot;
+    snapshot_timestamp = 0;
+    std::atomic_store(&snapshot, std::shared_ptr<Snapshot>());
+    isolate_pool::Sweep(UINT64_MAX);
     is_initialized = !Dispose();
   }
   return !is_initialized;
@@ -87,78 +98,64 @@ ALIGN_FUNCTION JNIEXPORT jboolean JNICALL Java_com_baidu_openrasp_v8_V8_CreateSn
   }
   auto duration = std::chrono::system_clock::now().time_since_epoch();
   auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
-  Snapshot* blob = new Snapshot(config, plugin_list, version, millis, env);
+  std::shared_ptr<Snapshot> blob(new Snapshot(config, plugin_list, version, millis, env));
   if (!blob->IsOk()) {
-    delete blob;
     return false;
   }
-  std::lock_guard<std::mutex> lock(snapshot_mtx);
-  delete snapshot;
-  snapshot = blob;
+  // 先在后台创建好新快照的isolate再发布快照，各线程在下次检测时直接从池中换用
+  isolate_pool::Prewarm(blob);
+  std::atomic_store(&snapshot, blob);
+  snapshot_timestamp = blob->timestamp;
+  isolate_pool::Sweep(blob->timestamp);
   return true;
 }
 
-/*
- * Class:     com_baidu_openrasp_v8_V8
- * Method:    Check
- * Signature: (Ljava/lang/String;[BILcom/baidu/openrasp/v8/Context;I)[B
- */
-ALIGN_FUNCTION JNIEXPORT jbyteArray JNICALL Java_com_baidu_openrasp_v8_V8_Check(JNIEnv* env,
-                                                                                jclass cls,
-                                                                                jstring jtype,
-                                                                                jbyteArray jparams,
-                                                                                jint jparams_size,
-                                                                                jobject jcontext,
-                                                                                jint jtimeout) {
-  Isolate* isolate = per_thread_runtime.GetIsolate();
-  if (!isolate) {
-    return nullptr;
-  }
-  v8::Locker lock(isolate);
-  if (isolate->IsDead()) {
-    return nullptr;
-  }
+// 各Check方法共用的检测过程，调用方需已进入isolate和context
+// flat_params不为空时使用扁平params，否则解析jparams中的json
+static v8::Local<v8::Array> CheckImpl(JNIEnv* env,
+                                      Isolate* isolate,
+                                      v8::Local<v8::Context> context,
+                                      jint jtype,
+                                      jbyteArray jparams,
+                                      jint jparams_size,
+                                      const char* flat_params,
+                                      size_t flat_params_size,
+                                      jobject jcontext,
+                                      jint jtimeout) {
   auto data = isolate->GetData();
-  data->custom_data = env;
-  v8::Isolate::Scope isolate_scope(isolate);
-  v8::HandleScope handle_scope(isolate);
   v8::TryCatch try_catch(isolate);
-  v8::Local<v8::Context> context = data->context.Get(isolate);
-  v8::Context::Scope context_scope(context);
-  v8::Local<v8::String> request_type;
   v8::Local<v8::Object> request_params;
   v8::Local<v8::Object> request_context;
   v8::Local<v8::Array> rst;
-  std::string type;
-
-  {
-    type = Jstring2String(env, jtype);
-    if (!v8::String::NewFromUtf8(isolate, type.data(), v8::NewStringType::kInternalized, type.size())
-             .ToLocal(&request_type)) {
-      return nullptr;
-    }
-  }
-
-  if (data->check_points.find(type) != data->check_points.end()) {
-    {
+  if (jtype >= 0 && jtype < data->check_tables.size() && !data->check_tables[jtype].empty()) {
+    if (flat_params) {
+      if (!isolate->NewFlatParams(context, flat_params, flat_params_size).ToLocal(&request_params)) {
+        plugin_log("Invalid flat params\n");
+        return {};
+      }
+      request_params->SetLazyDataProperty(context, NewV8Key(isolate, "stack", 5), GetStack).IsJust();
+    } else {
       auto maybe_string =
           v8::String::NewExternalOneByte(isolate, new ExternalOneByteStringResource(env, jparams, jparams_size));
       if (maybe_string.IsEmpty()) {
-        return nullptr;
+        return {};
       }
       auto maybe_obj = v8::JSON::Parse(context, maybe_string.ToLocalChecked());
       if (maybe_obj.IsEmpty()) {
         plugin_log(Exception(isolate, try_catch));
-        return nullptr;
+        return {};
       }
       request_params = maybe_obj.ToLocalChecked().As<v8::Object>();
       request_params->SetLazyDataProperty(context, NewV8Key(isolate, "stack", 5), GetStack).IsJust();
     }
 
     request_context = per_thread_runtime.request_context.Get(isolate);
-    if (type == "request" || request_context.IsEmpty()) {
+    if (jtype == request_check_point || request_context.IsEmpty()) {
       if (!data->request_context_templ.Get(isolate)->NewInstance(context).ToLocal(&request_context)) {
-        return nullptr;
+        if (flat_params) {
+          isolate->ReleaseFlatParams();
+        }
+        return {};
       }
       per_thread_runtime.request_context.Reset(isolate, request_context);
       if (data->hs.used_heap_size() > 10 * 1024 * 1024) {
@@ -167,13 +164,148 @@ ALIGN_FUNCTION JNIEXPORT jbyteArray JNICALL Java_com_baidu_openrasp_v8_V8_Check(
     }
     request_context->SetInternalField(0, v8::External::New(isolate, jcontext));
 
-    rst = isolate->Check(request_type, request_params, request_context, jtimeout);
+    isolate->Check(context, jtype, request_params, request_context, jtimeout).ToLocal(&rst);
+    if (flat_params) {
+      isolate->ReleaseFlatParams();
+    }
   }
 
-  if (type == "requestEnd") {
+  // 请求结束，在空闲预算内完成GC工作，避免下个请求的检测中出现GC停顿
+  if (jtype == request_end_check_point) {
     per_thread_runtime.request_context.Reset();
+    isolate->IdleNotification();
   }
+  return rst;
+}
 
+// 把结果编码到direct buffer，不足时暂存到当前线程
+static jint WriteResults(JNIEnv* env,
+                         Isolate* isolate,
+                         v8::Local<v8::Context> context,
+                         v8::Local<v8::Array> rst,
+                         jobject jresults) {
+  if (rst.IsEmpty() || rst->Length() == 0) {
+    return 0;
+  }
+  char* buffer = jresults ? reinterpret_cast<char*>(env->GetDirectBufferAddress(jresults)) : nullptr;
+  jlong capacity = buffer ? env->GetDirectBufferCapacity(jresults) : 0;
+  if (capacity < 0) {
+    capacity = 0;
+  }
+  size_t size = isolate->WriteResults(context, rst, buffer, capacity);
+  if (LIKELY(size <= capacity)) {
+    return size;
+  }
+  if (size > std::numeric_limits<jint>::max()) {
+    return -1;
+  }
+  auto& pending = per_thread_runtime.pending_results;
+  pending.resize(size);
+  isolate->WriteResults(context, rst, &pending[0], pending.size());
+  return -static_cast<jint>(size);
+}
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    ConfigSnapshotCache
+ * Signature: (Ljava/lang/String;Z)V
+ */
+ALIGN_FUNCTION JNIEXPORT void JNICALL Java_com_baidu_openrasp_v8_V8_ConfigSnapshotCache(JNIEnv* env,
+                                                                                       jclass cls,
+                                                                                       jstring jdirectory,
+                                                                                       jboolean jin_memory) {
+  Snapshot::ConfigCache(jdirectory ? Jstring2String(env, jdirectory) : std::string(), jin_memory);
+}
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    ConfigMemoryProfile
+ * Signature: (IIIZ)Z
+ */
+ALIGN_FUNCTION JNIEXPORT jboolean JNICALL
+Java_com_baidu_openrasp_v8_V8_ConfigMemoryProfile(JNIEnv* env,
+                                                  jclass cls,
+                                                  jint jmax_old_space_mb,
+                                                  jint jmax_semi_space_kb,
+                                                  jint joom_threshold_mb,
+                                                  jboolean jstress_compaction) {
+  MemoryProfile profile;
+  profile.max_old_space_mb = jmax_old_space_mb > 0 ? jmax_old_space_mb : 0;
+  profile.max_semi_space_kb = jmax_semi_space_kb > 0 ? jmax_semi_space_kb : 0;
+  if (joom_threshold_mb > 0) {
+    profile.oom_threshold_mb = joom_threshold_mb;
+  }
+  profile.stress_compaction = jstress_compaction;
+  return Isolate::ConfigMemoryProfile(profile);
+}
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    ConfigIdleBudget
+ * Signature: (I)V
+ */
+ALIGN_FUNCTION JNIEXPORT void JNICALL Java_com_baidu_openrasp_v8_V8_ConfigIdleBudget(JNIEnv* env,
+                                                                                    jclass cls,
+                                                                                    jint jbudget_ms) {
+  Isolate::ConfigIdleBudget(jbudget_ms);
+}
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    ConfigPluginBudget
+ * Signature: (II)V
+ */
+ALIGN_FUNCTION JNIEXPORT void JNICALL Java_com_baidu_openrasp_v8_V8_ConfigPluginBudget(JNIEnv* env,
+                                                                                      jclass cls,
+                                                                                      jint jmax_timeouts,
+                                                                                      jint jcooldown_ms) {
+  Isolate::ConfigPluginBudget(jmax_timeouts, jcooldown_ms);
+}
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    RegisterCheckPoint
+ * Signature: (Ljava/lang/String;)I
+ * 返回检测点的id，宿主启动时为每个检测点调用一次，之后检测时直接传入id
+ */
+ALIGN_FUNCTION JNIEXPORT jint JNICALL Java_com_baidu_openrasp_v8_V8_RegisterCheckPoint(JNIEnv* env,
+                                                                                       jclass cls,
+                                                                                       jstring jname) {
+  if (jname == nullptr) {
+    return -1;
+  }
+  return CheckPointRegistry::Register(Jstring2String(env, jname));
+}
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    Check
+ * Signature: (I[BILcom/baidu/openrasp/v8/Context;I)[B
+ */
+ALIGN_FUNCTION JNIEXPORT jbyteArray JNICALL Java_com_baidu_openrasp_v8_V8_Check(JNIEnv* env,
+                                                                                jclass cls,
+                                                                                jint jtype,
+                                                                                jbyteArray jparams,
+                                                                                jint jparams_size,
+                                                                                jobject jcontext,
+                                                                                jint jtimeout) {
+  Isolate* isolate = per_thread_runtime.GetIsolate();
+  if (!isolate) {
+    return nullptr;
+  }
+  v8::Locker lock(isolate);
+  if (isolate->IsDead()) {
+    return nullptr;
+  }
+  auto data = isolate->GetData();
+  data->custom_data = env;
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::TryCatch try_catch(isolate);
+  v8::Local<v8::Context> context = data->context.Get(isolate);
+  v8::Context::Scope context_scope(context);
+
+  auto rst = CheckImpl(env, isolate, context, jtype, jparams, jparams_size, nullptr, 0, jcontext, jtimeout);
   if (rst.IsEmpty() || rst->Length() == 0) {
     return nullptr;
   }
@@ -193,6 +325,131 @@ ALIGN_FUNCTION JNIEXPORT jbyteArray JNICALL Java_com_baidu_openrasp_v8_V8_Check(
   return bytearray;
 }
 
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    CheckBuffer
+ * Signature: (I[BILcom/baidu/openrasp/v8/Context;ILjava/nio/ByteBuffer;)I
+ * 结果按ResultAction的二进制格式直接写入调用方提供的direct buffer，不经过JSON序列化
+ * 返回写入的字节数，没有结果返回0，出错返回-1
+ * buffer不足时返回所需长度的相反数，结果暂存在当前线程，通过TakeResults取回
+ */
+ALIGN_FUNCTION JNIEXPORT jint JNICALL Java_com_baidu_openrasp_v8_V8_CheckBuffer(JNIEnv* env,
+                                                                                jclass cls,
+                                                                                jint jtype,
+                                                                                jbyteArray jparams,
+                                                                                jint jparams_size,
+                                                                                jobject jcontext,
+                                                                                jint jtimeout,
+                                                                                jobject jresults) {
+  per_thread_runtime.pending_results.clear();
+  Isolate* isolate = per_thread_runtime.GetIsolate();
+  if (!isolate) {
+    return -1;
+  }
+  v8::Locker lock(isolate);
+  if (isolate->IsDead()) {
+    return -1;
+  }
+  auto data = isolate->GetData();
+  data->custom_data = env;
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> context = data->context.Get(isolate);
+  v8::Context::Scope context_scope(context);
+
+  auto rst = CheckImpl(env, isolate, context, jtype, jparams, jparams_size, nullptr, 0, jcontext, jtimeout);
+  return WriteResults(env, isolate, context, rst, jresults);
+}
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    CheckFlat
+ * Signature: (ILjava/nio/ByteBuffer;ILcom/baidu/openrasp/v8/Context;ILjava/nio/ByteBuffer;)I
+ * params为扁平key/value编码的direct buffer，插件访问到的属性才会被解码，返回值同CheckBuffer
+ */
+ALIGN_FUNCTION JNIEXPORT jint JNICALL Java_com_baidu_openrasp_v8_V8_CheckFlat(JNIEnv* env,
+                                                                              jclass cls,
+                                                                              jint jtype,
+                                                                              jobject jparams,
+                                                                              jint jparams_size,
+                                                                              jobject jcontext,
+                                                                              jint jtimeout,
+                                                                              jobject jresults) {
+  per_thread_runtime.pending_results.clear();
+  const char* params = jparams ? reinterpret_cast<const char*>(env->GetDirectBufferAddress(jparams)) : nullptr;
+  if (!params || jparams_size < 0 || jparams_size > env->GetDirectBufferCapacity(jparams)) {
+    return -1;
+  }
+  Isolate* isolate = per_thread_runtime.GetIsolate();
+  if (!isolate) {
+    return -1;
+  }
+  v8::Locker lock(isolate);
+  if (isolate->IsDead()) {
+    return -1;
+  }
+  auto data = isolate->GetData();
+  data->custom_data = env;
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> context = data->context.Get(isolate);
+  v8::Context::Scope context_scope(context);
+
+  auto rst = CheckImpl(env, isolate, context, jtype, nullptr, 0, params, jparams_size, jcontext, jtimeout);
+  return WriteResults(env, isolate, context, rst, jresults);
+}
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    TakeResults
+ * Signature: ()[B
+ * 取回上一次CheckBuffer因buffer不足而暂存的结果
+ */
+ALIGN_FUNCTION JNIEXPORT jbyteArray JNICALL Java_com_baidu_openrasp_v8_V8_TakeResults(JNIEnv* env, jclass cls) {
+  auto& pending = per_thread_runtime.pending_results;
+  if (pending.empty()) {
+    return nullptr;
+  }
+  auto bytearray = env->NewByteArray(pending.size());
+  if (bytearray != nullptr) {
+    env->SetByteArrayRegion(bytearray, 0, pending.size(), reinterpret_cast<const jbyte*>(pending.data()));
+  }
+  pending.clear();
+  return bytearray;
+}
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    GetMetrics
+ * Signature: ()Ljava/lang/String;
+ * 不需要isolate，可以在任意线程调用
+ */
+ALIGN_FUNCTION JNIEXPORT jstring JNICALL Java_com_baidu_openrasp_v8_V8_GetMetrics(JNIEnv* env, jclass cls) {
+  return String2Jstring(env, Metrics::ToJson());
+}
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    SetProfiling
+ * Signature: (Z)V
+ */
+ALIGN_FUNCTION JNIEXPORT void JNICALL Java_com_baidu_openrasp_v8_V8_SetProfiling(JNIEnv* env,
+                                                                                 jclass cls,
+                                                                                 jboolean jenable) {
+  Metrics::SetProfiling(jenable);
+}
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    GetTopPlugins
+ * Signature: (I)Ljava/lang/String;
+ */
+ALIGN_FUNCTION JNIEXPORT jstring JNICALL Java_com_baidu_openrasp_v8_V8_GetTopPlugins(JNIEnv* env,
+                                                                                     jclass cls,
+                                                                                     jint jn) {
+  return String2Jstring(env, Metrics::TopPluginsJson(jn > 0 ? jn : 0));
+}
+
 /*
  * Class:     com_baidu_openrasp_v8_V8
  * Method:    ExecuteScript
@@ -31,13 +31,101 @@ JNIEXPORT jboolean JNICALL Java_com_baidu_openrasp_v8_V8_Dispose
 JNIEXPORT jboolean JNICALL Java_com_baidu_openrasp_v8_V8_CreateSnapshot
   (JNIEnv *, jclass, jstring, jobjectArray, jstring);
 
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    ConfigSnapshotCache
+ * Signature: (Ljava/lang/String;Z)V
+ */
+JNIEXPORT void JNICALL Java_com_baidu_openrasp_v8_V8_ConfigSnapshotCache
+  (JNIEnv *, jclass, jstring, jboolean);
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    ConfigMemoryProfile
+ * Signature: (IIIZ)Z
+ */
+JNIEXPORT jboolean JNICALL Java_com_baidu_openrasp_v8_V8_ConfigMemoryProfile
+  (JNIEnv *, jclass, jint, jint, jint, jboolean);
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    ConfigIdleBudget
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_com_baidu_openrasp_v8_V8_ConfigIdleBudget
+  (JNIEnv *, jclass, jint);
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    ConfigPluginBudget
+ * Signature: (II)V
+ */
+JNIEXPORT void JNICALL Java_com_baidu_openrasp_v8_V8_ConfigPluginBudget
+  (JNIEnv *, jclass, jint, jint);
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    RegisterCheckPoint
+ * Signature: (Ljava/lang/String;)I
+ */
+JNIEXPORT jint JNICALL Java_com_baidu_openrasp_v8_V8_RegisterCheckPoint
+  (JNIEnv *, jclass, jstring);
+
 /*
  * Class:     com_baidu_openrasp_v8_V8
  * Method:    Check
- * Signature: (Ljava/lang/String;[BILcom/baidu/openrasp/v8/Context;I)[B
+ * Signature: (I[BILcom/baidu/openrasp/v8/Context;I)[B
  */
 JNIEXPORT jbyteArray JNICALL Java_com_baidu_openrasp_v8_V8_Check
-  (JNIEnv *, jclass, jstring, jbyteArray, jint, jobject, jint);
+  (JNIEnv *, jclass, jint, jbyteArray, jint, jobject, jint);
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    CheckBuffer
+ * Signature: (I[BILcom/baidu/openrasp/v8/Context;ILjava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL Java_com_baidu_openrasp_v8_V8_CheckBuffer
+  (JNIEnv *, jclass, jint, jbyteArray, jint, jobject, jint, jobject);
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    CheckFlat
+ * Signature: (ILjava/nio/ByteBuffer;ILcom/baidu/openrasp/v8/Context;ILjava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL Java_com_baidu_openrasp_v8_V8_CheckFlat
+  (JNIEnv *, jclass, jint, jobject, jint, jobject, jint, jobject);
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    TakeResults
+ * Signature: ()[B
+ */
+JNIEXPORT jbyteArray JNICALL Java_com_baidu_openrasp_v8_V8_TakeResults
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    GetMetrics
+ * Signature: ()Ljava/lang/String;
+ */
+JNIEXPORT jstring JNICALL Java_com_baidu_openrasp_v8_V8_GetMetrics
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    SetProfiling
+ * Signature: (Z)V
+ */
+JNIEXPORT void JNICALL Java_com_baidu_openrasp_v8_V8_SetProfiling
+  (JNIEnv *, jclass, jboolean);
+
+/*
+ * Class:     com_baidu_openrasp_v8_V8
+ * Method:    GetTopPlugins
+ * Signature: (I)Ljava/lang/String;
+ */
+JNIEXPORT jstring JNICALL Java_com_baidu_openrasp_v8_V8_GetTopPlugins
+  (JNIEnv *, jclass, jint);
 
 /*
  * Class:     com_baidu_openrasp_v8_V8
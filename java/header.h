@@ -18,6 +18,7 @@
 
 #include <jni.h>
 
+#include <atomic>
 #include <chrono>
 #include <memory>
 #include <mutex>
@@ -32,8 +33,9 @@
 #define ALIGN_FUNCTION
 #endif
 
-extern openrasp_v8::Snapshot* snapshot;
-extern std::mutex snapshot_mtx;
+// 快照通过std::atomic_load和std::atomic_store读写，snapshot_timestamp用于检测路径上廉价地判断isolate是否过期
+extern std::shared_ptr<openrasp_v8::Snapshot> snapshot;
+extern std::atomic<uint64_t> snapshot_timestamp;
 
 void plugin_log(JNIEnv* env, const std::string& message);
 void plugin_log(const std::string& message);
@@ -83,20 +85,27 @@ inline JNIEnv* GetJNIEnv(openrasp_v8::Isolate* isolate) {
 }
 
 namespace isolate_pool {
-extern size_t size;
-extern std::shared_ptr<openrasp_v8::Isolate> GetIsolate();
+extern void Configure(size_t size);
+extern std::shared_ptr<openrasp_v8::Isolate> GetIsolate(const std::shared_ptr<openrasp_v8::Snapshot>& snapshot);
+extern void Prewarm(const std::shared_ptr<openrasp_v8::Snapshot>& snapshot);
+extern void Sweep(uint64_t timestamp);
 }  // namespace isolate_pool
 
 class PerThreadRuntime {
  public:
   ~PerThreadRuntime() { Dispose(); }
   openrasp_v8::Isolate* GetIsolate() {
-    if (!snapshot) {
+    uint64_t timestamp = snapshot_timestamp.load(std::memory_order_acquire);
+    if (!timestamp) {
       return nullptr;
     }
-    if (!isolate || isolate->IsDead() || isolate->IsExpired(snapshot->timestamp)) {
+    if (!isolate || isolate->IsDead() || isolate->IsExpired(timestamp)) {
       Dispose();
-      isolate = isolate_pool::GetIsolate();
+      auto current = std::atomic_load(&snapshot);
+      if (!current) {
+        return nullptr;
+      }
+      isolate = isolate_pool::GetIsolate(current);
     }
     return isolate.get();
   }
@@ -106,6 +115,7 @@ class PerThreadRuntime {
   }
   std::shared_ptr<openrasp_v8::Isolate> isolate;
   v8::Persistent<v8::Object> request_context;
+  std::string pending_results;  // CheckBuffer的buffer不足时暂存的结果
 };
 
 class ExternalOneByteStringResource : public v8::String::ExternalOneByteStringResource {
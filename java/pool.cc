@@ -14,51 +14,299 @@
  * limitations under the License.
  */
 
-#include <iostream>
-#include <list>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
 #include "header.h"
 
 namespace isolate_pool {
 
-class IsolateDeleter {
+// 槽位中的isolate连同引用计数，槽位本身持有一个引用，每个使用者各持有一个，计数归零时销毁isolate
+// 请求线程读到Entry指针后再把计数从非零加一，Entry对象本身不释放，归零后回收复用，所以读到旧指针也不会访问已释放的内存
+// 复用的Entry先写入isolate再以release发布计数，加一成功时一定能看到对应的isolate
+class Entry {
  public:
-  ALIGN_FUNCTION void operator()(openrasp_v8::Isolate* isolate) { isolate->Dispose(); }
+  openrasp_v8::Isolate* isolate = nullptr;
+  std::atomic<uint64_t> timestamp{0};  // 复用时可能被改写，未持有引用时只能作为提示
+  std::atomic<size_t> refs{0};
 };
 
-size_t size = 1;
-static std::list<std::weak_ptr<openrasp_v8::Isolate>> isolates;
+static std::mutex free_mtx;
+static std::vector<Entry*> free_entries;
 
-std::shared_ptr<openrasp_v8::Isolate> GetIsolate() {
-  std::lock_guard<std::mutex> lock1(snapshot_mtx);
-  isolates.remove_if([](std::weak_ptr<openrasp_v8::Isolate> ptr) {
-    auto p = ptr.lock();
-    return !p || p->IsDead() || p->IsExpired(snapshot->timestamp);
-  });
-  isolates.sort([](std::weak_ptr<openrasp_v8::Isolate> p1, std::weak_ptr<openrasp_v8::Isolate> p2) {
-    return p1.use_count() < p2.use_count();
-  });
+static Entry* NewEntry(openrasp_v8::Isolate* isolate, uint64_t timestamp) {
+  Entry* entry = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(free_mtx);
+    if (!free_entries.empty()) {
+      entry = free_entries.back();
+      free_entries.pop_back();
+    }
+  }
+  if (!entry) {
+    entry = new Entry();
+  }
+  entry->isolate = isolate;
+  entry->timestamp.store(timestamp, std::memory_order_relaxed);
+  entry->refs.store(1, std::memory_order_release);
+  return entry;
+}
+
+static bool Acquire(Entry* entry) {
+  size_t refs = entry->refs.load(std::memory_order_relaxed);
+  do {
+    if (refs == 0) {
+      return false;
+    }
+  } while (!entry->refs.compare_exchange_weak(refs, refs + 1, std::memory_order_acquire, std::memory_order_relaxed));
+  return true;
+}
+
+static ALIGN_FUNCTION void Release(Entry* entry) {
+  if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  entry->isolate->Dispose();
+  entry->isolate = nullptr;
+  std::lock_guard<std::mutex> lock(free_mtx);
+  free_entries.push_back(entry);
+}
+
+// building标记槽位正在创建isolate，避免多个线程同时为同一个槽位创建
+class Slot {
+ public:
+  ~Slot() {
+    auto old = entry.exchange(nullptr);
+    if (old) {
+      Release(old);
+    }
+  }
+  std::atomic<Entry*> entry{nullptr};
+  std::atomic<bool> building{false};
+};
+
+// 池按cpu分片，线程优先使用所在cpu对应分片中的isolate，减少跨核共享isolate时的缓存失效
+// 取isolate只有原子读和引用计数的CAS，不持有任何锁，也不在锁内创建isolate
+// 冷启动时分片的槽位都在创建中，请求线程在分片的条件变量上等待，创建完成后由创建者唤醒
+class Shard {
+ public:
+  explicit Shard(size_t count) : slots(new Slot[count]), count(count) {}
+  std::unique_ptr<Slot[]> slots;
+  size_t count;
+  std::mutex mtx;
+  std::condition_variable cv;
+  uint64_t version = 0;  // 每次有槽位创建结束后递增，受mtx保护
+};
+
+static std::vector<std::unique_ptr<Shard>> shards;
+
+// 在V8.Initialize中调用，此时没有线程在做检测，Dispose后重新Initialize时按新的大小重建分片
+void Configure(size_t size) {
+  shards.clear();
+  {
+    std::lock_guard<std::mutex> lock(free_mtx);
+    for (auto entry : free_entries) {
+      delete entry;
+    }
+    free_entries.clear();
+  }
+  size_t total = std::max<size_t>(size, 1);
+  size_t shard_count = std::min<size_t>(total, std::max<unsigned>(std::thread::hardware_concurrency(), 1));
+  for (size_t i = 0; i < shard_count; i++) {
+    shards.emplace_back(new Shard(total / shard_count + (i < total % shard_count ? 1 : 0)));
+  }
+}
+
+// 其他平台没有廉价的获取当前cpu的方法，按线程分散到各个分片
+static size_t CurrentCpu() {
+#ifdef __linux__
+  int cpu = sched_getcpu();
+  if (cpu >= 0) {
+    return cpu;
+  }
+#endif
+  return std::hash<std::thread::id>()(std::this_thread::get_id());
+}
+
+// isolate的时间戳取自快照而不是创建时间，Prewarm期间用旧快照创建的isolate在新快照发布后也会失效
+static Entry* NewIsolate(const std::shared_ptr<openrasp_v8::Snapshot>& snapshot) {
+  auto isolate = openrasp_v8::Isolate::New(snapshot.get(), snapshot->timestamp);
+  if (!isolate) {
+    return nullptr;
+  }
+  {
+    v8::Locker lock(isolate);
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    isolate->Initialize();
+    isolate->GetData()->request_context_templ.Reset(isolate, CreateRequestContextTemplate(isolate));
+  }
+  return NewEntry(isolate, snapshot->timestamp);
+}
+
+// 把新建的isolate放入槽位，释放槽位对旧isolate的引用，然后唤醒等待的请求线程
+static void Publish(Shard& shard, Slot& slot, Entry* entry) {
+  if (entry) {
+    auto old = slot.entry.exchange(entry, std::memory_order_acq_rel);
+    if (old) {
+      Release(old);
+    }
+  }
+  slot.building.store(false);
+  {
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    shard.version++;
+  }
+  shard.cv.notify_all();
+}
+
+// 槽位持有的isolate失效后从槽位中移除，只有槽位仍指向它时才释放槽位的引用
+static void Evict(Slot& slot, Entry* entry) {
+  if (slot.entry.compare_exchange_strong(entry, nullptr)) {
+    Release(entry);
+  }
+}
+
+// 返回给调用方的shared_ptr析构时释放引用
+static std::shared_ptr<openrasp_v8::Isolate> Share(Entry* entry) {
+  return std::shared_ptr<openrasp_v8::Isolate>(entry->isolate, [entry](openrasp_v8::Isolate*) { Release(entry); });
+}
+
+// 从分片中选出使用者最少的可用isolate并持有一个引用，同时记下第一个空闲或失效的槽位
+static Entry* Pick(Shard& shard, uint64_t timestamp, Slot** vacant) {
+  for (;;) {
+    Entry* best = nullptr;
+    Slot* best_slot = nullptr;
+    size_t best_refs = 0;
+    for (size_t i = 0; i < shard.count; i++) {
+      auto& slot = shard.slots[i];
+      auto entry = slot.entry.load(std::memory_order_acquire);
+      size_t refs = entry ? entry->refs.load(std::memory_order_relaxed) : 0;
+      if (refs != 0 && entry->timestamp.load(std::memory_order_relaxed) >= timestamp) {
+        if (!best || refs < best_refs) {
+          best = entry;
+          best_slot = &slot;
+          best_refs = refs;
+        }
+      } else if (vacant && !*vacant && !slot.building.load(std::memory_order_relaxed)) {
+        *vacant = &slot;
+      }
+    }
+    if (!best) {
+      return nullptr;
+    }
+    // 选中之后可能已被替换并销毁，重新选择
+    if (!Acquire(best)) {
+      continue;
+    }
+    if (best->timestamp.load(std::memory_order_relaxed) >= timestamp && !best->isolate->IsDead()) {
+      return best;
+    }
+    Evict(*best_slot, best);
+    Release(best);
+  }
+}
 
-  if (isolates.size() >= size) {
-    auto p = isolates.front().lock();
-    if (p) {
-      return p;
+std::shared_ptr<openrasp_v8::Isolate> GetIsolate(const std::shared_ptr<openrasp_v8::Snapshot>& snapshot) {
+  if (UNLIKELY(shards.empty())) {
+    return nullptr;
+  }
+  uint64_t timestamp = snapshot->timestamp;
+  size_t index = CurrentCpu() % shards.size();
+  auto& shard = *shards[index];
+
+  for (;;) {
+    uint64_t version;
+    {
+      std::lock_guard<std::mutex> lock(shard.mtx);
+      version = shard.version;
+    }
+    Slot* vacant = nullptr;
+    auto entry = Pick(shard, timestamp, &vacant);
+    // 分片未满时优先新建，isolate在锁外创建，完成后再放入槽位
+    if (vacant && !vacant->building.exchange(true)) {
+      if (entry) {
+        Release(entry);
+      }
+      auto created = NewIsolate(snapshot);
+      if (created) {
+        // 调用方持有的引用
+        Acquire(created);
+      }
+      Publish(shard, *vacant, created);
+      return created ? Share(created) : nullptr;
+    }
+    if (entry) {
+      return Share(entry);
     }
+    // 本分片的槽位都在创建中，借用其他分片的
+    for (size_t i = 1; i < shards.size(); i++) {
+      entry = Pick(*shards[(index + i) % shards.size()], timestamp, nullptr);
+      if (entry) {
+        return Share(entry);
+      }
+    }
+    // 冷启动时所有槽位都在创建中，等待本分片有槽位创建完成
+    std::unique_lock<std::mutex> lock(shard.mtx);
+    shard.cv.wait(lock, [&] { return shard.version != version; });
   }
+}
 
-  auto duration = std::chrono::system_clock::now().time_since_epoch();
-  auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
-  auto isolate = openrasp_v8::Isolate::New(snapshot, millis);
-  v8::Locker lock2(isolate);
-  v8::Isolate::Scope isolate_scope(isolate);
-  v8::HandleScope handle_scope(isolate);
-  isolate->Initialize();
-  isolate->GetData()->request_context_templ.Reset(isolate, CreateRequestContextTemplate(isolate));
+static ALIGN_FUNCTION void PrewarmWorker(const std::shared_ptr<openrasp_v8::Snapshot>* snapshot,
+                                         std::vector<std::pair<Shard*, Slot*>>* slots,
+                                         std::atomic<size_t>* next) {
+  for (size_t i = (*next)++; i < slots->size(); i = (*next)++) {
+    auto& shard = *(*slots)[i].first;
+    auto& slot = *(*slots)[i].second;
+    // 请求线程可能正在用旧快照为该槽位创建isolate，等它完成后再用新快照替换
+    while (slot.building.exchange(true)) {
+      std::this_thread::yield();
+    }
+    Publish(shard, slot, NewIsolate(*snapshot));
+  }
+}
 
-  std::shared_ptr<openrasp_v8::Isolate> ptr(isolate, IsolateDeleter());
-  isolates.push_front(ptr);
+// 在后台线程中用新快照创建isolate填满池，调用方在此之后才发布快照，请求线程换用新快照时不必自己创建isolate
+void Prewarm(const std::shared_ptr<openrasp_v8::Snapshot>& snapshot) {
+  std::vector<std::pair<Shard*, Slot*>> slots;
+  for (auto& shard : shards) {
+    for (size_t i = 0; i < shard->count; i++) {
+      slots.emplace_back(shard.get(), &shard->slots[i]);
+    }
+  }
+  std::atomic<size_t> next{0};
+  size_t thread_count = std::min<size_t>(slots.size(), std::max<unsigned>(std::thread::hardware_concurrency(), 1));
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < thread_count; i++) {
+    threads.emplace_back(PrewarmWorker, &snapshot, &slots, &next);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
 
-  return ptr;
+// 释放池中失效的isolate，在快照替换之后调用，不占用检测路径
+void Sweep(uint64_t timestamp) {
+  for (auto& shard : shards) {
+    for (size_t i = 0; i < shard->count; i++) {
+      auto& slot = shard->slots[i];
+      auto entry = slot.entry.load(std::memory_order_acquire);
+      if (!entry || !Acquire(entry)) {
+        continue;
+      }
+      if (entry->timestamp.load(std::memory_order_relaxed) < timestamp || entry->isolate->IsDead()) {
+        Evict(slot, entry);
+      }
+      Release(entry);
+    }
+  }
 }
-}  // namespace isolate_pool
\ No newline at end of file
+}  // namespace isolate_pool
@@ -0,0 +1,72 @@
+package com.baidu.openrasp.v8;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.Charset;
+import java.util.ArrayList;
+import java.util.List;
+
+/**
+ * V8.CheckBuffer返回的二进制结果，格式见base/bundle.h中的ResultAction
+ */
+public class CheckResult {
+
+    public static final int LOG = 0;
+
+    public static final int BLOCK = 1;
+
+    public static final int IGNORE = 2;
+
+    public static final int EXCEPTION = 3;
+
+    public static final int OTHER = 255;
+
+    private static final int HAS_JSON = 1;
+
+    private static final Charset UTF8 = Charset.forName("UTF-8");
+
+    public int action;
+
+    public int confidence;
+
+    public String name;
+
+    public String message;
+
+    /**
+     * 插件返回了额外字段或者action不在枚举中时，为完整结果的json，否则为null
+     */
+    public byte[] json;
+
+    public static List<CheckResult> parse(ByteBuffer buffer, int size) {
+        ByteBuffer buf = buffer.duplicate();
+        buf.order(ByteOrder.nativeOrder());
+        buf.clear();
+        buf.limit(size);
+        List<CheckResult> results = new ArrayList<CheckResult>();
+        while (buf.hasRemaining()) {
+            CheckResult result = new CheckResult();
+            result.action = buf.get() & 0xff;
+            int flags = buf.get() & 0xff;
+            buf.getShort();
+            result.confidence = buf.getInt();
+            result.name = new String(getBytes(buf), UTF8);
+            result.message = new String(getBytes(buf), UTF8);
+            if ((flags & HAS_JSON) != 0) {
+                result.json = getBytes(buf);
+            }
+            results.add(result);
+        }
+        return results;
+    }
+
+    public static List<CheckResult> parse(byte[] data) {
+        return parse(ByteBuffer.wrap(data), data.length);
+    }
+
+    private static byte[] getBytes(ByteBuffer buf) {
+        byte[] bytes = new byte[buf.getInt()];
+        buf.get(bytes);
+        return bytes;
+    }
+}
@@ -0,0 +1,70 @@
+package com.baidu.openrasp.v8;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.Charset;
+
+/**
+ * 构造V8.CheckFlat使用的扁平params，格式见base/bundle.h中的FlatParamType
+ * 插件只会解码访问到的属性，大字段不会被无谓地解析
+ */
+public class FlatParams {
+
+    private static final byte STRING = 0;
+
+    private static final byte JSON = 1;
+
+    private static final Charset UTF8 = Charset.forName("UTF-8");
+
+    private ByteBuffer buffer;
+
+    public FlatParams() {
+        this(4096);
+    }
+
+    public FlatParams(int capacity) {
+        buffer = ByteBuffer.allocateDirect(capacity).order(ByteOrder.nativeOrder());
+    }
+
+    public FlatParams putString(String key, String value) {
+        return put(key, STRING, value.getBytes(UTF8));
+    }
+
+    /**
+     * @param json utf8编码的json，插件访问时才会被解析
+     */
+    public FlatParams putJson(String key, byte[] json) {
+        return put(key, JSON, json);
+    }
+
+    public FlatParams clear() {
+        buffer.clear();
+        return this;
+    }
+
+    public ByteBuffer getBuffer() {
+        return buffer;
+    }
+
+    public int size() {
+        return buffer.position();
+    }
+
+    private FlatParams put(String key, byte type, byte[] value) {
+        byte[] k = key.getBytes(UTF8);
+        ensure(4 + k.length + 1 + 4 + value.length);
+        buffer.putInt(k.length).put(k).put(type).putInt(value.length).put(value);
+        return this;
+    }
+
+    private void ensure(int length) {
+        if (buffer.remaining() >= length) {
+            return;
+        }
+        int capacity = Math.max(buffer.capacity() * 2, buffer.position() + length);
+        ByteBuffer buf = ByteBuffer.allocateDirect(capacity).order(ByteOrder.nativeOrder());
+        buffer.flip();
+        buf.put(buffer);
+        buffer = buf;
+    }
+}
@@ -1,5 +1,8 @@
 package com.baidu.openrasp.v8;
 
+import java.nio.ByteBuffer;
+import java.util.concurrent.ConcurrentHashMap;
+
 import com.baidu.openrasp.nativelib.NativeLoader;
 
 public class V8 {
@@ -10,6 +13,8 @@ public class V8 {
 
     private static boolean isLoad = false;
 
+    private static ConcurrentHashMap<String, Integer> checkPoints = new ConcurrentHashMap<String, Integer>();
+
     public synchronized static native boolean Initialize(int isolate_pool_size, int request_pool_size,
             int request_queue_size);
 
@@ -17,7 +22,101 @@ public class V8 {
 
     public synchronized static native boolean CreateSnapshot(String config, Object[] plugins, String version);
 
-    public static native byte[] Check(String type, byte[] params, int params_size, Context context, int timeout);
+    /**
+     * 配置、插件和版本号相同时复用之前生成的快照，directory为null或空串时不使用文件缓存
+     */
+    public synchronized static native void ConfigSnapshotCache(String directory, boolean inMemory);
+
+    /**
+     * 内存配置，需在Initialize之前调用，之后的调用被忽略并返回false，0表示使用v8默认值
+     * stressCompaction为true时每次GC都压缩整个堆，最省内存，为false时新生代恢复工作，吞吐更高
+     */
+    public synchronized static native boolean ConfigMemoryProfile(int maxOldSpaceMb, int maxSemiSpaceKb,
+            int oomThresholdMb, boolean stressCompaction);
+
+    /**
+     * requestEnd检测结束后留给v8执行GC的时间，默认1毫秒，不大于0时不执行
+     */
+    public static native void ConfigIdleBudget(int budgetMs);
+
+    /**
+     * 检测函数在分到的时间内未结束会被中断，其他检测函数的结果照常返回
+     * 连续超时maxTimeouts次后暂停调用cooldownMs毫秒，maxTimeouts不大于0时不暂停，默认不暂停
+     */
+    public static native void ConfigPluginBudget(int maxTimeouts, int cooldownMs);
+
+    /**
+     * 注册检测点，返回的id在进程内保持不变，宿主可以在启动时缓存，检测时直接传入id
+     */
+    public static native int RegisterCheckPoint(String name);
+
+    public static native byte[] Check(int type, byte[] params, int params_size, Context context, int timeout);
+
+    /**
+     * 结果直接写入results（必须是direct buffer），使用CheckResult.parse解析
+     * 
+     * @return 写入的字节数，没有结果返回0，出错返回-1，results空间不足时返回所需长度的相反数，此时需调用TakeResults取回结果
+     */
+    public static native int CheckBuffer(int type, byte[] params, int params_size, Context context, int timeout,
+            ByteBuffer results);
+
+    /**
+     * params使用扁平编码（见FlatParams），插件访问到的属性才会被解码，返回值同CheckBuffer
+     */
+    public static native int CheckFlat(int type, ByteBuffer params, int params_size, Context context, int timeout,
+            ByteBuffer results);
+
+    public static int CheckFlat(int type, FlatParams params, Context context, int timeout, ByteBuffer results) {
+        return CheckFlat(type, params.getBuffer(), params.size(), context, timeout, results);
+    }
+
+    public static byte[] Check(String type, byte[] params, int params_size, Context context, int timeout) {
+        if (type == null) {
+            return null;
+        }
+        return Check(GetCheckPoint(type), params, params_size, context, timeout);
+    }
+
+    public static int CheckBuffer(String type, byte[] params, int params_size, Context context, int timeout,
+            ByteBuffer results) {
+        if (type == null) {
+            return -1;
+        }
+        return CheckBuffer(GetCheckPoint(type), params, params_size, context, timeout, results);
+    }
+
+    public static int CheckFlat(String type, FlatParams params, Context context, int timeout, ByteBuffer results) {
+        if (type == null) {
+            return -1;
+        }
+        return CheckFlat(GetCheckPoint(type), params, context, timeout, results);
+    }
+
+    public static int GetCheckPoint(String name) {
+        Integer id = checkPoints.get(name);
+        if (id == null) {
+            id = RegisterCheckPoint(name);
+            checkPoints.put(name, id);
+        }
+        return id;
+    }
+
+    public static native byte[] TakeResults();
+
+    /**
+     * 进程内所有检测的统计快照，json格式，按检测点和插件分别给出调用次数、各类结果的次数和耗时分位数（微秒）
+     */
+    public static native String GetMetrics();
+
+    /**
+     * 开启后额外统计每个插件占用的线程CPU时间，有一定开销，默认关闭
+     */
+    public static native void SetProfiling(boolean enable);
+
+    /**
+     * 按CPU时间（未开启profiling时按累计耗时）从高到低返回前n个插件在各检测点的统计，json数组
+     */
+    public static native String GetTopPlugins(int n);
 
     public static native String ExecuteScript(String source, String filename) throws Exception;
 
@@ -1,11 +1,13 @@
 package com.baidu.openrasp.v8;
 
 import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertFalse;
 import static org.junit.Assert.assertNotNull;
 import static org.junit.Assert.assertNull;
 import static org.junit.Assert.assertTrue;
 import static org.junit.Assert.fail;
 
+import java.nio.ByteBuffer;
 import java.util.ArrayList;
 import java.util.HashMap;
 import java.util.List;
@@ -74,6 +76,11 @@ public class V8Test {
     assertTrue(V8.Initialize());
   }
 
+  @Test
+  public void ConfigMemoryProfileAfterInitialize() {
+    assertFalse(V8.ConfigMemoryProfile(64, 1024, 48, false));
+  }
+
   @Test
   public void ExecuteScript() throws Exception {
     assertTrue(V8.CreateSnapshot("{}", new Object[0], "1.2.3"));
@@ -138,6 +145,108 @@ public class V8Test {
     }
   }
 
+  @Test
+  public void CheckBuffer() throws Exception {
+    List<String[]> scripts = new ArrayList<String[]>();
+    scripts.add(new String[] { "test.js",
+        "const plugin = new RASP('test')\nplugin.register('request', (params) => params)" });
+    assertTrue(V8.CreateSnapshot("{}", scripts.toArray(), "1.2.3"));
+    ByteBuffer buf = ByteBuffer.allocateDirect(64);
+    {
+      String params = "{\"action\":\"ignore\"}";
+      assertEquals(0, V8.CheckBuffer("request", params.getBytes(), params.getBytes().length, new ContextImpl(), 200, buf));
+    }
+    {
+      String params = "{\"action\":\"block\",\"confidence\":90}";
+      int size = V8.CheckBuffer("request", params.getBytes(), params.getBytes().length, new ContextImpl(), 200, buf);
+      assertTrue(size > 0);
+      CheckResult result = CheckResult.parse(buf, size).get(0);
+      assertEquals(CheckResult.BLOCK, result.action);
+      assertEquals(90, result.confidence);
+      assertEquals("test", result.name);
+      assertEquals("", result.message);
+      assertNull(result.json);
+    }
+    {
+      Map<String, Object> params = new HashMap<String, Object>();
+      params.put("action", "log");
+      params.put("message", "test 中文 & 😊 test 中文 & 😊 test 中文 & 😊");
+      ByteArrayOutputStream data = new ByteArrayOutputStream();
+      JsonStream.serialize(params, data);
+      int size = V8.CheckBuffer("request", data.getByteArray(), data.size(), new ContextImpl(), 200, buf);
+      assertTrue(size < 0);
+      byte[] rst = V8.TakeResults();
+      assertEquals(-size, rst.length);
+      CheckResult result = CheckResult.parse(rst).get(0);
+      assertEquals(CheckResult.LOG, result.action);
+      assertEquals("test 中文 & 😊 test 中文 & 😊 test 中文 & 😊", result.message);
+    }
+  }
+
+  @Test
+  public void GetMetrics() throws Exception {
+    List<String[]> scripts = new ArrayList<String[]>();
+    scripts.add(new String[] { "metrics.js",
+        "const plugin = new RASP('metrics')\nplugin.register('command', (params) => params)" });
+    assertTrue(V8.CreateSnapshot("{}", scripts.toArray(), "1.2.3"));
+    String params = "{\"action\":\"block\"}";
+    V8.Check("command", params.getBytes(), params.getBytes().length, new ContextImpl(), 200);
+    String metrics = V8.GetMetrics();
+    assertTrue(metrics.startsWith("{\"oom\":"));
+    assertTrue(metrics.contains("\"check_point\":\"command\",\"plugin\":\"metrics\""));
+  }
+
+  @Test
+  public void GetTopPlugins() throws Exception {
+    List<String[]> scripts = new ArrayList<String[]>();
+    scripts.add(new String[] { "profiling.js",
+        "const plugin = new RASP('slow')\nplugin.register('command', () => { for (let i = 0; i < 1e6; i++); })\n"
+            + "const plugin2 = new RASP('fast')\nplugin2.register('command', () => {})" });
+    assertTrue(V8.CreateSnapshot("{}", scripts.toArray(), "1.2.3"));
+    V8.SetProfiling(true);
+    String params = "{}";
+    for (int i = 0; i < 10; i++) {
+      V8.Check("command", params.getBytes(), params.getBytes().length, new ContextImpl(), 1000);
+    }
+    V8.SetProfiling(false);
+    assertTrue(V8.GetTopPlugins(1).startsWith("[{\"check_point\":\"command\",\"plugin\":\"slow\""));
+  }
+
+  @Test
+  public void CheckFlat() throws Exception {
+    List<String[]> scripts = new ArrayList<String[]>();
+    scripts.add(new String[] { "test.js",
+        "const plugin = new RASP('test')\nplugin.register('command', (params) => ({ action: params.action, message: params.command + params.json.a }))" });
+    assertTrue(V8.CreateSnapshot("{}", scripts.toArray(), "1.2.3"));
+    ByteBuffer buf = ByteBuffer.allocateDirect(1024);
+    FlatParams params = new FlatParams(16);
+    params.putString("action", "block").putString("command", "test 中文 & 😊").putJson("json", "{\"a\":1}".getBytes());
+    int size = V8.CheckFlat("command", params, new ContextImpl(), 200, buf);
+    assertTrue(size > 0);
+    CheckResult result = CheckResult.parse(buf, size).get(0);
+    assertEquals(CheckResult.BLOCK, result.action);
+    assertEquals("test 中文 & 😊1", result.message);
+    params.clear().putString("action", "ignore");
+    assertEquals(0, V8.CheckFlat("command", params, new ContextImpl(), 200, buf));
+  }
+
+  @Test
+  public void CheckPointId() throws Exception {
+    List<String[]> scripts = new ArrayList<String[]>();
+    scripts.add(new String[] { "test.js", "const plugin = new RASP('test')\nplugin.register('sql', (params) => params)" });
+    assertTrue(V8.CreateSnapshot("{}", scripts.toArray(), "1.2.3"));
+    int sql = V8.RegisterCheckPoint("sql");
+    assertEquals(sql, V8.RegisterCheckPoint("sql"));
+    assertEquals(sql, V8.GetCheckPoint("sql"));
+    assertTrue(sql != V8.RegisterCheckPoint("unknown"));
+    String params = "{\"action\":\"log\"}";
+    byte[] rst = V8.Check(sql, params.getBytes(), params.getBytes().length, new ContextImpl(), 200);
+    assertEquals("log", JsonIterator.deserialize(rst).asList().get(0).toString("action"));
+    assertNull(V8.Check(V8.RegisterCheckPoint("unknown"), params.getBytes(), params.getBytes().length,
+        new ContextImpl(), 200));
+    assertNull(V8.Check(-1, params.getBytes(), params.getBytes().length, new ContextImpl(), 200));
+  }
+
   @Test
   public void PluginLog() {
     List<String[]> scripts = new ArrayList<String[]>();
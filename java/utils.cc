@@ -25,8 +25,8 @@ JavaVM* jvm = nullptr;
 V8Class v8_class;
 ContextClass ctx_class;
 bool is_initialized = false;
-Snapshot* snapshot = nullptr;
-std::mutex snapshot_mtx;
+std::shared_ptr<Snapshot> snapshot;
+std::atomic<uint64_t> snapshot_timestamp{0};
 thread_local PerThreadRuntime per_thread_runtime;
 
 void plugin_log(JNIEnv* env, const std::string& message) {
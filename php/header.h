@@ -19,7 +19,10 @@
 #include "base/bundle.h"
 
 namespace openrasp {
+using openrasp_v8::CheckPointRegistry;
 using openrasp_v8::Initialize;
+using openrasp_v8::MemoryProfile;
+using openrasp_v8::Metrics;
 using openrasp_v8::NewV8String;
 using openrasp_v8::Platform;
 using openrasp_v8::PluginFile;